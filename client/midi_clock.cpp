@@ -0,0 +1,185 @@
+//*****************************************//
+//  midi_clock.cpp
+//
+//  Tempo measurement and regeneration of
+//  MIDI clock ticks (see midi_clock.h).
+//
+//*****************************************//
+
+#include "midi_clock.h"
+
+#define CLOCK_GAP_US 250000     // a longer pause between ticks starts a new measurement
+#define CLOCK_TEMPO_CHANGE 64   // send early when the period moves by more than 1/64
+#define CLOCK_MARGIN_US 2000    // play ticks this much behind the least delayed update
+#define CLOCK_RELAX_US 50       // per update, lets the offset follow drift and route changes
+#define CLOCK_RESYNC_TICKS 4    // phase errors beyond this many ticks are jumped, not steered
+#define CLOCK_STEER 8           // the period is steered by at most 1/8
+
+ClockMeter::ClockMeter()
+    : count_(0), since_(0), sent_(0), period_(0)
+{
+}
+
+bool ClockMeter::tick(uint64_t now, ClockUpdate &update)
+{
+    if (count_ > since_ && now - times_[(count_ - 1) % (CLOCK_WINDOW + 1)] > CLOCK_GAP_US)
+        since_ = count_;
+    times_[count_ % (CLOCK_WINDOW + 1)] = now;
+    uint32_t tick = count_++;
+
+    // Average over the last beat, or what there is of it so far
+    uint32_t n = tick - since_;
+    if (n == 0) {
+        // No tempo yet, but the receiver has to play this tick: it is the
+        // downbeat after a Start. Send it with the last period known.
+        sent_ = tick;
+        update.tick = tick;
+        update.period = period_;
+        update.time = (uint32_t)now;
+        return true;
+    }
+    if (n > CLOCK_WINDOW)
+        n = CLOCK_WINDOW;
+    uint64_t span = now - times_[(tick - n) % (CLOCK_WINDOW + 1)];
+    uint32_t period = (uint32_t)(span * 256 / n);
+
+    uint32_t change = period > period_ ? period - period_ : period_ - period;
+    bool first = sent_ <= since_;
+    if (!first && tick - sent_ < CLOCK_UPDATE_TICKS &&
+            (tick - sent_ < 2 || change <= period_ / CLOCK_TEMPO_CHANGE))
+        return false;
+    sent_ = tick;
+    period_ = period;
+    update.tick = tick;
+    update.period = period;
+    update.time = (uint32_t)now;
+    return true;
+}
+
+void ClockMeter::transport(uint64_t now, ClockUpdate &update) const
+{
+    update.tick = count_;
+    update.period = period_;
+    update.time = (uint32_t)now;
+}
+
+ClockGenerator::ClockGenerator()
+    : running_(false), synced_(false), offset_(0), next_(0), limit_(0), nextDue_(0), period_(0)
+{
+}
+
+void ClockGenerator::update(const ClockUpdate &update, uint64_t now)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // Sender to local time: keep the smallest offset, creeping up slowly
+    uint32_t measured = (uint32_t)now - update.time;
+    if (!synced_ || (int32_t)(measured - offset_) < 0 || measured - offset_ <= CLOCK_RELAX_US)
+        offset_ = measured;
+    else
+        offset_ += CLOCK_RELAX_US;
+    synced_ = true;
+
+    uint32_t local = update.time + offset_ + CLOCK_MARGIN_US;
+    double at = (double)now + (int32_t)(local - (uint32_t)now);
+    double period = update.period / 256.0;
+    limit_ = update.tick + CLOCK_HOLDOVER_TICKS;
+    if (!running_ || period <= 0 || period_ <= 0) {
+        restart(update.tick, at, period);
+        return;
+    }
+
+    // Where our own schedule put that tick
+    double ours = nextDue_ - (double)(int32_t)(next_ - update.tick) * period_;
+    double error = at - ours;
+    if (error > CLOCK_RESYNC_TICKS * period || error < -CLOCK_RESYNC_TICKS * period) {
+        restart(update.tick, at, period);
+        return;
+    }
+    // Close half the phase error before the next update is due
+    double steer = error / (2 * CLOCK_UPDATE_TICKS);
+    if (steer > period / CLOCK_STEER)
+        steer = period / CLOCK_STEER;
+    else if (steer < -period / CLOCK_STEER)
+        steer = -period / CLOCK_STEER;
+    period_ = period + steer;
+}
+
+// Play tick itself at local time at, then carry on at period
+void ClockGenerator::restart(uint32_t tick, double at, double period)
+{
+    running_ = true;
+    period_ = period > 0 ? period : 0;
+    next_ = tick;
+    nextDue_ = at;
+    if (period <= 0)
+        limit_ = tick;      // tempo unknown: just this tick until the next update
+}
+
+void ClockGenerator::transport(const ClockUpdate &update, const unsigned char *msg, size_t n,
+                               uint64_t now)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    Transport t;
+    t.tick = update.tick;
+    t.at = (double)now;
+    if (synced_) {
+        uint32_t local = update.time + offset_ + CLOCK_MARGIN_US;
+        t.at += (int32_t)(local - (uint32_t)now);
+    }
+    t.message.assign(msg, msg + n);
+    transport_.push_back(t);
+}
+
+/*
+ * Right before its tick while the clock runs (at once if that tick is
+ * already out), else at its own sender time mapped like an update's.
+ */
+double ClockGenerator::transportDue(const Transport &t) const
+{
+    if (!running_)
+        return t.at;
+    if ((int32_t)(t.tick - next_) < 0)
+        return 0;
+    return nextDue_ + (double)(t.tick - next_) * period_;
+}
+
+uint64_t ClockGenerator::nextDue()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    bool ticking = running_ && (int32_t)(next_ - limit_) <= 0;
+    if (!ticking && transport_.empty())
+        return 0;
+    double due = ticking ? nextDue_ : transportDue(transport_.front());
+    if (ticking && !transport_.empty() && transportDue(transport_.front()) < due)
+        due = transportDue(transport_.front());
+    return due < 1 ? 1 : (uint64_t)due;
+}
+
+bool ClockGenerator::due(uint64_t now, std::vector<unsigned char> &message)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_ && (int32_t)(next_ - limit_) > 0) {
+        // No word from the sender for a beat: its clock has stopped
+        running_ = false;
+    }
+    if (!transport_.empty() && (double)now >= transportDue(transport_.front())) {
+        message.swap(transport_.front().message);
+        transport_.pop_front();
+        return true;
+    }
+    if (!running_ || (double)now < nextDue_)
+        return false;
+    next_++;
+    nextDue_ += period_;
+    message.assign(1, MIDI_CLOCK);
+    return true;
+}
+
+void ClockGenerator::reset()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+    synced_ = false;
+    transport_.clear();
+}
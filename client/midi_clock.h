@@ -0,0 +1,118 @@
+/*
+ * midi_clock.h
+ *
+ *  MIDI clock transport. ClockMeter runs on the sending side: it is fed
+ *  the 24 ppqn clock ticks (0xF8) as they arrive and produces the tempo
+ *  and phase updates that travel as FRAME_CLOCK. ClockGenerator runs on
+ *  the receiving side: it turns those updates back into evenly spaced
+ *  ticks on the local clock, so network jitter never reaches the tempo.
+ *
+ *  The generator maps sender time to local time through the smallest
+ *  offset seen between the two (the least delayed update), steers its
+ *  tick period to close any phase error over the next update interval,
+ *  and runs at most CLOCK_HOLDOVER_TICKS past the last update: a sender
+ *  that stops its clock or goes away stops the regenerated one too.
+ *
+ *  Start, Stop, Continue and Song Position are tagged with the index of
+ *  the tick they precede and come out of the generator right before that
+ *  tick, so the slave's downbeat lands on the regenerated timeline rather
+ *  than wherever network jitter put the message.
+ */
+
+#ifndef MIDI_CLOCK_H_
+#define MIDI_CLOCK_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#define MIDI_CLOCK 0xF8
+#define MIDI_SONG_POSITION 0xF2
+#define MIDI_START 0xFA
+#define MIDI_CONTINUE 0xFB
+#define MIDI_STOP 0xFC
+#define CLOCK_WINDOW 24         // ticks averaged for the tempo, one beat
+#define CLOCK_UPDATE_TICKS 6    // ticks between updates at a steady tempo
+#define CLOCK_HOLDOVER_TICKS 12 // ticks regenerated past the last update
+
+/* One FRAME_CLOCK body, plus the sender time that goes in the header */
+struct ClockUpdate {
+    uint32_t tick;          // ticks counted since the sender's clock started
+    uint32_t period;        // tick period in 1/256 us
+    uint32_t time;          // sender time of that tick (us, wraps)
+};
+
+/* Transport messages that travel in FRAME_CLOCK, after the update fields */
+inline bool midi_is_transport(const unsigned char *msg, size_t n)
+{
+    if (n == 1)
+        return msg[0] == MIDI_START || msg[0] == MIDI_CONTINUE || msg[0] == MIDI_STOP;
+    return n == 3 && msg[0] == MIDI_SONG_POSITION;
+}
+
+class ClockMeter {
+public:
+    ClockMeter();
+
+    /*
+     * One tick at time now (us). Returns true if update should be sent.
+     * The first tick of a run is always sent, with the last known period.
+     */
+    bool tick(uint64_t now, ClockUpdate &update);
+
+    /* Update to carry a transport message: it precedes the next tick */
+    void transport(uint64_t now, ClockUpdate &update) const;
+
+private:
+    uint64_t times_[CLOCK_WINDOW + 1];  // arrival times, by tick count
+    uint32_t count_;        // ticks seen
+    uint32_t since_;        // tick count at the start of the current run
+    uint32_t sent_;         // tick count of the last update
+    uint32_t period_;       // period in the last update
+};
+
+class ClockGenerator {
+public:
+    ClockGenerator();
+
+    /* Apply an update that arrived at local time now (us) */
+    void update(const ClockUpdate &update, uint64_t now);
+
+    /* Queue a transport message that arrived at now to emit right before its tick */
+    void transport(const ClockUpdate &update, const unsigned char *msg, size_t n, uint64_t now);
+
+    /* Local time the next tick or transport message is due (us), 0 if none */
+    uint64_t nextDue();
+
+    /*
+     * True if a tick or transport message is due at now; message is then
+     * set to what the caller should emit.
+     */
+    bool due(uint64_t now, std::vector<unsigned char> &message);
+
+    void reset();
+
+private:
+    struct Transport {
+        uint32_t tick;      // sender tick count it precedes
+        double at;          // local time of the message, if the clock is not running
+        std::vector<unsigned char> message;
+    };
+
+    void restart(uint32_t tick, double at, double period);
+    double transportDue(const Transport &t) const;
+
+    std::mutex mutex_;
+    bool running_;
+    bool synced_;           // offset_ is valid
+    uint32_t offset_;       // local minus sender time of the least delayed update
+    uint32_t next_;         // sender tick count of the next tick
+    uint32_t limit_;        // last tick count allowed without a newer update
+    double nextDue_;        // local time of the next tick (us)
+    double period_;         // current local period (us)
+    std::deque<Transport> transport_;   // waiting for their tick
+};
+
+#endif /* MIDI_CLOCK_H_ */
@@ -2,20 +2,21 @@
 //  midiclient.cpp
 //  by John Fu, 2015.
 //
-//  Simple program to echo MIDI input to 
-//  MIDI output.
+//  Streams MIDI input to the relay server
+//  and plays what the room sends to MIDI
+//  output.
 //
-//  compile with: 
-//  g++ -g -std=c++11 -Wall -D__LINUX_ALSA__ -o 
-//  midiclient midiclient.cpp rtmidi/RtMidi.cpp -lasound -pthread
+//  compile with: make midiclient
 //
 //*****************************************//
 
 /* Standard */
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
 #include <vector>
 #include <string>
+#include <unistd.h>
 
 /* Threading */
 #include <signal.h>
@@ -25,33 +26,40 @@
 #include "RtMidi.h"
 
 /* Networking */
-#include "simple_client.h"
+#include "session.h"
+#include "event_notifier.h"
+
+/* Processing */
+#include "midi_pipeline.h"
+#include "midi_log.h"
 
 /* DEFS */
 #define PORT "3490" // the port client will be connecting to
 #define MAXDATASIZE 100 // max number of bytes we can get at once
+#define CC_WINDOW_US 10000 // controller sweeps are thinned to one value per 10ms
+#define SYSEX_PART_BYTES 4096 // SysEx dumps are streamed in parts of this size
 
-// Platform-dependent sleep routines.
-#if defined(__WINDOWS_MM__)
-#include <windows.h>
-#define SLEEP( milliseconds ) Sleep( (DWORD) milliseconds )
-#else // Unix variants
-#include <unistd.h>
-#define SLEEP( milliseconds ) usleep( (unsigned long) (milliseconds * 1000.0) )
-#endif
-
-// Interrupt handler logic
-bool done;
-static void finish(int ignore){ done = true; }
-
-// Number of client threads
-static const int NUM_THREADS = 10;
+// Interrupt handler logic. The handler may run on any thread, so it
+// wakes main through an eventfd rather than relying on pause().
+volatile sig_atomic_t done;
+static EventNotifier *interrupted = 0;
+static void finish(int ignore){ done = true; if ( interrupted ) interrupted->signal(); }
 
 void usage( void ) {
 	// Error function in case of incorrect command-line
 	// argument specifications.
-	std::cout << "\n message: cmidiin <port>\n";
-	std::cout << "    where port = the device to use (default = 0).\n\n";
+	std::cout << "\n usage: midiclient [-c channel] [-t semitones] [-d] [-k curve] [-v] [-x] [-m] [-b seconds] hostname [room]\n";
+	std::cout << "        midiclient -e [-c channel] [-t semitones] [-d] [-k curve] [-v] [-x] [-m]\n";
+	std::cout << "    where room = the relay room to join (default = lobby),\n";
+	std::cout << "          -c = only pass this channel (1-16),\n";
+	std::cout << "          -t = transpose notes by this many semitones,\n";
+	std::cout << "          -d = drop notes transposed out of range (default clamps),\n";
+	std::cout << "          -k = velocity curve: lin, log or exp,\n";
+	std::cout << "          -b = start this many seconds back in the room (server journal),\n";
+	std::cout << "          -v = log every message,\n";
+	std::cout << "          -x = pass SysEx through (sent behind notes while streaming),\n";
+	std::cout << "          -m = pass MIDI clock through (sent as tempo, regenerated locally),\n";
+	std::cout << "          -e = echo input to output locally instead of streaming.\n\n";
 	exit( 0 );
 }
 
@@ -111,35 +119,89 @@ bool chooseMidiPort( RtMidiIn *rtmidiin, RtMidiOut *rtmidiout )
 }
 
 /**
-  Receives MIDI from midiin and transmits it out of midiout.
-  Shift is the number of semitones you want the output to be.
+  Per-message processing shared by the echo and streaming paths. Runs on
+  the MIDI input thread: it runs the pipeline in place, logs through the
+  asynchronous ring and never allocates or touches the console.
  */
-void echo( RtMidiIn *midiin, RtMidiOut *midiout, int shift )
+struct InputStage {
+	Session *session;       // streaming mode
+	RtMidiOut *midiout;     // local echo mode
+	MidiPipeline pipeline;
+	MidiLog *log;           // 0 when not logging
+};
+
+/**
+  Transforms message in place. Returns false if it should be dropped.
+ */
+static bool process( InputStage *stage, double stamp, std::vector<unsigned char> *message )
 {
-	// Gather incoming MIDI note and generate output MIDI note of the same size
-	std::vector<unsigned char> input;
-	unsigned int stamp = midiin->getMessage( &input );
-	unsigned int nBytes = input.size();
-	std::vector<unsigned char> output(nBytes);
-
-	// Shift the tones
-	for ( unsigned int i=0; i<nBytes; i++ ) {
-		if (i == 1)
-			output[i] = (int)input[i] + shift;
-		else
-			output[i] = input[i];
-		std::cout << (int)input[i] << ", ";
-		std::cout << (int)output[i] << ", ";
-	}
-	if ( nBytes > 0 ) {
-		std::cout << "stamp = " << stamp << std::endl;
+	size_t nBytes = message->size();
+	if ( nBytes == 0 ) return false;
+	unsigned char *bytes = &( *message )[0];
+
+	unsigned char input[MIDI_LOG_MAX_BYTES];
+	if ( stage->log )
+		memcpy( input, bytes, nBytes < sizeof input ? nBytes : sizeof input );
+
+	bool keep = stage->pipeline.apply( bytes, nBytes );
+
+	if ( stage->log )
+		stage->log->record( stamp, input, nBytes, bytes, keep ? nBytes : 0 );
+	return keep;
+}
+
+/**
+  RtMidiIn callback for local echo: receives MIDI from midiin and
+  transmits what survives the pipeline out of midiout.
+  The message buffer belongs to RtMidi and is reused for every event,
+  so the transform works on it directly.
+ */
+void echo( double stamp, std::vector<unsigned char> *message, void *userData )
+{
+	InputStage *stage = static_cast<InputStage *>( userData );
+	if ( process( stage, stamp, message ) )
+		stage->midiout->sendMessage( message );
+}
+
+/**
+  RtMidiIn callback for streaming. Hands the processed message straight
+  to the session's sender ring; nothing here blocks.
+ */
+void midiInputCallback( double deltatime, std::vector<unsigned char> *message, void *userData )
+{
+	InputStage *stage = static_cast<InputStage *>( userData );
+	if ( process( stage, deltatime, message ) )
+		stage->session->send( *message );
+}
+
+/**
+  RtMidiIn SysEx callback for streaming (-x). Dumps arrive in parts of
+  about SYSEX_PART_BYTES and go to the session's SysEx ring as they come.
+  Only one port is open, so parts of different messages never interleave.
+  A part that starts with F0 begins a new message: the driver drops an
+  unterminated one without telling us, and the next dump must not be
+  appended to it.
+ */
+void sysexInputCallback( double deltatime, unsigned int source, const RtMidiIn::SysexSegment *segments,
+                         unsigned int count, bool complete, void *userData )
+{
+	InputStage *stage = static_cast<InputStage *>( userData );
+	for ( unsigned int i = 0; i < count; i++ ) {
+		bool begin = i == 0 && segments[i].size > 0 && segments[i].data[0] == 0xF0;
+		bool end = complete && i + 1 == count;
+		stage->session->sendSysex( segments[i].data, segments[i].size, begin, end );
 	}
-	midiout->sendMessage( &output );
 }
 
-// This function will be called from a thread
-void call_from_thread(int tid) {
-	std::cout << "Launched by thread " << tid << std::endl;
+/**
+  Playout stage: sleeps until the session has received something and
+  plays it out of midiout. Returns once the session is stopped.
+ */
+void playout( Session *session, RtMidiOut *midiout )
+{
+	std::vector<unsigned char> message;
+	while ( session->receive( message, -1 ) )
+		midiout->sendMessage( &message );
 }
 
 int main( int argc, char *argv[] )
@@ -148,12 +210,57 @@ int main( int argc, char *argv[] )
 	RtMidiIn *midiin = 0;
 	RtMidiOut *midiout = 0;
 
-	// Store data received from the server
-	int server_sockfd = 0;
-	std::string rcvdata;
+	// Connection to the server
+	Session *session = 0;
+	SessionConfig config;
+	std::thread player;
+	EventNotifier interrupt;
+
+	// Input processing
+	InputStage stage;
+	stage.session = 0;
+	stage.midiout = 0;
+	stage.log = 0;
+	int channel = 0, shift = 0;
+	TransposeRange range = TRANSPOSE_CLAMP;
+	VelocityShape curve = VELOCITY_LINEAR;
+	MidiLog *log = 0;
+	bool local = false;
+	bool verbose = false;
+	bool sysex = false;
+	bool clock = false;
+
+	int opt;
+	while ( ( opt = getopt( argc, argv, "c:t:dk:veb:xm" ) ) != -1 ) {
+		switch ( opt ) {
+		case 'c': channel = atoi( optarg ); break;
+		case 't': shift = atoi( optarg ); break;
+		case 'd': range = TRANSPOSE_DROP; break;
+		case 'k':
+			if ( !strcmp( optarg, "log" ) ) curve = VELOCITY_LOG;
+			else if ( !strcmp( optarg, "exp" ) ) curve = VELOCITY_EXP;
+			else if ( strcmp( optarg, "lin" ) ) usage();
+			break;
+		case 'v': verbose = true; break;
+		case 'e': local = true; break;
+		case 'x': sysex = true; break;
+		case 'm': clock = true; break;
+		case 'b': config.rewindMs = atoi( optarg ) * 1000; break;
+		default: usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
 
 	// Minimal command-line check.
-	if ( argc > 2 ) usage();
+	if ( local ? argc != 0 : ( argc < 1 || argc > 2 ) ) usage();
+	if ( channel < 0 || channel > 16 ) usage();
+	if ( verbose ) stage.log = log = new MidiLog();
+
+	// Build the input pipeline once, before any callback runs.
+	if ( channel ) stage.pipeline.channelFilter( channel );
+	stage.pipeline.transpose( shift, range );
+	if ( curve != VELOCITY_LINEAR ) stage.pipeline.velocityCurve( curve );
 
 	try {
 		// This function should be embedded in a try/catch block in case of
@@ -170,37 +277,38 @@ int main( int argc, char *argv[] )
 
 		// Don't ignore sysex, timing, or active sensing messages.
 		//midiin->ignoreTypes( false, false, false );
+		if ( sysex || clock ) midiin->ignoreTypes( !sysex, !clock, true );
 
 		// Install an interrupt handler function.
 		done = false;
+		interrupted = &interrupt;
 		(void) signal(SIGINT, finish);
 
-		// Periodically check input queue.
-		std::cout << "\nReading MIDI from port ... quit with Ctrl-C.\n";
-
-		//    // Create 2 threads, one for input, one for output
-		//    std::thread t_array[2];
-		//
-		//    for (int i = 0; i < NUM_THREADS; i++) {
-		//    	std::thread(call_from_thread, i);
-		//    }
-
-		// Connect to the server
-		server_sockfd = connect_to_server(argc, argv);
-
-		// Echo input to output
-		while ( !done ) {
-//			echo( midiin, midiout, 4);
-			std::cout << "Got into loop" << std::endl;
-			std::string teststr = "shit";
-			send_to_server(teststr, server_sockfd);
-			rcvdata = recv_from_server(server_sockfd);
-			if (!rcvdata.empty()) {
-				std::cout << "client: received " << rcvdata << std::endl;
-			}
-//			buf = recv_from_server(server_sockfd);
-//			std::cout << buf << std::endl;
+		if ( local ) {
+			// Pipeline: input callback -> transpose -> midiout.
+			stage.midiout = midiout;
+			midiin->setCallback( &echo, &stage );
+			std::cout << "\nEchoing MIDI ... quit with Ctrl-C.\n";
+		}
+		else {
+			// Connect to the server. The session reconnects by itself.
+			config.host = argv[0];
+			if ( argc == 2 ) config.room = argv[1];
+			config.coalesceUs = CC_WINDOW_US;
+			config.clock = clock;
+			session = new Session( config );
+			session->start();
+
+			// Pipeline: input callback -> sender thread -> network,
+			// network -> receiver thread -> playout thread -> midiout.
+			stage.session = session;
+			player = std::thread( playout, session, midiout );
+			midiin->setCallback( &midiInputCallback, &stage );
+			if ( sysex ) midiin->setSysexCallback( &sysexInputCallback, &stage, SYSEX_PART_BYTES );
+			std::cout << "\nStreaming MIDI ... quit with Ctrl-C.\n";
 		}
+		while ( !done )
+			interrupt.wait( -1 );
 
 	} catch ( RtMidiError &error ) {
 		error.printMessage();
@@ -208,9 +316,19 @@ int main( int argc, char *argv[] )
 
 	clean_up:
 		std::cout << "\nCleaning Up.\n";
-		cleanup(server_sockfd);
+		// Stop input first so the callback never sees a dead session
 		delete midiin;
+		if ( session ) session->stop();
+		if ( player.joinable() ) player.join();
+		if ( session ) {
+			// Note offs the session produced while stopping
+			std::vector<unsigned char> message;
+			while ( session->receive( message, 0 ) )
+				midiout->sendMessage( &message );
+		}
+		delete session;
 		delete midiout;
+		delete log;
 		return 0;
 }
 
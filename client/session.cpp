@@ -0,0 +1,751 @@
+//*****************************************//
+//  session.cpp
+//
+//  Reconnecting, heartbeating relay session
+//  with independent send and receive threads.
+//
+//*****************************************//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <utility>
+#include "midi_util.h"
+#include "simple_client.h"
+#include "session.h"
+
+#define RESEND_FRAMES 1024      // sent frames kept for resume
+#define RECV_CHUNK 4096
+#define SYSEX_TRANSFERS 16      // incoming transfers reassembled at once
+#define SYSEX_RETRY_MS 5        // wait while SysEx waits for the socket to drain
+#define RESUME_WINDOW_MS 30000  // how long the server keeps a dropped session
+#define CLIENT_CAPS (CAP_SNAPSHOT | CAP_RESUME | CAP_HEARTBEAT | CAP_CATCHUP | CAP_SYSEX)
+
+Session::Session(const SessionConfig &config)
+    : config_(config), running_(false), outRing_(config.ringBytes), sysexRing_(config.ringBytes),
+      inRing_(config.ringBytes), overruns_(0), sysexInBytes_(0), fd_(-1), generation_(0),
+      session_(0), token_(0), lastSeq_(0), nextSeq_(1), caps_(0), lastSent_(0), sysexBytes_(0),
+      coalescer_(config.coalesceUs), transfer_(0), transferOpen_(false)
+{
+}
+
+Session::~Session()
+{
+    stop();
+}
+
+void Session::start()
+{
+    if (running_)
+        return;
+    running_ = true;
+    stopNotify_.clear();
+    receiver_ = std::thread(&Session::recvLoop, this);
+    sender_ = std::thread(&Session::sendLoop, this);
+}
+
+void Session::stop()
+{
+    if (!running_)
+        return;
+    running_ = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (fd_ >= 0)
+            shutdown(fd_, SHUT_RDWR);
+    }
+    stopNotify_.signal();
+    outNotify_.signal();
+    inNotify_.signal();
+    if (sender_.joinable())
+        sender_.join();
+    if (receiver_.joinable())
+        receiver_.join();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (fd_ >= 0) {
+        cleanup(fd_);
+        fd_ = -1;
+    }
+}
+
+bool Session::connected()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return fd_ >= 0;
+}
+
+bool Session::send(const unsigned char *message, size_t n)
+{
+    if (n == 0)
+        return false;
+    if (message[0] == 0xF0 && n > WIRE_SYSEX_CHUNK)
+        return sendSysex(message, n, true, true);
+    bool pushed;
+    if (config_.clock && ((n == 1 && message[0] == MIDI_CLOCK) || midi_is_transport(message, n))) {
+        // Stamped here, on the MIDI input thread, for the tempo measurement
+        uint64_t now = monotonic_us();
+        pushed = outRing_.push(message, n, &now, sizeof now);
+    } else {
+        pushed = outRing_.push(message, n);
+    }
+    if (!pushed) {
+        overruns_++;
+        return false;
+    }
+    outNotify_.notify();
+    return true;
+}
+
+bool Session::sendSysex(const unsigned char *data, size_t n, bool begin, bool end)
+{
+    unsigned char flags = (begin ? SYSEX_BEGIN : 0) | (end ? SYSEX_END : 0);
+    if (!sysexRing_.push(&flags, 1, data, n)) {
+        overruns_++;
+        return false;
+    }
+    outNotify_.notify();
+    return true;
+}
+
+bool Session::receive(std::vector<unsigned char> &message, int timeoutMs)
+{
+    uint64_t deadline = monotonic_us() + (uint64_t)(timeoutMs > 0 ? timeoutMs : 0) * 1000;
+    for (;;) {
+        if (pop(message))
+            return true;
+        uint64_t now = monotonic_us();
+        if (running_ && clock_.due(now, message))
+            return true;
+        if (timeoutMs >= 0 && now >= deadline)
+            return false;
+
+        // Sleep until something arrives, the next tick is due or the timeout
+        uint64_t wake = clock_.nextDue();
+        if (timeoutMs >= 0 && (!wake || deadline < wake))
+            wake = deadline;
+        inNotify_.arm();
+        if (pending() || !running_) {
+            inNotify_.disarm();
+            if (!running_)
+                return pop(message);
+            continue;
+        }
+        inNotify_.waitUs(!wake ? -1 : wake > now ? (int64_t)(wake - now) : 0);
+    }
+}
+
+// Anything for pop(), from the receiver thread
+bool Session::pending()
+{
+    if (!inRing_.empty())
+        return true;
+    std::lock_guard<std::mutex> lock(sysexInMutex_);
+    return !sysexIn_.empty();
+}
+
+// Next message for receive(): the ring first, then oversized SysEx
+bool Session::pop(std::vector<unsigned char> &message)
+{
+    if (inRing_.pop(message))
+        return true;
+    std::lock_guard<std::mutex> lock(sysexInMutex_);
+    if (sysexIn_.empty())
+        return false;
+    message.swap(sysexIn_.front());
+    sysexIn_.pop_front();
+    sysexInBytes_ -= message.size();
+    return true;
+}
+
+// Blocking write of a whole buffer
+static bool write_all(int fd, const std::vector<unsigned char> &bytes)
+{
+    size_t done = 0;
+    while (done < bytes.size()) {
+        ssize_t n = ::send(fd, &bytes[done], bytes.size() - done, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+/*
+ * Write a batch of encoded frames to the connection the sender picked up
+ * as generation gen. Fails without writing if that connection has been
+ * dropped in the meantime, since its fd number may already be reused.
+ */
+bool Session::writeFrames(int fd, unsigned long gen, const std::vector<unsigned char> &bytes)
+{
+    std::lock_guard<std::mutex> lock(writeMutex_);
+    {
+        std::lock_guard<std::mutex> state(mutex_);
+        if (gen != generation_)
+            return false;
+    }
+    return write_all(fd, bytes);
+}
+
+// Wrap one message into a sequenced frame for the server. Sender thread.
+void Session::queueFrame(const unsigned char *message, size_t n, uint64_t now)
+{
+    WireFrame frame;
+    frame.type = FRAME_MIDI;
+    frame.time = (uint32_t)now;
+    frame.body.assign(message, message + n);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::deque<WireFrame> &queue = outgoing_[send_class(frame)];
+    if (queue.size() >= config_.maxPending)
+        queue.pop_front();
+    queue.push_back(WireFrame());
+    std::swap(queue.back(), frame);
+}
+
+/*
+ * Split one part handed over by sendSysex() into transfer chunks. When
+ * the SysEx backlog is full the rest of the transfer is dropped; the
+ * receivers discard the part they have. Sender thread.
+ */
+void Session::queueSysex(const unsigned char *part, size_t n, unsigned char flags, uint64_t now)
+{
+    if (flags & SYSEX_BEGIN) {
+        if (++transfer_ == 0)
+            transfer_ = 1;
+        transferOpen_ = true;
+    }
+    if (!transferOpen_)
+        return;
+    if (flags & SYSEX_END)
+        transferOpen_ = false;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (sysexBytes_ + n > config_.maxSysexBytes) {
+        transferOpen_ = false;
+        overruns_++;
+        return;
+    }
+    size_t done = 0;
+    do {
+        size_t chunk = n - done < WIRE_SYSEX_CHUNK ? n - done : WIRE_SYSEX_CHUNK;
+        outgoing_[SEND_BULK].push_back(WireFrame());
+        WireFrame &frame = outgoing_[SEND_BULK].back();
+        frame.type = FRAME_SYSEX;
+        if (done == 0)
+            frame.flags |= flags & SYSEX_BEGIN;
+        if (done + chunk == n)
+            frame.flags |= flags & SYSEX_END;
+        frame.time = (uint32_t)now;
+        frame.body.resize(4 + chunk);
+        wire_put32(&frame.body[0], transfer_);
+        if (chunk)
+            memcpy(&frame.body[4], part + done, chunk);
+        done += chunk;
+        sysexBytes_ += chunk;
+    } while (done < n);
+}
+
+/*
+ * Measure the tempo from a clock tick send() stamped at time at. Servers
+ * that don't pass FRAME_CLOCK on get the tick itself. Sender thread.
+ */
+void Session::queueClock(uint64_t at, uint64_t now)
+{
+    bool transport;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        transport = caps_ & CAP_CLOCK;
+    }
+    if (!transport) {
+        unsigned char tick = MIDI_CLOCK;
+        queueFrame(&tick, 1, now);
+        return;
+    }
+
+    ClockUpdate update;
+    if (meter_.tick(at, update))
+        queueClockFrame(update, NULL, 0);
+}
+
+/*
+ * Start, Stop, Continue or Song Position received at time at: tagged with
+ * the tick it precedes so the receiver plays it on its regenerated
+ * timeline. Sender thread.
+ */
+void Session::queueTransport(const unsigned char *msg, size_t n, uint64_t at, uint64_t now)
+{
+    bool transport;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        transport = caps_ & CAP_CLOCK;
+    }
+    if (!transport) {
+        queueFrame(msg, n, now);
+        return;
+    }
+    ClockUpdate update;
+    meter_.transport(at, update);
+    queueClockFrame(update, msg, n);
+}
+
+// A FRAME_CLOCK behind everything realtime already queued. Sender thread.
+void Session::queueClockFrame(const ClockUpdate &update, const unsigned char *msg, size_t n)
+{
+    WireFrame frame;
+    frame.type = FRAME_CLOCK;
+    frame.time = update.time;
+    frame.body.resize(8);
+    wire_put32(&frame.body[0], update.tick);
+    wire_put32(&frame.body[4], update.period);
+    frame.body.insert(frame.body.end(), msg, msg + n);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::deque<WireFrame> &queue = outgoing_[SEND_REALTIME];
+    if (queue.size() >= config_.maxPending)
+        queue.pop_front();
+    queue.push_back(WireFrame());
+    std::swap(queue.back(), frame);
+}
+
+// Move everything handed over by send() through the coalescer. Sender thread.
+void Session::drainInput(uint64_t now)
+{
+    while (outRing_.pop(scratch_)) {
+        size_t n = scratch_.size() - sizeof now;
+        if (config_.clock && scratch_.size() > sizeof now &&
+                ((n == 1 && scratch_[0] == MIDI_CLOCK) || midi_is_transport(&scratch_[0], n))) {
+            uint64_t at;
+            memcpy(&at, &scratch_[n], sizeof at);
+            if (scratch_[0] == MIDI_CLOCK)
+                queueClock(at, now);
+            else
+                queueTransport(&scratch_[0], n, at, now);
+            continue;
+        }
+        if (coalescer_.offer(&scratch_[0], scratch_.size(), now))
+            queueFrame(&scratch_[0], scratch_.size(), now);
+    }
+    while (sysexRing_.pop(scratch_))
+        queueSysex(scratch_.data() + 1, scratch_.size() - 1, scratch_[0], now);
+
+    std::vector<CoalescedMessage> due;
+    coalescer_.flush(now, due);
+    for (size_t i = 0; i < due.size(); i++)
+        queueFrame(due[i].bytes, 3, now);
+}
+
+/*
+ * Encode the front of queue and keep it for resend. Frames are numbered
+ * as they are written, since SysEx chunks queued earlier may go out after
+ * later channel messages. Caller holds mutex_.
+ */
+void Session::takeFrame(std::deque<WireFrame> &queue, std::vector<unsigned char> &bytes)
+{
+    WireFrame &frame = queue.front();
+    if (frame.seq == 0)
+        frame.seq = nextSeq_++;
+    wire_encode(bytes, frame);
+    if (unacked_.size() >= RESEND_FRAMES)
+        unacked_.pop_front();
+    unacked_.push_back(WireFrame());
+    std::swap(unacked_.back(), frame);
+    queue.pop_front();
+}
+
+void Session::sendLoop()
+{
+    std::vector<unsigned char> bytes;
+    while (running_) {
+        int fd;
+        unsigned long gen;
+        bool ping = false;
+        bool throttled = false;
+        bool more = false;
+        uint64_t now = monotonic_us();
+        uint64_t heartbeat = (uint64_t)config_.heartbeatMs * 1000;
+        uint64_t wake;
+
+        drainInput(now);
+        bytes.clear();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            fd = fd_;
+            gen = generation_;
+            if (fd >= 0) {
+                // One deficit round-robin round per pass
+                for (int cls = 0; cls < SEND_CLASSES; cls++) {
+                    std::deque<WireFrame> &queue = outgoing_[cls];
+                    if (queue.empty()) {
+                        drr_.idle(cls);
+                        continue;
+                    }
+                    if (cls == SEND_BULK && wire_unsent(fd) >= WIRE_SYSEX_BACKLOG) {
+                        throttled = true;
+                        continue;
+                    }
+                    drr_.grant(cls);
+                    while (!queue.empty()) {
+                        WireFrame &frame = queue.front();
+                        if (frame.type == FRAME_SYSEX && !(caps_ & CAP_SYSEX)) {
+                            // Not for this server; it would drop us for it
+                            sysexBytes_ -= frame.body.size() - 4;
+                            queue.pop_front();
+                            overruns_++;
+                            continue;
+                        }
+                        size_t size = WIRE_HEADER_SIZE + frame.body.size();
+                        if ((long)size > drr_.credit(cls))
+                            break;
+                        drr_.charge(cls, size);
+                        if (frame.type == FRAME_SYSEX)
+                            sysexBytes_ -= frame.body.size() - 4;
+                        takeFrame(queue, bytes);
+                    }
+                    if (!queue.empty())
+                        more = true;
+                }
+                if (bytes.empty() && now - lastSent_ >= heartbeat)
+                    ping = true;
+                if (!bytes.empty() || ping)
+                    lastSent_ = now;
+            }
+            wake = lastSent_ + heartbeat;
+        }
+
+        if (ping)
+            wire_encode(bytes, FRAME_PING, 0, 0, (uint32_t)now, NULL, 0);
+        if (!bytes.empty() && !writeFrames(fd, gen, bytes)) {
+            // Wake the receiver, which owns reconnecting
+            more = false;
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (gen == generation_)
+                shutdown(fd, SHUT_RDWR);
+        }
+
+        // Sleep until new input, the next heartbeat or a coalesced value is due
+        if (more)
+            continue;
+        uint64_t due = coalescer_.nextDue();
+        if (due && due < wake)
+            wake = due;
+        now = monotonic_us();
+        if (throttled && now + SYSEX_RETRY_MS * 1000 < wake)
+            wake = now + SYSEX_RETRY_MS * 1000;
+        int timeoutMs = wake <= now ? 0 : (int)((wake - now + 999) / 1000);
+        outNotify_.arm();
+        if (!outRing_.empty() || !sysexRing_.empty() || !running_) {
+            outNotify_.disarm();
+            continue;
+        }
+        outNotify_.wait(timeoutMs);
+    }
+}
+
+void Session::recvLoop()
+{
+    unsigned int delayMs = config_.backoffMinMs;
+    unsigned char buf[RECV_CHUNK];
+    uint64_t lastHeard = 0;
+    uint64_t lostAt = 0;
+
+    while (running_) {
+        int fd;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            fd = fd_;
+        }
+        if (fd < 0) {
+            // Held notes carry over a resume; once that is out of reach, let go
+            uint64_t now = monotonic_us();
+            if (!lostAt)
+                lostAt = now;
+            else if (now - lostAt > (uint64_t)RESUME_WINDOW_MS * 1000)
+                releaseNotes();
+            if (establish()) {
+                delayMs = config_.backoffMinMs;
+                lostAt = 0;
+                lastHeard = monotonic_us();
+                // Frames that arrived right behind the WELCOME
+                WireFrame frame;
+                while (reader_.next(frame))
+                    handleFrame(frame);
+                inNotify_.notify();
+            } else {
+                backoff(delayMs);
+            }
+            continue;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        int rv = poll(&pfd, 1, config_.heartbeatMs);
+        if (rv == -1 && errno != EINTR) {
+            disconnect("poll failed");
+            continue;
+        }
+        if (rv > 0) {
+            ssize_t n = recv(fd, buf, sizeof buf, 0);
+            if (n <= 0) {
+                if (n == 0 || (errno != EINTR && errno != EAGAIN))
+                    disconnect(n == 0 ? "closed by server" : "recv failed");
+                continue;
+            }
+            lastHeard = monotonic_us();
+            reader_.feed(buf, n);
+            WireFrame frame;
+            while (reader_.next(frame))
+                handleFrame(frame);
+            inNotify_.notify();
+        }
+        if (monotonic_us() - lastHeard > (uint64_t)config_.idleTimeoutMs * 1000)
+            disconnect("idle timeout");
+    }
+    releaseNotes();
+}
+
+// Connect and handshake. Runs on the receiver thread.
+bool Session::establish()
+{
+    int fd = connect_to_host(config_.host.c_str());
+    if (fd < 0)
+        return false;
+
+    WireHello hello;
+    hello.caps = CLIENT_CAPS | (config_.clock ? CAP_CLOCK : 0);
+    hello.room = config_.room;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        hello.session = session_;
+        hello.token = token_;
+        hello.lastSeq = lastSeq_;
+    }
+    std::vector<unsigned char> bytes;
+    if (hello.session == 0 && config_.rewindMs) {
+        // Ahead of the HELLO so it applies to the room it joins
+        unsigned char ms[4];
+        wire_put32(ms, config_.rewindMs);
+        wire_encode(bytes, FRAME_REWIND, 0, 0, (uint32_t)monotonic_us(), ms, sizeof ms);
+    }
+    WireFrame frame;
+    wire_encode_hello(frame, hello);
+    frame.time = (uint32_t)monotonic_us();
+    wire_encode(bytes, frame);
+    if (!write_all(fd, bytes)) {
+        cleanup(fd);
+        return false;
+    }
+
+    // The WELCOME is the first thing the server sends
+    reader_ = WireReader();
+    uint64_t deadline = monotonic_us() + (uint64_t)config_.idleTimeoutMs * 1000;
+    unsigned char buf[RECV_CHUNK];
+    WireWelcome welcome;
+    bool welcomed = false;
+    while (!welcomed && running_) {
+        uint64_t now = monotonic_us();
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (now >= deadline || poll(&pfd, 1, (int)((deadline - now) / 1000) + 1) <= 0)
+            break;
+        ssize_t n = recv(fd, buf, sizeof buf, 0);
+        if (n <= 0)
+            break;
+        reader_.feed(buf, n);
+        WireFrame reply;
+        if (reader_.next(reply) && !(welcomed = wire_decode_welcome(reply, welcome)))
+            break;
+    }
+    if (!welcomed || welcome.version != PROTOCOL_VERSION) {
+        fprintf(stderr, "client: handshake with %s failed\n", config_.host.c_str());
+        cleanup(fd);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    caps_ = welcome.caps;
+    if (session_ != 0 && welcome.session == session_) {
+        // Resumed: resend whatever the server had not received yet
+        while (!unacked_.empty() && unacked_.back().seq > welcome.clientSeq) {
+            // Ahead of everything, in seq order, or the server skips them
+            outgoing_[SEND_REALTIME].push_front(unacked_.back());
+            unacked_.pop_back();
+        }
+        printf("client: resumed session %08x\n", session_);
+    } else {
+        // Fresh session: room seqs restart, what was in flight is gone,
+        // and the snapshot (if any) says what is still sounding
+        releaseNotes();
+        session_ = welcome.session;
+        token_ = welcome.token;
+        lastSeq_ = 0;
+        printf("client: started session %08x\n", session_);
+    }
+    unacked_.clear();
+    fd_ = fd;
+    lastSent_ = monotonic_us();
+    outNotify_.notify();
+    return true;
+}
+
+// Hand one message to receive(). Receiver thread.
+void Session::deliver(const unsigned char *message, size_t n)
+{
+    notes_.update(message, n);
+    if (!inRing_.push(message, n))
+        overruns_++;
+}
+
+/*
+ * Hand a reassembled SysEx message to receive(). Those too big to share
+ * the ring with live traffic are queued beside it. Receiver thread.
+ */
+void Session::deliverSysex(std::vector<unsigned char> &message)
+{
+    if (message.size() + 4 <= config_.ringBytes / 4) {
+        deliver(&message[0], message.size());
+        return;
+    }
+    std::lock_guard<std::mutex> lock(sysexInMutex_);
+    if (sysexInBytes_ + message.size() > config_.maxSysexBytes) {
+        overruns_++;
+        return;
+    }
+    sysexInBytes_ += message.size();
+    sysexIn_.push_back(std::vector<unsigned char>());
+    sysexIn_.back().swap(message);
+}
+
+// Hand receive() the note offs and pedal releases for everything still down
+void Session::releaseNotes()
+{
+    if (!notes_.active())
+        return;
+    std::vector<unsigned char> bytes;
+    notes_.release(bytes);
+    for (size_t i = 0; i + 3 <= bytes.size(); i += 3)
+        deliver(&bytes[i], 3);
+    inNotify_.notify();
+}
+
+void Session::handleFrame(const WireFrame &frame)
+{
+    switch (frame.type) {
+    case FRAME_MIDI:
+        if (frame.body.empty())
+            break;
+        deliver(&frame.body[0], frame.body.size());
+        break;
+    case FRAME_SYSEX:
+        // Relayed live only, outside the room seq
+        receiveSysex(frame);
+        return;
+    case FRAME_CLOCK:
+        if (frame.body.size() >= 8) {
+            ClockUpdate update;
+            update.tick = wire_get32(&frame.body[0]);
+            update.period = wire_get32(&frame.body[4]);
+            update.time = frame.time;
+            if (frame.body.size() > 8 && midi_is_transport(&frame.body[8], frame.body.size() - 8))
+                clock_.transport(update, &frame.body[8], frame.body.size() - 8, monotonic_us());
+            else
+                clock_.update(update, monotonic_us());
+        }
+        return;
+    case FRAME_SNAPSHOT: {
+        // Start from silence, then split the snapshot back into messages
+        releaseNotes();
+        size_t i = 0;
+        while (i < frame.body.size()) {
+            size_t n = midi_channel_message_size(frame.body[i]);
+            if (n == 0 || i + n > frame.body.size())
+                break;
+            deliver(&frame.body[i], n);
+            i += n;
+        }
+        break;
+    }
+    default:
+        // PONG and anything newer than us only count as signs of life
+        return;
+    }
+
+    // Control lane frames can arrive after higher seqs and so fall below
+    // the resume point; the server resends controller state on resume.
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (frame.seq > lastSeq_)
+        lastSeq_ = frame.seq;
+}
+
+/*
+ * Add one chunk to its transfer and deliver the message once complete.
+ * Chunks of a transfer whose start was missed are dropped. Receiver thread.
+ */
+void Session::receiveSysex(const WireFrame &frame)
+{
+    if (frame.body.size() < 4)
+        return;
+    uint32_t id = wire_get32(&frame.body[0]);
+    std::map<uint32_t, std::vector<unsigned char> >::iterator it = transfers_.find(id);
+    if (frame.flags & SYSEX_BEGIN) {
+        if (it == transfers_.end()) {
+            // More open transfers than any sender keeps going: the oldest was cut off
+            if (transfers_.size() >= SYSEX_TRANSFERS)
+                transfers_.erase(transfers_.begin());
+            it = transfers_.insert(std::make_pair(id, std::vector<unsigned char>())).first;
+        }
+        it->second.clear();
+    } else if (it == transfers_.end()) {
+        return;
+    }
+
+    std::vector<unsigned char> &message = it->second;
+    if (message.size() + frame.body.size() - 4 > config_.maxSysexBytes) {
+        transfers_.erase(it);
+        overruns_++;
+        return;
+    }
+    message.insert(message.end(), frame.body.begin() + 4, frame.body.end());
+    if (!(frame.flags & SYSEX_END))
+        return;
+    if (!message.empty())
+        deliverSysex(message);
+    transfers_.erase(it);
+}
+
+void Session::disconnect(const char *reason)
+{
+    int fd;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fd = fd_;
+        fd_ = -1;
+        generation_++;
+    }
+    if (fd < 0)
+        return;
+    fprintf(stderr, "client: connection lost (%s), reconnecting\n", reason);
+    transfers_.clear();
+    shutdown(fd, SHUT_RDWR);
+    std::lock_guard<std::mutex> lock(writeMutex_);
+    close(fd);
+}
+
+// Sleep for the current delay (with jitter) and double it for next time
+void Session::backoff(unsigned int &delayMs)
+{
+    unsigned int jitter = delayMs / 4;
+    unsigned int sleepMs = delayMs - jitter + (jitter ? rand() % (2 * jitter + 1) : 0);
+    stopNotify_.wait(sleepMs);
+    delayMs = delayMs * 2 > config_.backoffMaxMs ? config_.backoffMaxMs : delayMs * 2;
+}
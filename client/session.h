@@ -0,0 +1,183 @@
+/*
+ * session.h
+ *
+ *  Persistent, full-duplex connection to the relay. A Session owns two
+ *  threads: the receiver connects (with exponential backoff), performs
+ *  the HELLO/WELCOME handshake, reads frames and enforces the idle
+ *  timeout; the sender drains the outgoing queue and sends heartbeats.
+ *  When the connection drops the session reconnects on its own and
+ *  resumes by sequence number in both directions, so callers just keep
+ *  calling send() and receive(). Notes the room left sounding are held
+ *  across a resume and released through receive() when a fresh session
+ *  starts instead, when resuming is no longer possible, before a state
+ *  snapshot is applied, and when the session stops.
+ *
+ *  Both directions are lock-free handoffs: send() copies into an SPSC
+ *  ring and wakes the sender through an eventfd only if it sleeps, and
+ *  the receiver hands messages to receive() the same way. send() is safe
+ *  to call from an RtMidiIn callback; it must have a single caller thread,
+ *  as must receive().
+ *
+ *  The sender keeps one queue per SendClass and writes each pass as one
+ *  deficit round-robin round (see send_classes.h): notes go out ahead of
+ *  controller sweeps, and both ahead of SysEx.
+ *
+ *  Large SysEx goes through sendSysex() (send() forwards to it), on a ring
+ *  of its own. The sender splits it into FRAME_SYSEX chunks on the bulk
+ *  queue, which is only written while the socket has little in flight,
+ *  so a dump never delays notes by more than one chunk. The receiver
+ *  reassembles transfers and hands each message to receive() whole;
+ *  messages too big for the ring are handed over under a lock.
+ *
+ *  With SessionConfig::clock set and a server that passes FRAME_CLOCK on,
+ *  MIDI clock ticks given to send() are not forwarded one by one: the
+ *  sender measures tempo and phase from them (ClockMeter) and sends an
+ *  update every few ticks, and receive() returns ticks regenerated on the
+ *  local clock (ClockGenerator) between the messages from the room.
+ *  Start, Stop, Continue and Song Position go along in FRAME_CLOCK too
+ *  and come back out right before the regenerated tick they preceded.
+ */
+
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "cc_coalescer.h"
+#include "event_notifier.h"
+#include "midi_clock.h"
+#include "midi_wire.h"
+#include "note_tracker.h"
+#include "send_classes.h"
+#include "spsc_ring.h"
+
+struct SessionConfig {
+    std::string host;
+    std::string room;               // empty for the server default
+    unsigned int heartbeatMs;       // ping interval when otherwise idle
+    unsigned int idleTimeoutMs;     // reconnect if the server is silent this long
+    unsigned int backoffMinMs;      // first reconnect delay
+    unsigned int backoffMaxMs;      // reconnect delay cap
+    size_t maxPending;              // outgoing frames per class buffered while disconnected
+    unsigned int coalesceUs;        // CC coalescing window on the send path (0 = off)
+    size_t ringBytes;               // size of each handoff ring
+    unsigned int rewindMs;          // start this far in the room's past (0 = live)
+    size_t maxSysexBytes;           // SysEx buffered per direction, and largest message received
+    bool clock;                     // carry MIDI clock as tempo updates, regenerate it on receive
+
+    SessionConfig()
+        : heartbeatMs(1000), idleTimeoutMs(5000), backoffMinMs(250),
+          backoffMaxMs(8000), maxPending(1024), coalesceUs(0), ringBytes(1 << 16),
+          rewindMs(0), maxSysexBytes(4 << 20), clock(false) {}
+};
+
+class Session {
+public:
+    explicit Session(const SessionConfig &config);
+    ~Session();
+
+    /* Start the sender and receiver threads */
+    void start();
+
+    /* Stop both threads and close the connection */
+    void stop();
+
+    /* Queue one MIDI message for the server. Never blocks or allocates. */
+    bool send(const unsigned char *message, size_t n);
+    bool send(const std::vector<unsigned char> &message)
+    {
+        return !message.empty() && send(&message[0], message.size());
+    }
+
+    /*
+     * Queue part of a SysEx message for transfer behind live traffic.
+     * begin marks the part starting with F0, end the one finishing the
+     * message; parts of one message are passed in order. Same threading
+     * rules as send(); a part must fit the ring.
+     */
+    bool sendSysex(const unsigned char *data, size_t n, bool begin, bool end);
+
+    /*
+     * Wait up to timeoutMs (-1 = forever) for a MIDI message from the
+     * room, or a regenerated clock tick or transport message when one is
+     * due. Returns false on timeout or once the session is stopped.
+     */
+    bool receive(std::vector<unsigned char> &message, int timeoutMs);
+
+    /* Messages lost because a handoff ring was full */
+    unsigned long overruns() const { return overruns_; }
+
+    bool connected();
+
+private:
+    void sendLoop();
+    void drainInput(uint64_t now);
+    void queueFrame(const unsigned char *message, size_t n, uint64_t now);
+    void queueSysex(const unsigned char *part, size_t n, unsigned char flags, uint64_t now);
+    void queueClock(uint64_t at, uint64_t now);
+    void queueTransport(const unsigned char *msg, size_t n, uint64_t at, uint64_t now);
+    void queueClockFrame(const ClockUpdate &update, const unsigned char *msg, size_t n);
+    void takeFrame(std::deque<WireFrame> &queue, std::vector<unsigned char> &bytes);
+    void deliver(const unsigned char *message, size_t n);
+    void deliverSysex(std::vector<unsigned char> &message);
+    bool pop(std::vector<unsigned char> &message);
+    bool pending();
+    void releaseNotes();
+    void recvLoop();
+    bool establish();
+    void handleFrame(const WireFrame &frame);
+    void receiveSysex(const WireFrame &frame);
+    void disconnect(const char *reason);
+    bool writeFrames(int fd, unsigned long gen, const std::vector<unsigned char> &bytes);
+    void backoff(unsigned int &delayMs);
+
+    SessionConfig config_;
+    std::thread sender_;
+    std::thread receiver_;
+    std::atomic<bool> running_;
+
+    SpscRing outRing_;              // send() -> sender thread
+    EventNotifier outNotify_;
+    SpscRing sysexRing_;            // sendSysex() -> sender thread: flags byte, then data
+    SpscRing inRing_;               // receiver thread -> receive()
+    EventNotifier inNotify_;
+    EventNotifier stopNotify_;      // interrupts the reconnect backoff
+    std::atomic<unsigned long> overruns_;
+
+    std::mutex sysexInMutex_;       // guards sysexIn_
+    std::deque<std::vector<unsigned char> > sysexIn_;   // receiver thread -> receive(), too big for inRing_
+    size_t sysexInBytes_;
+    ClockGenerator clock_;          // receiver thread -> receive()
+
+    std::mutex mutex_;              // guards everything below except the reader
+    std::mutex writeMutex_;         // held while writing to, or closing, the socket
+    int fd_;                        // -1 while disconnected
+    unsigned long generation_;      // bumped on every disconnect
+    uint32_t session_;              // 0 until the first WELCOME
+    uint64_t token_;                // proves ownership of session_ on resume
+    uint32_t lastSeq_;              // highest room seq received
+    uint32_t nextSeq_;              // client seq of the next outgoing frame
+    uint32_t caps_;                 // negotiated with the current server
+    uint64_t lastSent_;
+    std::deque<WireFrame> outgoing_[SEND_CLASSES];  // not yet written
+    DeficitRoundRobin drr_;
+    size_t sysexBytes_;             // SysEx transfer bytes in outgoing_
+    std::deque<WireFrame> unacked_;     // written, kept for resend on resume
+
+    CcCoalescer coalescer_;         // sender thread only
+    std::vector<unsigned char> scratch_;    // sender thread only
+    uint32_t transfer_;             // sender thread only: id of the last SysEx transfer
+    bool transferOpen_;             // sender thread only: parts of it still to come
+    ClockMeter meter_;              // sender thread only
+    WireReader reader_;             // receiver thread only
+    NoteTracker notes_;             // receiver thread only: what receive() left sounding
+    std::map<uint32_t, std::vector<unsigned char> > transfers_; // receiver thread only
+};
+
+#endif /* SESSION_H_ */
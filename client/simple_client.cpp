@@ -29,12 +29,18 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <vector>
 #include <string>
+#include <mutex>
+#include "midi_util.h"
 #include "simple_client.h"
 
 #define PORT "3490" // the port client will be connecting to 
 #define MAXDATASIZE 100 // max number of bytes we can get at once 
+#define CONNECT_STAGGER_MS 250      // head start of each address over the next
+#define CONNECT_TIMEOUT_MS 10000    // give up on a host after this long
 
 // Get sockaddr, IPv4 or IPv6:
 void *get_in_addr(struct sockaddr *sa)
@@ -47,62 +53,213 @@ void *get_in_addr(struct sockaddr *sa)
 
 /* Connect to the server. If successful, return the socket file descriptor. */
 int connect_to_server(int argc, char *argv[])
+{
+    if (argc < 2) {                         // Must have at least the hostname
+        fprintf(stderr,"usage: client hostname [room]\n");
+        exit(1);
+    }
+    return connect_to_host(argv[1]);
+}
+
+/* Address of the last successful connection, tried first next time */
+static std::mutex last_good_mutex;
+static std::string last_good_host;
+static struct sockaddr_storage last_good_addr;
+static socklen_t last_good_len = 0;
+
+/* One connection attempt in flight */
+struct ConnectAttempt {
+    int fd;
+    const struct addrinfo *ai;
+};
+
+/* Starts a non-blocking connect to ai. Returns the socket, or -1. */
+static int start_connect(const struct addrinfo *ai)
+{
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == -1) {
+        perror("client: socket");
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1 && errno != EINPROGRESS) {
+        perror("client: connect");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Orders the addresses to try: the last good one for this host first,
+ * then alternating address families starting with the resolver's
+ * preference, so a broken IPv6 route costs one stagger and not a
+ * connect timeout.
+ */
+static std::vector<const struct addrinfo *> connect_order(const char *host,
+                                                          const struct addrinfo *list)
+{
+    std::vector<const struct addrinfo *> first, other, order;
+    for (const struct addrinfo *p = list; p != NULL; p = p->ai_next) {
+        if (first.empty() || p->ai_family == first[0]->ai_family)
+            first.push_back(p);
+        else
+            other.push_back(p);
+    }
+    for (size_t i = 0; i < first.size() || i < other.size(); i++) {
+        if (i < first.size()) order.push_back(first[i]);
+        if (i < other.size()) order.push_back(other[i]);
+    }
+
+    std::lock_guard<std::mutex> lock(last_good_mutex);
+    if (last_good_len == 0 || last_good_host != host)
+        return order;
+    for (size_t i = 0; i < order.size(); i++) {
+        if (order[i]->ai_addrlen == last_good_len &&
+            memcmp(order[i]->ai_addr, &last_good_addr, last_good_len) == 0) {
+            const struct addrinfo *good = order[i];
+            order.erase(order.begin() + i);
+            order.insert(order.begin(), good);
+            break;
+        }
+    }
+    return order;
+}
+
+/*
+ * Races connections to the addresses in order (RFC 8305 "Happy
+ * Eyeballs"). Each attempt gets CONNECT_STAGGER_MS before the next one
+ * starts, or less if it fails sooner; the first to complete wins and
+ * the rest are abandoned. Returns the connected socket, or -1.
+ */
+static int race_connect(const std::vector<const struct addrinfo *> &order,
+                        const struct addrinfo **winner)
+{
+    std::vector<ConnectAttempt> pending;
+    size_t next = 0;
+    int sockfd = -1;
+    uint64_t now = monotonic_us();
+    uint64_t deadline = now + (uint64_t)CONNECT_TIMEOUT_MS * 1000;
+    uint64_t nextStart = now;
+
+    while (sockfd == -1 && now < deadline && (next < order.size() || !pending.empty())) {
+        // Start the next attempt once the previous one had its head start
+        if (next < order.size() && (now >= nextStart || pending.empty())) {
+            const struct addrinfo *ai = order[next++];
+            int fd = start_connect(ai);
+            if (fd != -1) {
+                ConnectAttempt attempt = {fd, ai};
+                pending.push_back(attempt);
+            }
+            nextStart = now + (uint64_t)CONNECT_STAGGER_MS * 1000;
+            continue;
+        }
+
+        std::vector<struct pollfd> pfds(pending.size());
+        for (size_t i = 0; i < pending.size(); i++) {
+            pfds[i].fd = pending[i].fd;
+            pfds[i].events = POLLOUT;
+            pfds[i].revents = 0;
+        }
+        uint64_t until = next < order.size() && nextStart < deadline ? nextStart : deadline;
+        int rv = poll(pfds.data(), pfds.size(), (int)((until - now) / 1000) + 1);
+        if (rv == -1 && errno != EINTR) {
+            perror("client: poll");
+            break;
+        }
+
+        for (size_t i = pfds.size(); i-- > 0; ) {
+            if (pfds[i].revents == 0)
+                continue;
+            int err = 0;
+            socklen_t len = sizeof err;
+            getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err == 0 && sockfd == -1) {
+                sockfd = pending[i].fd;
+                *winner = pending[i].ai;
+            } else {
+                if (err != 0)
+                    fprintf(stderr, "client: connect: %s\n", strerror(err));
+                close(pending[i].fd);
+            }
+            pending.erase(pending.begin() + i);
+            nextStart = monotonic_us();     // a failure hands over at once
+        }
+        now = monotonic_us();
+    }
+
+    for (size_t i = 0; i < pending.size(); i++)
+        close(pending[i].fd);
+    return sockfd;
+}
+
+/* Connect to host on PORT. Returns the socket file descriptor, or -1. */
+int connect_to_host(const char *host)
 {
     int sockfd;                   			// sockfd - stores socket descriptor
 
-    struct addrinfo hints, *servinfo, *p;   // hints - an addrinfo struct from netdb that we can fill in
+    struct addrinfo hints, *servinfo;       // hints - an addrinfo struct from netdb that we can fill in
                                             // servinfo - linked list of struct addrinfos, set by getaddrinfo()
-                                            // p - used in loop, stores the address info of the first server we connect to
+    const struct addrinfo *p = NULL;        // p - stores the address info of the server we connected to
+    struct addrinfo cached;                 // Stands in for servinfo when the lookup fails
+    struct sockaddr_storage cachedAddr;     // Copy of the last good address for cached
     int rv;                                 // Stores the success/failure of getaddrinfo call, 0 if success, nonzero on error
     char s[INET6_ADDRSTRLEN];               // Max length for IPv6 msgs, used in inet_ntop() call
 
-    if (argc != 2) {                        // Must have 2 arguments
-        fprintf(stderr,"usage: client hostname\n");
-        exit(1);
-    }
     // Set up our addrinfo structure
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
 
-    // getaddrinfo error handling
-    if ((rv = getaddrinfo(argv[1], PORT, &hints, &servinfo)) != 0) {
+    // getaddrinfo error handling; a reconnect can still use the last good address
+    if ((rv = getaddrinfo(host, PORT, &hints, &servinfo)) != 0) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        return 1;
+        std::lock_guard<std::mutex> lock(last_good_mutex);
+        if (last_good_len == 0 || last_good_host != host)
+            return -1;
+        memset(&cached, 0, sizeof cached);
+        cached.ai_family = last_good_addr.ss_family;
+        cached.ai_socktype = SOCK_STREAM;
+        memcpy(&cachedAddr, &last_good_addr, last_good_len);
+        cached.ai_addr = (struct sockaddr *)&cachedAddr;
+        cached.ai_addrlen = last_good_len;
+        servinfo = NULL;
     }
 
-    // Loop through the linkedlist of addrinfo structs and connect to the first we can
-    for(p = servinfo; p != NULL; p = p->ai_next) {
-        // Error creating a socket
-        if ((sockfd = socket(p->ai_family, p->ai_socktype,
-                p->ai_protocol)) == -1) {
-            perror("client: socket");
-            continue;
-        }
-        // Error connecting to a socket
-        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-            close(sockfd);
-            perror("client: connect");
-            continue;
-        }
-        break;
-    }
-    
+    std::vector<const struct addrinfo *> order;
+    if (servinfo)
+        order = connect_order(host, servinfo);
+    else
+        order.push_back(&cached);
+    sockfd = race_connect(order, &p);
+
     // Could not find a socket to connect to
-    if (p == NULL) {
+    if (sockfd == -1) {
         fprintf(stderr, "client: failed to connect\n");
-        return 2;
+        if (servinfo)
+            freeaddrinfo(servinfo);
+        return -1;
+    }
+
+    // Callers expect a blocking socket
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) & ~O_NONBLOCK);
+    {
+        std::lock_guard<std::mutex> lock(last_good_mutex);
+        last_good_host = host;
+        memcpy(&last_good_addr, p->ai_addr, p->ai_addrlen);
+        last_good_len = p->ai_addrlen;
     }
 
     // Convert IP address to printable format
     inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr), s, sizeof s);
     printf("client: connecting to %s\n", s);
     
-    freeaddrinfo(servinfo); // free the linkedlist
+    if (servinfo)
+        freeaddrinfo(servinfo); // free the linkedlist
     return sockfd;
 }
 
-/* Returns the pointer to a char received from the server */
+/* Returns the data received from the server, empty on error or disconnect */
 std::string recv_from_server(int sockfd) {
     int numbytes;                    	// numbytes - stores # bytes read into the buffer from recv()
     std::vector<char> buf(MAXDATASIZE);
@@ -112,9 +269,9 @@ std::string recv_from_server(int sockfd) {
 //    printf("Numbytes: %i\n", numbytes);
     if (numbytes == -1) {
         perror("recv");
-        exit(1);
+        return rcv;
     }
-    rcv.append( buf.cbegin(), buf.cend() );
+    rcv.append( buf.cbegin(), buf.cbegin() + numbytes );
     return rcv;
 }
 
@@ -124,6 +281,74 @@ void send_to_server(std::string data, int sockfd) {
 		perror("send");
 }
 
+/* Subscribes to a room; the server answers with the room state snapshot */
+bool join_room(const std::string &room, int sockfd) {
+    std::vector<unsigned char> frame;
+    if (room.empty() || !wire_encode(frame, FRAME_JOIN, 0, 0, 0,
+                                     (const unsigned char *)room.data(), room.size()))
+        return false;
+    if (send(sockfd, &frame[0], frame.size(), MSG_NOSIGNAL) == -1) {
+        perror("send");
+        return false;
+    }
+    return true;
+}
+
+/* Sends one MIDI message to the server as a wire frame */
+bool send_midi_to_server(const std::vector<unsigned char> &message, int sockfd) {
+    std::vector<unsigned char> frame;
+    if (message.empty() || !wire_encode(frame, FRAME_MIDI, 0, 0, (uint32_t)monotonic_us(),
+                                        &message[0], message.size()))
+        return false;
+    if (send(sockfd, &frame[0], frame.size(), MSG_NOSIGNAL) == -1) {
+        perror("send");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Waits up to timeout_ms for data from the server and appends every
+ * complete MIDI message received to messages. Returns false once the
+ * connection is gone.
+ */
+bool recv_midi_from_server(int sockfd, WireReader &reader,
+                           std::vector< std::vector<unsigned char> > &messages, int timeout_ms) {
+    struct pollfd pfd;
+    pfd.fd = sockfd;
+    pfd.events = POLLIN;
+    int rv = poll(&pfd, 1, timeout_ms);
+    if (rv <= 0)
+        return rv == 0 || errno == EINTR;
+
+    unsigned char buf[MAXDATASIZE];
+    int numbytes = recv(sockfd, buf, sizeof buf, 0);
+    if (numbytes <= 0) {
+        if (numbytes == -1)
+            perror("recv");
+        return false;
+    }
+    reader.feed(buf, numbytes);
+
+    WireFrame frame;
+    while (reader.next(frame)) {
+        if (frame.type == FRAME_MIDI && !frame.body.empty()) {
+            messages.push_back(frame.body);
+        } else if (frame.type == FRAME_SNAPSHOT) {
+            // Split the state snapshot back into individual messages
+            size_t i = 0;
+            while (i < frame.body.size()) {
+                size_t n = midi_channel_message_size(frame.body[i]);
+                if (n == 0 || i + n > frame.body.size())
+                    break;
+                messages.push_back(std::vector<unsigned char>(&frame.body[i], &frame.body[i] + n));
+                i += n;
+            }
+        }
+    }
+    return true;
+}
+
 void cleanup(int sockfd) {
 	printf("Cleaning up\n");
 	close(sockfd);
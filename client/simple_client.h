@@ -8,10 +8,19 @@
 #ifndef SIMPLE_CLIENT_H_
 #define SIMPLE_CLIENT_H_
 
+#include <string>
+#include <vector>
+#include "midi_wire.h"
+
 void *get_in_addr(struct sockaddr *sa);
 int connect_to_server(int argc, char *argv[]);
+int connect_to_host(const char *host);
 std::string recv_from_server(int sockfd);
 void send_to_server(std::string data, int sockfd);
+bool join_room(const std::string &room, int sockfd);
+bool send_midi_to_server(const std::vector<unsigned char> &message, int sockfd);
+bool recv_midi_from_server(int sockfd, WireReader &reader,
+                           std::vector< std::vector<unsigned char> > &messages, int timeout_ms);
 void cleanup(int sockfd);
 
 #endif /* SIMPLE_CLIENT_H_ */
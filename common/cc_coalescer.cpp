@@ -0,0 +1,97 @@
+//*****************************************//
+//  cc_coalescer.cpp
+//
+//  Windowed latest-value coalescing of
+//  control change messages.
+//
+//*****************************************//
+
+#include <string.h>
+#include "midi_util.h"
+#include "cc_coalescer.h"
+
+CcCoalescer::CcCoalescer(unsigned int windowUs)
+    : windowUs_(windowUs)
+{
+    memset(slots_, 0, sizeof slots_);
+    allowed_[0] = allowed_[1] = 0;
+
+    // Order sensitive or switch-like controllers are never merged
+    for (int cc = 0; cc < 128; cc++) {
+        if (midi_cc_is_ordered(cc))
+            allow(cc);
+    }
+}
+
+void CcCoalescer::allow(int controller, bool passThrough)
+{
+    if (controller < 0 || controller > 127)
+        return;
+    uint64_t bit = (uint64_t)1 << (controller & 63);
+    if (passThrough)
+        allowed_[controller >> 6] |= bit;
+    else
+        allowed_[controller >> 6] &= ~bit;
+}
+
+bool CcCoalescer::offer(const unsigned char *msg, size_t n, uint64_t now, uint32_t tag)
+{
+    if (windowUs_ == 0 || n < 3 || (msg[0] & 0xF0) != MIDI_CONTROL_CHANGE)
+        return true;
+    int controller = msg[1] & 0x7F;
+    if ((allowed_[controller >> 6] >> (controller & 63)) & 1)
+        return true;
+
+    Slot &slot = slots_[(msg[0] & 0x0F) * 128 + controller];
+    if (slot.windowEnd == 0 || now >= slot.windowEnd) {
+        // Window closed: this value supersedes anything still pending
+        if (slot.windowEnd == 0)
+            open_.push_back((msg[0] & 0x0F) * 128 + controller);
+        slot.windowEnd = now + windowUs_;
+        slot.pending = false;
+        return true;
+    }
+    slot.value = msg[2];
+    slot.tag = tag;
+    slot.pending = true;
+    return false;
+}
+
+void CcCoalescer::flush(uint64_t now, std::vector<CoalescedMessage> &out)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < open_.size(); i++) {
+        int key = open_[i];
+        Slot &slot = slots_[key];
+        if (now < slot.windowEnd) {
+            open_[kept++] = key;
+            continue;
+        }
+        if (slot.pending) {
+            // Emitting opens a fresh window so sweeps stay rate limited
+            CoalescedMessage m;
+            m.bytes[0] = MIDI_CONTROL_CHANGE | (key >> 7);
+            m.bytes[1] = key & 0x7F;
+            m.bytes[2] = slot.value;
+            m.tag = slot.tag;
+            out.push_back(m);
+            slot.pending = false;
+            slot.windowEnd = now + windowUs_;
+            open_[kept++] = key;
+        } else {
+            slot.windowEnd = 0;
+        }
+    }
+    open_.resize(kept);
+}
+
+uint64_t CcCoalescer::nextDue() const
+{
+    uint64_t due = 0;
+    for (size_t i = 0; i < open_.size(); i++) {
+        uint64_t end = slots_[open_[i]].windowEnd;
+        if (due == 0 || end < due)
+            due = end;
+    }
+    return due;
+}
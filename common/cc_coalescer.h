@@ -0,0 +1,64 @@
+/*
+ * cc_coalescer.h
+ *
+ *  Rate limiter for control change sweeps. Each (channel, controller)
+ *  pair may emit at most one value per window: the first change passes
+ *  straight through and opens a window, later changes inside the window
+ *  only overwrite a pending slot, and the latest pending value goes out
+ *  when the window closes. Controllers on the allowlist (pedals, bank
+ *  select, RPN/NRPN data entry, channel mode) always pass through.
+ *
+ *  Used by midiclient in front of send_to_server() and by the relay per
+ *  subscriber.
+ */
+
+#ifndef CC_COALESCER_H_
+#define CC_COALESCER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/* A held controller value released by flush() */
+struct CoalescedMessage {
+    unsigned char bytes[3];
+    uint32_t tag;           // caller data passed to offer() with this value
+};
+
+class CcCoalescer {
+public:
+    explicit CcCoalescer(unsigned int windowUs = 10000);
+
+    void setWindow(unsigned int windowUs) { windowUs_ = windowUs; }
+    unsigned int window() const { return windowUs_; }
+
+    /* Let a controller through unthrottled (or throttle it again) */
+    void allow(int controller, bool passThrough = true);
+
+    /*
+     * Offer one message at time now. Returns true if it should be sent
+     * immediately, false if it was absorbed and will come out of flush().
+     */
+    bool offer(const unsigned char *msg, size_t n, uint64_t now, uint32_t tag = 0);
+
+    /* Append the pending values whose window has closed */
+    void flush(uint64_t now, std::vector<CoalescedMessage> &out);
+
+    /* Time the next pending value is due, or 0 if nothing is pending */
+    uint64_t nextDue() const;
+
+private:
+    struct Slot {
+        uint64_t windowEnd;     // 0 when no window is open
+        uint32_t tag;
+        unsigned char value;
+        bool pending;
+    };
+
+    unsigned int windowUs_;
+    uint64_t allowed_[2];           // controller pass-through bitset
+    Slot slots_[16 * 128];
+    std::vector<int> open_;         // slots with an open window
+};
+
+#endif /* CC_COALESCER_H_ */
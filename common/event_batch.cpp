@@ -0,0 +1,158 @@
+//*****************************************//
+//  event_batch.cpp
+//
+//  Structure-of-arrays MIDI event batch.
+//
+//*****************************************//
+
+#include <algorithm>
+#include <string.h>
+#include "midi_util.h"
+#include "event_batch.h"
+
+/* Length of a message that fits the columns, 0 if it doesn't */
+static size_t short_size(unsigned char status)
+{
+    if (midi_is_channel_message(status))
+        return midi_channel_message_size(status);
+    switch (status) {
+    case 0xF1: case 0xF3: return 2;    // time code quarter frame, song select
+    case 0xF2: return 3;               // song position
+    case 0xF6: return 1;               // tune request
+    default: return status >= 0xF8 ? 1 : 0;
+    }
+}
+
+void EventBatch::reserve(size_t events, size_t sysexBytes)
+{
+    time_.reserve(events);
+    status_.reserve(events);
+    data1_.reserve(events);
+    data2_.reserve(events);
+    sysex_.reserve(sysexBytes);
+}
+
+void EventBatch::clear()
+{
+    time_.clear();
+    status_.clear();
+    data1_.clear();
+    data2_.clear();
+    index_.clear();
+    sysex_.clear();
+}
+
+bool EventBatch::add(uint32_t time, const unsigned char *msg, size_t n)
+{
+    if (n == 0 || msg[0] < 0x80)
+        return false;
+
+    if (msg[0] == 0xF0) {
+        if (n < 2 || n > WIRE_MAX_BODY || msg[n - 1] != 0xF7)
+            return false;
+        Sysex s;
+        s.event = (uint32_t)status_.size();
+        s.offset = (uint32_t)sysex_.size();
+        s.size = (uint32_t)n;
+        index_.push_back(s);
+        sysex_.insert(sysex_.end(), msg, msg + n);
+        time_.push_back(time);
+        status_.push_back(0xF0);
+        data1_.push_back(0);
+        data2_.push_back(0);
+        return true;
+    }
+
+    if (n != short_size(msg[0]))
+        return false;
+    for (size_t i = 1; i < n; i++)
+        if (msg[i] & 0x80)
+            return false;
+    time_.push_back(time);
+    status_.push_back(msg[0]);
+    data1_.push_back(n > 1 ? msg[1] : 0);
+    data2_.push_back(n > 2 ? msg[2] : 0);
+    return true;
+}
+
+const EventBatch::Sysex &EventBatch::findSysex(size_t i) const
+{
+    return *std::lower_bound(index_.begin(), index_.end(), (uint32_t)i, Sysex::before);
+}
+
+size_t EventBatch::messageSize(size_t i) const
+{
+    return isSysex(i) ? findSysex(i).size : short_size(status_[i]);
+}
+
+void EventBatch::message(size_t i, std::vector<unsigned char> &out) const
+{
+    if (isSysex(i)) {
+        const Sysex &s = findSysex(i);
+        out.assign(sysex_.begin() + s.offset, sysex_.begin() + s.offset + s.size);
+        return;
+    }
+    size_t n = short_size(status_[i]);
+    out.resize(n);
+    out[0] = status_[i];
+    if (n > 1) out[1] = data1_[i];
+    if (n > 2) out[2] = data2_[i];
+}
+
+void EventBatch::compact(const unsigned char *keep)
+{
+    size_t n = size(), w = 0, s = 0, sw = 0, bytes = 0;
+    for (size_t i = 0; i < n; i++) {
+        bool sysex = isSysex(i);
+        if (keep[i]) {
+            time_[w] = time_[i];
+            status_[w] = status_[i];
+            data1_[w] = data1_[i];
+            data2_[w] = data2_[i];
+            if (sysex) {
+                Sysex moved = index_[s];
+                memmove(&sysex_[bytes], &sysex_[moved.offset], moved.size);
+                moved.event = (uint32_t)w;
+                moved.offset = (uint32_t)bytes;
+                bytes += moved.size;
+                index_[sw++] = moved;
+            }
+            w++;
+        }
+        if (sysex)
+            s++;
+    }
+    time_.resize(w);
+    status_.resize(w);
+    data1_.resize(w);
+    data2_.resize(w);
+    index_.resize(sw);
+    sysex_.resize(bytes);
+}
+
+bool EventBatch::addFrame(const WireFrame &frame)
+{
+    if (frame.type != FRAME_MIDI)
+        return false;
+    return add(frame.time, frame.body);
+}
+
+void EventBatch::encode(std::vector<unsigned char> &out, uint32_t seq) const
+{
+    unsigned char msg[3];
+    size_t s = 0;
+    for (size_t i = 0; i < size(); i++) {
+        // add() only takes what fits a frame, so every event gets its seq
+        if (isSysex(i)) {
+            const Sysex &x = index_[s++];
+            if (wire_encode(out, FRAME_MIDI, 0, seq, time_[i], &sysex_[x.offset], x.size))
+                seq++;
+            continue;
+        }
+        msg[0] = status_[i];
+        msg[1] = data1_[i];
+        msg[2] = data2_[i];
+        if (wire_encode(out, FRAME_MIDI, 0, seq, time_[i], msg, short_size(msg[0])))
+            seq++;
+    }
+}
@@ -0,0 +1,107 @@
+/*
+ * event_batch.h
+ *
+ *  Structure-of-arrays container for a run of timestamped MIDI events.
+ *  Short messages (channel voice, system common, realtime) live in
+ *  parallel time/status/data1/data2 columns that the batch kernels work
+ *  on directly. SysEx goes to an out-of-line side table and its status
+ *  column entry is 0xF0, which no kernel touches.
+ *
+ *  Nothing here allocates per event once the columns have grown to their
+ *  working size. clear() keeps capacity, so a reused batch stops
+ *  allocating after its first use.
+ *
+ *  This is for bulk work over whole runs of events, together with the
+ *  kernels in midi_batch_kernels.h. The live relay, recorder and client
+ *  paths handle one message at a time as it arrives and keep using
+ *  per-message vectors.
+ */
+
+#ifndef EVENT_BATCH_H_
+#define EVENT_BATCH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "midi_wire.h"
+
+class EventBatch {
+public:
+    void reserve(size_t events, size_t sysexBytes = 0);
+    void clear();
+
+    size_t size() const { return status_.size(); }
+    bool empty() const { return status_.empty(); }
+
+    /*
+     * Append one complete message. Returns false (and adds nothing) for a
+     * malformed one: wrong length for its status, data bytes with the top
+     * bit set, a stray data byte, or SysEx too long for one wire frame.
+     */
+    bool add(uint32_t time, const unsigned char *msg, size_t n);
+    bool add(uint32_t time, const std::vector<unsigned char> &msg)
+    { return msg.empty() ? false : add(time, &msg[0], msg.size()); }
+
+    /* Columns, for the batch kernels */
+    uint32_t *time() { return data(time_); }
+    unsigned char *status() { return data(status_); }
+    unsigned char *data1() { return data(data1_); }
+    unsigned char *data2() { return data(data2_); }
+    const uint32_t *time() const { return data(time_); }
+    const unsigned char *status() const { return data(status_); }
+    const unsigned char *data1() const { return data(data1_); }
+    const unsigned char *data2() const { return data(data2_); }
+
+    bool isSysex(size_t i) const { return status_[i] == 0xF0; }
+    size_t messageSize(size_t i) const;
+
+    /* Copy message i into out, which is resized to fit. */
+    void message(size_t i, std::vector<unsigned char> &out) const;
+
+    /* Remove every event whose keep byte is 0, preserving order. */
+    void compact(const unsigned char *keep);
+
+    /* Append the body of a FRAME_MIDI frame; false for anything else. */
+    bool addFrame(const WireFrame &frame);
+
+    /* Append every event as a FRAME_MIDI, numbered from seq upwards without gaps. */
+    void encode(std::vector<unsigned char> &out, uint32_t seq) const;
+
+    /*
+     * Play every event out of an RtMidiOut (or anything with the same
+     * sendMessage). scratch is reused for each message.
+     */
+    template <class MidiOut>
+    void send(MidiOut *out, std::vector<unsigned char> &scratch) const
+    {
+        for (size_t i = 0; i < size(); i++) {
+            message(i, scratch);
+            out->sendMessage(&scratch);
+        }
+    }
+
+private:
+    struct Sysex {
+        uint32_t event;     // index into the columns
+        uint32_t offset;    // into sysex_
+        uint32_t size;
+
+        static bool before(const Sysex &s, uint32_t event) { return s.event < event; }
+    };
+
+    template <typename T>
+    static T *data(std::vector<T> &v) { return v.empty() ? 0 : &v[0]; }
+    template <typename T>
+    static const T *data(const std::vector<T> &v) { return v.empty() ? 0 : &v[0]; }
+
+    const Sysex &findSysex(size_t i) const;
+
+    std::vector<uint32_t> time_;
+    std::vector<unsigned char> status_;
+    std::vector<unsigned char> data1_;
+    std::vector<unsigned char> data2_;
+    std::vector<Sysex> index_;          // ordered by event
+    std::vector<unsigned char> sysex_;
+};
+
+#endif /* EVENT_BATCH_H_ */
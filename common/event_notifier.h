@@ -0,0 +1,112 @@
+/*
+ * event_notifier.h
+ *
+ *  eventfd based wakeup for one sleeping consumer. The consumer arms the
+ *  notifier, re-checks its queue and then waits; the producer only pays
+ *  for the write() system call when the consumer is actually asleep.
+ *
+ *    consumer:  for (;;) { drain(); n.arm(); if (!empty()) { n.disarm(); continue; } n.wait(ms); }
+ *    producer:  push(); n.notify();
+ *
+ *  fd() can also be put into a poll()/epoll set by the consumer.
+ */
+
+#ifndef EVENT_NOTIFIER_H_
+#define EVENT_NOTIFIER_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <atomic>
+
+class EventNotifier {
+public:
+    EventNotifier() : waiting_(false)
+    {
+        fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+
+    ~EventNotifier()
+    {
+        if (fd_ >= 0)
+            close(fd_);
+    }
+
+    int fd() const { return fd_; }
+
+    /* Consumer: announce the intent to sleep. Re-check for work afterwards. */
+    void arm()
+    {
+        waiting_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void disarm()
+    {
+        waiting_.store(false, std::memory_order_relaxed);
+    }
+
+    /* Consumer: sleep until notified or timeoutMs passes (-1 waits forever) */
+    bool wait(int timeoutMs)
+    {
+        struct pollfd pfd;
+        pfd.fd = fd_;
+        pfd.events = POLLIN;
+        bool woken = poll(&pfd, 1, timeoutMs) > 0;
+        if (woken)
+            clear();
+        disarm();
+        return woken;
+    }
+
+    /* Same with a timeout in microseconds, for timing that ms can't resolve */
+    bool waitUs(int64_t timeoutUs)
+    {
+        struct pollfd pfd;
+        pfd.fd = fd_;
+        pfd.events = POLLIN;
+        struct timespec ts;
+        ts.tv_sec = timeoutUs / 1000000;
+        ts.tv_nsec = (timeoutUs % 1000000) * 1000;
+        bool woken = ppoll(&pfd, 1, timeoutUs < 0 ? NULL : &ts, NULL) > 0;
+        if (woken)
+            clear();
+        disarm();
+        return woken;
+    }
+
+    /* Producer: wake the consumer if it is (about to be) asleep */
+    void notify()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting_.load(std::memory_order_relaxed))
+            signal();
+    }
+
+    /* Wake unconditionally, e.g. for shutdown */
+    void signal()
+    {
+        uint64_t one = 1;
+        ssize_t res = write(fd_, &one, sizeof one);
+        (void) res;
+    }
+
+    /* Reset the counter after the fd polled readable */
+    void clear()
+    {
+        uint64_t count;
+        ssize_t res = read(fd_, &count, sizeof count);
+        (void) res;
+    }
+
+private:
+    EventNotifier(const EventNotifier &);
+    EventNotifier &operator=(const EventNotifier &);
+
+    int fd_;
+    std::atomic<bool> waiting_;
+};
+
+#endif /* EVENT_NOTIFIER_H_ */
@@ -0,0 +1,307 @@
+//*****************************************//
+//  midi_batch_kernels.cpp
+//
+//  Scalar, SSE4.1 and AVX2 batch kernels
+//  with runtime dispatch.
+//
+//*****************************************//
+
+#include "midi_batch_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MIDI_BATCH_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Scalar kernels. Also used for the tail of every vector loop.
+ */
+
+static void channel_filter_scalar(const unsigned char *status, size_t n,
+                                  uint16_t channels, unsigned char *keep)
+{
+    for (size_t i = 0; i < n; i++)
+        if (midi_is_channel_message(status[i]) && !(channels >> (status[i] & 0x0F) & 1))
+            keep[i] = 0;
+}
+
+static inline bool is_note(unsigned char status)
+{
+    unsigned char type = status & 0xF0;
+    return type == MIDI_NOTE_OFF || type == MIDI_NOTE_ON || type == MIDI_POLY_PRESSURE;
+}
+
+static void transpose_scalar(const unsigned char *status, unsigned char *data1, size_t n,
+                             int shift, TransposeRange range, unsigned char *keep)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (!is_note(status[i]))
+            continue;
+        int note = (data1[i] & 0x7F) + shift;
+        if (note < 0 || note > 127) {
+            if (range == TRANSPOSE_DROP) {
+                keep[i] = 0;
+                continue;
+            }
+            note = note < 0 ? 0 : 127;
+        }
+        data1[i] = (unsigned char)note;
+    }
+}
+
+static void velocity_scalar(const unsigned char *status, unsigned char *data2, size_t n,
+                            const unsigned char table[128])
+{
+    for (size_t i = 0; i < n; i++)
+        if ((status[i] & 0xF0) == MIDI_NOTE_ON)
+            data2[i] = table[data2[i] & 0x7F];
+}
+
+#ifdef MIDI_BATCH_X86
+
+/*
+ * SSE4.1: 16 events per step. Channel bits and the velocity table are
+ * looked up with pshufb, eight 16 entry slices for the 128 entry table.
+ */
+
+static void channel_table(uint16_t channels, unsigned char table[16])
+{
+    for (int c = 0; c < 16; c++)
+        table[c] = (channels >> c & 1) ? 0xFF : 0;
+}
+
+__attribute__((target("sse4.1")))
+static void channel_filter_sse41(const unsigned char *status, size_t n,
+                                 uint16_t channels, unsigned char *keep)
+{
+    unsigned char bits[16];
+    channel_table(channels, bits);
+    const __m128i table = _mm_loadu_si128((const __m128i *)bits);
+    const __m128i low = _mm_set1_epi8(0x0F);
+    const __m128i system = _mm_set1_epi8((char)0xEF);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(status + i));
+        __m128i pass = _mm_shuffle_epi8(table, _mm_and_si128(s, low));
+        // status >= 0xF0 is a system message, signed compare on 0x80..0xFF
+        pass = _mm_or_si128(pass, _mm_cmpgt_epi8(s, system));
+        __m128i k = _mm_loadu_si128((const __m128i *)(keep + i));
+        _mm_storeu_si128((__m128i *)(keep + i), _mm_and_si128(k, pass));
+    }
+    channel_filter_scalar(status + i, n - i, channels, keep + i);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i note_mask_sse41(__m128i s)
+{
+    __m128i type = _mm_and_si128(s, _mm_set1_epi8((char)0xF0));
+    return _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(type, _mm_set1_epi8((char)MIDI_NOTE_OFF)),
+                                     _mm_cmpeq_epi8(type, _mm_set1_epi8((char)MIDI_NOTE_ON))),
+                        _mm_cmpeq_epi8(type, _mm_set1_epi8((char)MIDI_POLY_PRESSURE)));
+}
+
+__attribute__((target("sse4.1")))
+static void transpose_sse41(const unsigned char *status, unsigned char *data1, size_t n,
+                            int shift, TransposeRange range, unsigned char *keep)
+{
+    const __m128i delta = _mm_set1_epi8((char)shift);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i seven = _mm_set1_epi8(0x7F);
+    // Out of range: note > 127 - shift going up, note < -shift going down
+    const __m128i limit = _mm_set1_epi8((char)(shift > 0 ? 127 - shift : -shift));
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i note = note_mask_sse41(_mm_loadu_si128((const __m128i *)(status + i)));
+        __m128i d = _mm_loadu_si128((const __m128i *)(data1 + i));
+        __m128i v = _mm_and_si128(d, seven);
+        __m128i out = shift > 0 ? _mm_cmpgt_epi8(v, limit) : _mm_cmpgt_epi8(limit, v);
+        // Saturating add pins at 127, max pins at 0
+        __m128i moved = _mm_max_epi8(_mm_adds_epi8(v, delta), zero);
+        if (range == TRANSPOSE_DROP) {
+            __m128i lost = _mm_and_si128(note, out);
+            __m128i k = _mm_loadu_si128((const __m128i *)(keep + i));
+            _mm_storeu_si128((__m128i *)(keep + i), _mm_andnot_si128(lost, k));
+            note = _mm_andnot_si128(out, note);
+        }
+        _mm_storeu_si128((__m128i *)(data1 + i), _mm_blendv_epi8(d, moved, note));
+    }
+    transpose_scalar(status + i, data1 + i, n - i, shift, range, keep ? keep + i : 0);
+}
+
+__attribute__((target("sse4.1")))
+static void velocity_sse41(const unsigned char *status, unsigned char *data2, size_t n,
+                           const unsigned char table[128])
+{
+    __m128i slices[8];
+    for (int j = 0; j < 8; j++)
+        slices[j] = _mm_loadu_si128((const __m128i *)(table + 16 * j));
+    const __m128i low = _mm_set1_epi8(0x0F);
+    const __m128i typeMask = _mm_set1_epi8((char)0xF0);
+    const __m128i noteOn = _mm_set1_epi8((char)MIDI_NOTE_ON);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(status + i));
+        __m128i on = _mm_cmpeq_epi8(_mm_and_si128(s, typeMask), noteOn);
+        __m128i d = _mm_loadu_si128((const __m128i *)(data2 + i));
+        __m128i idx = _mm_and_si128(d, low);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(d, 4), _mm_set1_epi8(0x07));
+        __m128i r = _mm_setzero_si128();
+        for (int j = 0; j < 8; j++)
+            r = _mm_blendv_epi8(r, _mm_shuffle_epi8(slices[j], idx),
+                                _mm_cmpeq_epi8(hi, _mm_set1_epi8((char)j)));
+        _mm_storeu_si128((__m128i *)(data2 + i), _mm_blendv_epi8(d, r, on));
+    }
+    velocity_scalar(status + i, data2 + i, n - i, table);
+}
+
+/*
+ * AVX2: the same algorithms, 32 events per step. pshufb works per 128
+ * bit lane, so the lookup tables are broadcast into both lanes.
+ */
+
+__attribute__((target("avx2")))
+static void channel_filter_avx2(const unsigned char *status, size_t n,
+                                uint16_t channels, unsigned char *keep)
+{
+    unsigned char bits[16];
+    channel_table(channels, bits);
+    const __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)bits));
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    const __m256i system = _mm256_set1_epi8((char)0xEF);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(status + i));
+        __m256i pass = _mm256_shuffle_epi8(table, _mm256_and_si256(s, low));
+        pass = _mm256_or_si256(pass, _mm256_cmpgt_epi8(s, system));
+        __m256i k = _mm256_loadu_si256((const __m256i *)(keep + i));
+        _mm256_storeu_si256((__m256i *)(keep + i), _mm256_and_si256(k, pass));
+    }
+    channel_filter_scalar(status + i, n - i, channels, keep + i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i note_mask_avx2(__m256i s)
+{
+    __m256i type = _mm256_and_si256(s, _mm256_set1_epi8((char)0xF0));
+    return _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(type, _mm256_set1_epi8((char)MIDI_NOTE_OFF)),
+                                           _mm256_cmpeq_epi8(type, _mm256_set1_epi8((char)MIDI_NOTE_ON))),
+                           _mm256_cmpeq_epi8(type, _mm256_set1_epi8((char)MIDI_POLY_PRESSURE)));
+}
+
+__attribute__((target("avx2")))
+static void transpose_avx2(const unsigned char *status, unsigned char *data1, size_t n,
+                           int shift, TransposeRange range, unsigned char *keep)
+{
+    const __m256i delta = _mm256_set1_epi8((char)shift);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i seven = _mm256_set1_epi8(0x7F);
+    const __m256i limit = _mm256_set1_epi8((char)(shift > 0 ? 127 - shift : -shift));
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i note = note_mask_avx2(_mm256_loadu_si256((const __m256i *)(status + i)));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(data1 + i));
+        __m256i v = _mm256_and_si256(d, seven);
+        __m256i out = shift > 0 ? _mm256_cmpgt_epi8(v, limit) : _mm256_cmpgt_epi8(limit, v);
+        __m256i moved = _mm256_max_epi8(_mm256_adds_epi8(v, delta), zero);
+        if (range == TRANSPOSE_DROP) {
+            __m256i lost = _mm256_and_si256(note, out);
+            __m256i k = _mm256_loadu_si256((const __m256i *)(keep + i));
+            _mm256_storeu_si256((__m256i *)(keep + i), _mm256_andnot_si256(lost, k));
+            note = _mm256_andnot_si256(out, note);
+        }
+        _mm256_storeu_si256((__m256i *)(data1 + i), _mm256_blendv_epi8(d, moved, note));
+    }
+    transpose_scalar(status + i, data1 + i, n - i, shift, range, keep ? keep + i : 0);
+}
+
+__attribute__((target("avx2")))
+static void velocity_avx2(const unsigned char *status, unsigned char *data2, size_t n,
+                          const unsigned char table[128])
+{
+    __m256i slices[8];
+    for (int j = 0; j < 8; j++)
+        slices[j] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(table + 16 * j)));
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    const __m256i typeMask = _mm256_set1_epi8((char)0xF0);
+    const __m256i noteOn = _mm256_set1_epi8((char)MIDI_NOTE_ON);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(status + i));
+        __m256i on = _mm256_cmpeq_epi8(_mm256_and_si256(s, typeMask), noteOn);
+        __m256i d = _mm256_loadu_si256((const __m256i *)(data2 + i));
+        __m256i idx = _mm256_and_si256(d, low);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(d, 4), _mm256_set1_epi8(0x07));
+        __m256i r = _mm256_setzero_si256();
+        for (int j = 0; j < 8; j++)
+            r = _mm256_blendv_epi8(r, _mm256_shuffle_epi8(slices[j], idx),
+                                   _mm256_cmpeq_epi8(hi, _mm256_set1_epi8((char)j)));
+        _mm256_storeu_si256((__m256i *)(data2 + i), _mm256_blendv_epi8(d, r, on));
+    }
+    velocity_scalar(status + i, data2 + i, n - i, table);
+}
+
+#endif /* MIDI_BATCH_X86 */
+
+/*
+ * Dispatch
+ */
+
+struct BatchKernels {
+    void (*channelFilter)(const unsigned char *, size_t, uint16_t, unsigned char *);
+    void (*transpose)(const unsigned char *, unsigned char *, size_t, int, TransposeRange, unsigned char *);
+    void (*velocity)(const unsigned char *, unsigned char *, size_t, const unsigned char *);
+    const char *isa;
+};
+
+static BatchKernels select_kernels()
+{
+    BatchKernels k = { channel_filter_scalar, transpose_scalar, velocity_scalar, "scalar" };
+#ifdef MIDI_BATCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        BatchKernels avx2 = { channel_filter_avx2, transpose_avx2, velocity_avx2, "avx2" };
+        k = avx2;
+    } else if (__builtin_cpu_supports("sse4.1")) {
+        BatchKernels sse41 = { channel_filter_sse41, transpose_sse41, velocity_sse41, "sse4.1" };
+        k = sse41;
+    }
+#endif
+    return k;
+}
+
+static const BatchKernels &kernels()
+{
+    static const BatchKernels k = select_kernels();
+    return k;
+}
+
+void midi_batch_channel_filter(const unsigned char *status, size_t n,
+                               uint16_t channels, unsigned char *keep)
+{
+    kernels().channelFilter(status, n, channels, keep);
+}
+
+void midi_batch_transpose(const unsigned char *status, unsigned char *data1, size_t n,
+                          int shift, TransposeRange range, unsigned char *keep)
+{
+    if (shift == 0)
+        return;
+    // Shifts past +-127 move every note out of range and don't fit the
+    // 8 bit lanes; the scalar loop handles them.
+    if (shift > 127 || shift < -127) {
+        transpose_scalar(status, data1, n, shift, range, keep);
+        return;
+    }
+    kernels().transpose(status, data1, n, shift, range, keep);
+}
+
+void midi_batch_velocity(const unsigned char *status, unsigned char *data2, size_t n,
+                         const unsigned char table[128])
+{
+    kernels().velocity(status, data2, n, table);
+}
+
+const char *midi_batch_isa()
+{
+    return kernels().isa;
+}
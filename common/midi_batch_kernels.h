@@ -0,0 +1,47 @@
+/*
+ * midi_batch_kernels.h
+ *
+ *  Bulk transforms over structure-of-arrays event batches (parallel
+ *  status[] / data1[] / data2[] arrays, one entry per channel message,
+ *  as kept by EventBatch). They do the same job as the per-message stages
+ *  in midi_pipeline.h but over thousands of events at once, for offline
+ *  work on whole recordings. The relay applies no transforms and the
+ *  client's live input path sees one message at a time, so both keep
+ *  using the per-message stages.
+ *
+ *  Each kernel has a scalar version plus SSE4.1 and AVX2 versions built
+ *  with target attributes. The best one for the running CPU is chosen
+ *  once, on first use, so the binary still runs on CPUs without them.
+ *
+ *  keep[] holds one byte per event, 0xFF to keep and 0 to drop. The
+ *  kernels only ever clear entries, so filters can be chained on one
+ *  keep array and compacted afterwards.
+ */
+
+#ifndef MIDI_BATCH_KERNELS_H_
+#define MIDI_BATCH_KERNELS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "midi_transpose.h"
+
+/* Drop channel messages whose channel bit (bit 0 = channel 1) is clear. */
+void midi_batch_channel_filter(const unsigned char *status, size_t n,
+                               uint16_t channels, unsigned char *keep);
+
+/*
+ * Transpose note messages in data1. With TRANSPOSE_DROP, notes that leave
+ * 0..127 are cleared in keep and left unchanged; keep may be 0 with
+ * TRANSPOSE_CLAMP.
+ */
+void midi_batch_transpose(const unsigned char *status, unsigned char *data1, size_t n,
+                          int shift, TransposeRange range, unsigned char *keep);
+
+/* Map note on velocities in data2 through a 128 entry table. */
+void midi_batch_velocity(const unsigned char *status, unsigned char *data2, size_t n,
+                         const unsigned char table[128]);
+
+/* Instruction set the kernels dispatch to: "avx2", "sse4.1" or "scalar". */
+const char *midi_batch_isa();
+
+#endif /* MIDI_BATCH_KERNELS_H_ */
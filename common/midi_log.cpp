@@ -0,0 +1,92 @@
+//*****************************************//
+//  midi_log.cpp
+//
+//  Background formatter for MidiLog.
+//
+//*****************************************//
+
+#include <string.h>
+#include "midi_log.h"
+
+MidiLog::MidiLog(FILE *out, size_t ringBytes)
+    : out_(out), ring_(ringBytes), running_(true), dropped_(0)
+{
+    thread_ = std::thread(&MidiLog::run, this);
+}
+
+MidiLog::~MidiLog()
+{
+    running_ = false;
+    notify_.signal();
+    thread_.join();
+}
+
+void MidiLog::record(double stamp, const unsigned char *in, size_t inSize,
+                     const unsigned char *out, size_t outSize)
+{
+    Header h;
+    h.stamp = stamp;
+    h.inSize = (unsigned short)inSize;
+    h.outSize = (unsigned short)outSize;
+
+    unsigned char bytes[2 * MIDI_LOG_MAX_BYTES];
+    size_t nIn = inSize < MIDI_LOG_MAX_BYTES ? inSize : MIDI_LOG_MAX_BYTES;
+    size_t nOut = outSize < MIDI_LOG_MAX_BYTES ? outSize : MIDI_LOG_MAX_BYTES;
+    if (nIn)
+        memcpy(bytes, in, nIn);
+    if (nOut)
+        memcpy(bytes + nIn, out, nOut);
+
+    if (!ring_.push(&h, sizeof h, bytes, nIn + nOut)) {
+        dropped_++;
+        return;
+    }
+    notify_.notify();
+}
+
+void MidiLog::print(const std::vector<unsigned char> &record)
+{
+    Header h;
+    memcpy(&h, &record[0], sizeof h);
+    const unsigned char *bytes = &record[sizeof h];
+    size_t nIn = h.inSize < MIDI_LOG_MAX_BYTES ? h.inSize : MIDI_LOG_MAX_BYTES;
+    size_t nOut = h.outSize < MIDI_LOG_MAX_BYTES ? h.outSize : MIDI_LOG_MAX_BYTES;
+
+    fprintf(out_, "in:");
+    for (size_t i = 0; i < nIn; i++)
+        fprintf(out_, " %02x", bytes[i]);
+    if (h.inSize > nIn)
+        fprintf(out_, " ... (%u bytes)", h.inSize);
+    fprintf(out_, "  out:");
+    if (h.outSize == 0)
+        fprintf(out_, " dropped");
+    for (size_t i = 0; i < nOut; i++)
+        fprintf(out_, " %02x", bytes[nIn + i]);
+    if (h.outSize > nOut)
+        fprintf(out_, " ... (%u bytes)", h.outSize);
+    fprintf(out_, "  stamp = %f\n", h.stamp);
+}
+
+void MidiLog::run()
+{
+    std::vector<unsigned char> record;
+    for (;;) {
+        bool any = false;
+        while (ring_.pop(record)) {
+            print(record);
+            any = true;
+        }
+        if (any)
+            fflush(out_);
+        if (!running_)
+            break;
+        notify_.arm();
+        if (!ring_.empty() || !running_) {
+            notify_.disarm();
+            continue;
+        }
+        notify_.wait(-1);
+    }
+    if (dropped_)
+        fprintf(out_, "midi log: %lu records dropped\n", (unsigned long)dropped_);
+}
@@ -0,0 +1,51 @@
+/*
+ * midi_log.h
+ *
+ *  Asynchronous MIDI traffic log. The real-time thread only copies a
+ *  small binary record into a lock-free ring; a background thread does
+ *  the formatting and the console I/O. When the ring is full records are
+ *  dropped (and counted) rather than ever blocking the caller.
+ */
+
+#ifndef MIDI_LOG_H_
+#define MIDI_LOG_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <atomic>
+#include <thread>
+#include "event_notifier.h"
+#include "spsc_ring.h"
+
+#define MIDI_LOG_MAX_BYTES 16   // bytes of each message kept in a record
+
+class MidiLog {
+public:
+    explicit MidiLog(FILE *out = stdout, size_t ringBytes = 1 << 16);
+    ~MidiLog();
+
+    /* Log a message before and after processing. Single producer thread. */
+    void record(double stamp, const unsigned char *in, size_t inSize,
+                const unsigned char *out, size_t outSize);
+
+    unsigned long dropped() const { return dropped_; }
+
+private:
+    struct Header {
+        double stamp;
+        unsigned short inSize;      // original sizes, bytes are truncated
+        unsigned short outSize;
+    };
+
+    void run();
+    void print(const std::vector<unsigned char> &record);
+
+    FILE *out_;
+    SpscRing ring_;
+    EventNotifier notify_;
+    std::atomic<bool> running_;
+    std::atomic<unsigned long> dropped_;
+    std::thread thread_;
+};
+
+#endif /* MIDI_LOG_H_ */
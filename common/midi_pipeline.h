@@ -0,0 +1,239 @@
+/*
+ * midi_pipeline.h
+ *
+ *  Chains of per-message transforms for the MIDI input path. Every stage
+ *  works in place on one raw message and returns false to drop it.
+ *
+ *  Pipeline<...> composes stages at compile time and inlines the whole
+ *  chain into the caller:
+ *
+ *      typedef Pipeline<ChannelFilter<1>, Transpose<+12>,
+ *                       VelocityCurve<VELOCITY_LOG> > Chain;
+ *      if (Chain::apply(msg, n)) ...
+ *
+ *  MidiPipeline is the runtime-configured equivalent. Its stages are
+ *  plain records dispatched through a switch, so neither variant pays for
+ *  a virtual call per stage per message. Channels are 1-based here, as
+ *  they are shown to users.
+ */
+
+#ifndef MIDI_PIPELINE_H_
+#define MIDI_PIPELINE_H_
+
+#include <math.h>
+#include <stddef.h>
+#include <vector>
+#include "midi_util.h"
+#include "midi_transpose.h"
+
+enum VelocityShape {
+    VELOCITY_LINEAR,
+    VELOCITY_LOG,       // soft playing comes out louder
+    VELOCITY_EXP        // soft playing comes out softer
+};
+
+/* Fill a 128 entry velocity table. Zero stays zero (it means note off). */
+inline void midi_velocity_table(VelocityShape shape, unsigned char table[128])
+{
+    const double k = 8.0;   // curvature
+    table[0] = 0;
+    for (int v = 1; v < 128; v++) {
+        double x = v / 127.0, y = x;
+        if (shape == VELOCITY_LOG) y = log(1 + k * x) / log(1 + k);
+        else if (shape == VELOCITY_EXP) y = (pow(1 + k, x) - 1) / k;
+        int out = (int)(y * 127 + 0.5);
+        table[v] = (unsigned char)(out < 1 ? 1 : out > 127 ? 127 : out);
+    }
+}
+
+/*
+ * Stage primitives, shared by both pipeline variants.
+ */
+
+/* Pass channel messages on one channel (1-16); system messages pass. */
+inline bool midi_stage_channel_filter(const unsigned char *msg, size_t n, int channel)
+{
+    if (n == 0 || !midi_is_channel_message(msg[0])) return true;
+    return (msg[0] & 0x0F) == channel - 1;
+}
+
+/* Move channel messages from one channel (1-16) to another. */
+inline bool midi_stage_channel_remap(unsigned char *msg, size_t n, int from, int to)
+{
+    if (n && midi_is_channel_message(msg[0]) && (msg[0] & 0x0F) == from - 1)
+        msg[0] = (unsigned char)((msg[0] & 0xF0) | ((to - 1) & 0x0F));
+    return true;
+}
+
+/* Keep note messages whose note lies in lo..hi; others pass untouched. */
+inline bool midi_stage_note_range(const unsigned char *msg, size_t n, int lo, int hi)
+{
+    if (n < 3) return true;
+    unsigned char type = msg[0] & 0xF0;
+    if (type != MIDI_NOTE_ON && type != MIDI_NOTE_OFF && type != MIDI_POLY_PRESSURE)
+        return true;
+    return msg[1] >= lo && msg[1] <= hi;
+}
+
+/* Renumber one controller. */
+inline bool midi_stage_cc_remap(unsigned char *msg, size_t n, int from, int to)
+{
+    if (n >= 3 && (msg[0] & 0xF0) == MIDI_CONTROL_CHANGE && msg[1] == from)
+        msg[1] = (unsigned char)(to & 0x7F);
+    return true;
+}
+
+/* Map note on velocities through a table. */
+inline bool midi_stage_velocity(unsigned char *msg, size_t n, const unsigned char table[128])
+{
+    if (n >= 3 && (msg[0] & 0xF0) == MIDI_NOTE_ON)
+        msg[2] = table[msg[2] & 0x7F];
+    return true;
+}
+
+/* Drop system realtime bytes (clock, start/stop, active sensing, reset). */
+inline bool midi_stage_drop_realtime(const unsigned char *msg, size_t n)
+{
+    return n == 0 || msg[0] < 0xF8;
+}
+
+/*
+ * Compile-time stages
+ */
+
+template <int Channel>
+struct ChannelFilter {
+    static bool apply(unsigned char *msg, size_t n)
+    { return midi_stage_channel_filter(msg, n, Channel); }
+};
+
+template <int From, int To>
+struct ChannelRemap {
+    static bool apply(unsigned char *msg, size_t n)
+    { return midi_stage_channel_remap(msg, n, From, To); }
+};
+
+template <int Shift, TransposeRange Range = TRANSPOSE_CLAMP>
+struct Transpose {
+    static bool apply(unsigned char *msg, size_t n)
+    { return midi_transpose(msg, n, Shift, Range); }
+};
+
+template <int Lo, int Hi>
+struct NoteRange {
+    static bool apply(unsigned char *msg, size_t n)
+    { return midi_stage_note_range(msg, n, Lo, Hi); }
+};
+
+template <int From, int To>
+struct CcRemap {
+    static bool apply(unsigned char *msg, size_t n)
+    { return midi_stage_cc_remap(msg, n, From, To); }
+};
+
+template <VelocityShape Shape>
+struct VelocityCurve {
+    static bool apply(unsigned char *msg, size_t n)
+    { return midi_stage_velocity(msg, n, table.values); }
+
+private:
+    struct Table {
+        Table() { midi_velocity_table(Shape, values); }
+        unsigned char values[128];
+    };
+    static const Table table;   // built during static initialisation
+};
+
+template <VelocityShape Shape>
+const typename VelocityCurve<Shape>::Table VelocityCurve<Shape>::table;
+
+struct DropRealtime {
+    static bool apply(unsigned char *msg, size_t n)
+    { return midi_stage_drop_realtime(msg, n); }
+};
+
+template <typename... Stages>
+struct Pipeline;
+
+template <>
+struct Pipeline<> {
+    static bool apply(unsigned char *, size_t) { return true; }
+};
+
+template <typename First, typename... Rest>
+struct Pipeline<First, Rest...> {
+    static bool apply(unsigned char *msg, size_t n)
+    { return First::apply(msg, n) && Pipeline<Rest...>::apply(msg, n); }
+};
+
+/*
+ * Runtime-configured pipeline. Build it before the input callback is
+ * installed; apply() itself never allocates.
+ */
+class MidiPipeline {
+public:
+    void channelFilter(int channel)     { add(STAGE_CHANNEL_FILTER, channel, 0); }
+    void channelRemap(int from, int to) { add(STAGE_CHANNEL_REMAP, from, to); }
+    void transpose(int shift, TransposeRange range = TRANSPOSE_CLAMP)
+    { if (shift) add(STAGE_TRANSPOSE, shift, range); }
+    void noteRange(int lo, int hi)      { add(STAGE_NOTE_RANGE, lo, hi); }
+    void ccRemap(int from, int to)      { add(STAGE_CC_REMAP, from, to); }
+    void dropRealtime()                 { add(STAGE_DROP_REALTIME, 0, 0); }
+    void velocityCurve(VelocityShape shape)
+    {
+        add(STAGE_VELOCITY, 0, 0);
+        midi_velocity_table(shape, stages_.back().table);
+    }
+
+    void clear()       { stages_.clear(); }
+    bool empty() const { return stages_.empty(); }
+
+    bool apply(unsigned char *msg, size_t n) const
+    {
+        for (size_t i = 0; i < stages_.size(); i++) {
+            const Stage &s = stages_[i];
+            bool keep = true;
+            switch (s.type) {
+            case STAGE_CHANNEL_FILTER: keep = midi_stage_channel_filter(msg, n, s.a); break;
+            case STAGE_CHANNEL_REMAP:  keep = midi_stage_channel_remap(msg, n, s.a, s.b); break;
+            case STAGE_TRANSPOSE:      keep = midi_transpose(msg, n, s.a, (TransposeRange)s.b); break;
+            case STAGE_NOTE_RANGE:     keep = midi_stage_note_range(msg, n, s.a, s.b); break;
+            case STAGE_CC_REMAP:       keep = midi_stage_cc_remap(msg, n, s.a, s.b); break;
+            case STAGE_VELOCITY:       keep = midi_stage_velocity(msg, n, s.table); break;
+            case STAGE_DROP_REALTIME:  keep = midi_stage_drop_realtime(msg, n); break;
+            }
+            if (!keep) return false;
+        }
+        return true;
+    }
+
+private:
+    enum StageType {
+        STAGE_CHANNEL_FILTER,
+        STAGE_CHANNEL_REMAP,
+        STAGE_TRANSPOSE,
+        STAGE_NOTE_RANGE,
+        STAGE_CC_REMAP,
+        STAGE_VELOCITY,
+        STAGE_DROP_REALTIME
+    };
+
+    struct Stage {
+        StageType type;
+        int a, b;
+        unsigned char table[128];   // velocity curve only
+    };
+
+    void add(StageType type, int a, int b)
+    {
+        Stage s;
+        s.type = type;
+        s.a = a;
+        s.b = b;
+        stages_.push_back(s);
+    }
+
+    std::vector<Stage> stages_;
+};
+
+#endif /* MIDI_PIPELINE_H_ */
@@ -0,0 +1,235 @@
+//*****************************************//
+//  midi_state.cpp
+//
+//  Incremental per-channel MIDI state model
+//  used for late-joiner snapshots.
+//
+//*****************************************//
+
+#include <string.h>
+#include "midi_util.h"
+#include "midi_state.h"
+
+static inline bool test_bit(const uint64_t *set, int bit)
+{
+    return (set[bit >> 6] >> (bit & 63)) & 1;
+}
+
+static inline void set_bit(uint64_t *set, int bit)
+{
+    set[bit >> 6] |= (uint64_t)1 << (bit & 63);
+}
+
+static inline void clear_bit(uint64_t *set, int bit)
+{
+    set[bit >> 6] &= ~((uint64_t)1 << (bit & 63));
+}
+
+static inline void put(std::vector<unsigned char> &out, unsigned char a, unsigned char b)
+{
+    out.push_back(a);
+    out.push_back(b);
+}
+
+static inline void put(std::vector<unsigned char> &out, unsigned char a, unsigned char b, unsigned char c)
+{
+    out.push_back(a);
+    out.push_back(b);
+    out.push_back(c);
+}
+
+/* Controllers Reset All Controllers returns to their defaults (RP-015) */
+static const unsigned char reset_controllers[] = {
+    1, 33,                      // modulation
+    11, 43,                     // expression
+    64, 65, 66, 67,             // sustain, portamento, sostenuto, soft pedal
+    98, 99, 100, 101            // NRPN and RPN selection
+};
+
+void MidiState::reset()
+{
+    for (int ch = 0; ch < 16; ch++)
+        resetChannel(ch);
+    activeChannels_ = 0;
+}
+
+void MidiState::resetChannel(int ch)
+{
+    Channel &c = channels_[ch];
+    memset(c.keys, 0, sizeof c.keys);
+    memset(c.sustained, 0, sizeof c.sustained);
+    memset(c.ccSet, 0, sizeof c.ccSet);
+    memset(c.touched, 0, sizeof c.touched);
+    c.program = -1;
+    c.pressure = -1;
+    c.bend = -1;
+}
+
+void MidiState::update(const unsigned char *msg, size_t n)
+{
+    if (n == 0 || n < midi_channel_message_size(msg[0]))
+        return;
+    int ch = msg[0] & 0x0F;
+    Channel &c = channels_[ch];
+
+    switch (msg[0] & 0xF0) {
+    case MIDI_NOTE_ON:
+        if (msg[2] != 0) {
+            set_bit(c.keys, msg[1]);
+            clear_bit(c.sustained, msg[1]);
+            clear_bit(c.touched, msg[1]);
+            c.velocity[msg[1]] = msg[2];
+            markActive(ch);
+            break;
+        }
+        // Velocity 0 is a note off
+        // fall through
+    case MIDI_NOTE_OFF:
+        if (!test_bit(c.keys, msg[1]))
+            break;
+        clear_bit(c.keys, msg[1]);
+        clear_bit(c.touched, msg[1]);
+        if (test_bit(c.ccSet, MIDI_CC_SUSTAIN) && c.cc[MIDI_CC_SUSTAIN] >= 64)
+            set_bit(c.sustained, msg[1]);
+        break;
+    case MIDI_CONTROL_CHANGE:
+        switch (msg[1]) {
+        case MIDI_CC_ALL_SOUND_OFF:
+        case MIDI_CC_ALL_NOTES_OFF:
+            memset(c.keys, 0, sizeof c.keys);
+            memset(c.sustained, 0, sizeof c.sustained);
+            memset(c.touched, 0, sizeof c.touched);
+            break;
+        case MIDI_CC_RESET_ALL:
+            // Only what RP-015 resets; volume, pan, bank and the rest stay.
+            // A fresh synth has these at their defaults, so forget them.
+            for (size_t i = 0; i < sizeof reset_controllers; i++)
+                clear_bit(c.ccSet, reset_controllers[i]);
+            c.pressure = -1;
+            c.bend = -1;
+            memset(c.sustained, 0, sizeof c.sustained);
+            memset(c.touched, 0, sizeof c.touched);
+            break;
+        default:
+            // Remaining channel mode messages (122-127) carry no state we replay
+            if (msg[1] >= MIDI_CC_ALL_SOUND_OFF)
+                break;
+            c.cc[msg[1]] = msg[2];
+            set_bit(c.ccSet, msg[1]);
+            if (msg[1] == MIDI_CC_SUSTAIN && msg[2] < 64)
+                memset(c.sustained, 0, sizeof c.sustained);
+            markActive(ch);
+            break;
+        }
+        break;
+    case MIDI_PROGRAM_CHANGE:
+        c.program = msg[1];
+        markActive(ch);
+        break;
+    case MIDI_CHANNEL_PRESSURE:
+        c.pressure = msg[1];
+        markActive(ch);
+        break;
+    case MIDI_PITCH_BEND:
+        c.bend = msg[1] | (msg[2] << 7);
+        markActive(ch);
+        break;
+    case MIDI_POLY_PRESSURE:
+        // Key pressure only means something while the key is down
+        if (test_bit(c.keys, msg[1])) {
+            c.touch[msg[1]] = msg[2];
+            set_bit(c.touched, msg[1]);
+        }
+        break;
+    }
+}
+
+void MidiState::snapshot(std::vector<unsigned char> &out) const
+{
+    render(out, true);
+}
+
+void MidiState::settings(std::vector<unsigned char> &out) const
+{
+    render(out, false);
+}
+
+void MidiState::render(std::vector<unsigned char> &out, bool notes) const
+{
+    for (int ch = 0; ch < 16; ch++) {
+        if (!(activeChannels_ & (1u << ch)))
+            continue;
+        const Channel &c = channels_[ch];
+
+        // Bank select has to precede the program change it qualifies
+        if (test_bit(c.ccSet, MIDI_CC_BANK_MSB))
+            put(out, MIDI_CONTROL_CHANGE | ch, MIDI_CC_BANK_MSB, c.cc[MIDI_CC_BANK_MSB]);
+        if (test_bit(c.ccSet, MIDI_CC_BANK_LSB))
+            put(out, MIDI_CONTROL_CHANGE | ch, MIDI_CC_BANK_LSB, c.cc[MIDI_CC_BANK_LSB]);
+        if (c.program >= 0)
+            put(out, MIDI_PROGRAM_CHANGE | ch, c.program);
+
+        for (int cc = 0; cc < MIDI_CC_ALL_SOUND_OFF; cc++) {
+            if (cc == MIDI_CC_BANK_MSB || cc == MIDI_CC_BANK_LSB || !test_bit(c.ccSet, cc))
+                continue;
+            put(out, MIDI_CONTROL_CHANGE | ch, cc, c.cc[cc]);
+        }
+        if (c.bend >= 0)
+            put(out, MIDI_PITCH_BEND | ch, c.bend & 0x7F, (c.bend >> 7) & 0x7F);
+        if (c.pressure >= 0)
+            put(out, MIDI_CHANNEL_PRESSURE | ch, c.pressure);
+        if (!notes)
+            continue;
+
+        // Sounding notes. Pedal-held notes are struck and released again so
+        // the (already replayed) sustain pedal keeps them alive until it lifts.
+        for (int w = 0; w < 2; w++) {
+            uint64_t sounding = c.keys[w] | c.sustained[w];
+            while (sounding) {
+                int note = w * 64 + __builtin_ctzll(sounding);
+                sounding &= sounding - 1;
+                put(out, MIDI_NOTE_ON | ch, note, c.velocity[note]);
+            }
+        }
+        for (int w = 0; w < 2; w++) {
+            uint64_t touched = c.touched[w];
+            while (touched) {
+                int note = w * 64 + __builtin_ctzll(touched);
+                touched &= touched - 1;
+                put(out, MIDI_POLY_PRESSURE | ch, note, c.touch[note]);
+            }
+        }
+        for (int w = 0; w < 2; w++) {
+            uint64_t released = c.sustained[w];
+            while (released) {
+                int note = w * 64 + __builtin_ctzll(released);
+                released &= released - 1;
+                put(out, MIDI_NOTE_OFF | ch, note, 0);
+            }
+        }
+    }
+}
+
+void MidiState::controllers(std::vector<unsigned char> &out) const
+{
+    for (int ch = 0; ch < 16; ch++) {
+        if (!(activeChannels_ & (1u << ch)))
+            continue;
+        const Channel &c = channels_[ch];
+        for (int cc = 0; cc < MIDI_CC_ALL_SOUND_OFF; cc++) {
+            if (midi_cc_is_ordered(cc) || !test_bit(c.ccSet, cc))
+                continue;
+            put(out, MIDI_CONTROL_CHANGE | ch, cc, c.cc[cc]);
+        }
+        if (c.pressure >= 0)
+            put(out, MIDI_CHANNEL_PRESSURE | ch, c.pressure);
+        for (int w = 0; w < 2; w++) {
+            uint64_t touched = c.touched[w];
+            while (touched) {
+                int note = w * 64 + __builtin_ctzll(touched);
+                touched &= touched - 1;
+                put(out, MIDI_POLY_PRESSURE | ch, note, c.touch[note]);
+            }
+        }
+    }
+}
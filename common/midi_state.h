@@ -0,0 +1,71 @@
+/*
+ * midi_state.h
+ *
+ *  Compact model of the sounding state of a MIDI stream: for each of the
+ *  16 channels the keys held down, notes kept alive by the sustain pedal,
+ *  controller values, program, pitch bend, channel pressure and the key
+ *  pressure of held notes. It is updated message by message and can
+ *  render itself back into the minimal list of messages that reproduces
+ *  that state on a fresh synth, which is what a late joiner receives
+ *  instead of the stream history.
+ */
+
+#ifndef MIDI_STATE_H_
+#define MIDI_STATE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+class MidiState {
+public:
+    MidiState() { reset(); }
+
+    void reset();
+
+    /* Apply one complete MIDI message. Non channel messages are ignored. */
+    void update(const unsigned char *msg, size_t n);
+
+    /*
+     * Append a byte stream of channel messages (running status not used)
+     * that recreates the current state: bank select and program first,
+     * then controllers, bend and pressure, then the sounding notes and
+     * their key pressure.
+     */
+    void snapshot(std::vector<unsigned char> &out) const;
+
+    /* The same without the sounding notes: just the channel settings */
+    void settings(std::vector<unsigned char> &out) const;
+
+    /*
+     * Append the current value of every continuous controller that has
+     * been sent, the ones a CcCoalescer may hold back, followed by the
+     * channel pressure and the key pressure of held notes.
+     */
+    void controllers(std::vector<unsigned char> &out) const;
+
+    bool empty() const { return activeChannels_ == 0; }
+
+private:
+    struct Channel {
+        uint64_t keys[2];           // keys held down
+        uint64_t sustained[2];      // released keys still held by the pedal
+        uint64_t ccSet[2];          // controllers that have been sent
+        uint64_t touched[2];        // held keys with a key pressure value
+        unsigned char velocity[128];
+        unsigned char touch[128];   // polyphonic key pressure
+        unsigned char cc[128];
+        short program;              // -1 if never sent
+        short pressure;             // -1 if never sent
+        int bend;                   // -1 if never sent, else 14 bit value
+    };
+
+    void resetChannel(int ch);
+    void render(std::vector<unsigned char> &out, bool notes) const;
+    void markActive(int ch) { activeChannels_ |= (uint16_t)(1u << ch); }
+
+    Channel channels_[16];
+    uint16_t activeChannels_;       // channels with any recorded state
+};
+
+#endif /* MIDI_STATE_H_ */
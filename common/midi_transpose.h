@@ -0,0 +1,42 @@
+/*
+ * midi_transpose.h
+ *
+ *  Real-time safe, in-place transposition. Only messages that carry a
+ *  note number (note off, note on, polyphonic key pressure) are touched;
+ *  controllers, bend, SysEx and realtime bytes pass through unchanged.
+ *  Notes shifted outside 0..127 are either clamped to the range or
+ *  dropped. Both modes are deterministic per note number, so the note
+ *  off of a clamped or dropped note on is treated exactly the same way.
+ */
+
+#ifndef MIDI_TRANSPOSE_H_
+#define MIDI_TRANSPOSE_H_
+
+#include <stddef.h>
+#include "midi_util.h"
+
+enum TransposeRange {
+    TRANSPOSE_CLAMP,        // pin out of range notes to 0 or 127
+    TRANSPOSE_DROP          // discard out of range notes
+};
+
+/* Transpose msg in place. Returns false if the message should be dropped. */
+inline bool midi_transpose(unsigned char *msg, size_t n, int shift, TransposeRange range)
+{
+    if (shift == 0 || n < 3)
+        return true;
+    unsigned char type = msg[0] & 0xF0;
+    if (type != MIDI_NOTE_ON && type != MIDI_NOTE_OFF && type != MIDI_POLY_PRESSURE)
+        return true;
+
+    int note = (msg[1] & 0x7F) + shift;
+    if (note < 0 || note > 127) {
+        if (range == TRANSPOSE_DROP)
+            return false;
+        note = note < 0 ? 0 : 127;
+    }
+    msg[1] = (unsigned char)note;
+    return true;
+}
+
+#endif /* MIDI_TRANSPOSE_H_ */
@@ -0,0 +1,120 @@
+/*
+ * midi_util.h
+ *
+ *  Small helpers for classifying raw MIDI messages, shared by the
+ *  client and the server.
+ */
+
+#ifndef MIDI_UTIL_H_
+#define MIDI_UTIL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Channel voice status nibbles */
+#define MIDI_NOTE_OFF         0x80
+#define MIDI_NOTE_ON          0x90
+#define MIDI_POLY_PRESSURE    0xA0
+#define MIDI_CONTROL_CHANGE   0xB0
+#define MIDI_PROGRAM_CHANGE   0xC0
+#define MIDI_CHANNEL_PRESSURE 0xD0
+#define MIDI_PITCH_BEND       0xE0
+
+/* Controllers with special meaning for note state */
+#define MIDI_CC_BANK_MSB        0
+#define MIDI_CC_BANK_LSB        32
+#define MIDI_CC_SUSTAIN         64
+#define MIDI_CC_ALL_SOUND_OFF   120
+#define MIDI_CC_RESET_ALL       121
+#define MIDI_CC_ALL_NOTES_OFF   123
+
+/* Monotonic clock in microseconds */
+inline uint64_t monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Wall clock in microseconds since the epoch, for anything persisted */
+inline uint64_t realtime_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* True for channel voice messages (0x80 - 0xEF) */
+inline bool midi_is_channel_message(unsigned char status)
+{
+    return status >= 0x80 && status < 0xF0;
+}
+
+/* Length of a channel voice message from its status byte, 0 if not one */
+inline size_t midi_channel_message_size(unsigned char status)
+{
+    if (!midi_is_channel_message(status)) return 0;
+    unsigned char type = status & 0xF0;
+    return (type == MIDI_PROGRAM_CHANGE || type == MIDI_CHANNEL_PRESSURE) ? 2 : 3;
+}
+
+/* Note off, or note on with zero velocity */
+inline bool midi_is_note_off(const unsigned char *msg, size_t n)
+{
+    if (n < 3) return false;
+    unsigned char type = msg[0] & 0xF0;
+    return type == MIDI_NOTE_OFF || (type == MIDI_NOTE_ON && msg[2] == 0);
+}
+
+/*
+ * Messages that end sounding notes: note offs, sustain pedal release
+ * and the all-notes/all-sound-off controllers. These must never be
+ * dropped or coalesced away or listeners are left with hanging notes.
+ */
+inline bool midi_is_release(const unsigned char *msg, size_t n)
+{
+    if (midi_is_note_off(msg, n)) return true;
+    if (n < 3 || (msg[0] & 0xF0) != MIDI_CONTROL_CHANGE) return false;
+    if (msg[1] == MIDI_CC_SUSTAIN) return msg[2] < 64;
+    return msg[1] == MIDI_CC_ALL_SOUND_OFF || msg[1] == MIDI_CC_ALL_NOTES_OFF;
+}
+
+/*
+ * Controllers whose order relative to other messages matters and that
+ * must never be merged or held back: bank select, RPN/NRPN selection and
+ * data entry, pedals and switches, and the channel mode messages.
+ */
+inline bool midi_cc_is_ordered(int controller)
+{
+    switch (controller) {
+    case MIDI_CC_BANK_MSB: case MIDI_CC_BANK_LSB:
+    case 6: case 38: case 96: case 97: case 98: case 99: case 100: case 101:
+    case 64: case 65: case 66: case 67: case 68: case 69:
+        return true;
+    default:
+        return controller >= MIDI_CC_ALL_SOUND_OFF;
+    }
+}
+
+/*
+ * Key identifying a continuous controller "slot" whose latest value
+ * supersedes earlier ones: control change (per controller), pitch bend
+ * and channel pressure. Returns -1 for everything else, including the
+ * ordered controllers, where every value counts.
+ */
+inline int midi_coalesce_key(const unsigned char *msg, size_t n)
+{
+    if (n < 2) return -1;
+    unsigned char type = msg[0] & 0xF0;
+    int channel = msg[0] & 0x0F;
+    if (type == MIDI_CONTROL_CHANGE && n >= 3)
+        return midi_cc_is_ordered(msg[1]) ? -1 : channel * 130 + msg[1];
+    if (type == MIDI_PITCH_BEND && n >= 3) return channel * 130 + 128;
+    if (type == MIDI_CHANNEL_PRESSURE) return channel * 130 + 129;
+    return -1;
+}
+
+#define MIDI_COALESCE_KEYS (16 * 130)
+
+#endif /* MIDI_UTIL_H_ */
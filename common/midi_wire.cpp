@@ -0,0 +1,127 @@
+//*****************************************//
+//  midi_wire.cpp
+//
+//  Encoding and stream reassembly of the
+//  relay wire frames (see midi_wire.h).
+//
+//*****************************************//
+
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include "midi_wire.h"
+
+bool wire_encode(std::vector<unsigned char> &out, unsigned char type, unsigned char flags,
+                 uint32_t seq, uint32_t time, const unsigned char *body, size_t n)
+{
+    if (n > WIRE_MAX_BODY)
+        return false;
+    size_t at = out.size();
+    out.resize(at + WIRE_HEADER_SIZE + n);
+    unsigned char *p = &out[at];
+    wire_put16(p, (uint32_t)n);
+    p[2] = type;
+    p[3] = flags;
+    wire_put32(p + 4, seq);
+    wire_put32(p + 8, time);
+    if (n)
+        memcpy(p + WIRE_HEADER_SIZE, body, n);
+    return true;
+}
+
+bool wire_encode(std::vector<unsigned char> &out, const WireFrame &frame)
+{
+    return wire_encode(out, frame.type, frame.flags, frame.seq, frame.time,
+                       frame.body.empty() ? NULL : &frame.body[0], frame.body.size());
+}
+
+void WireReader::feed(const unsigned char *data, size_t n)
+{
+    // Compact once the consumed prefix dominates the buffer
+    if (start_ > 0 && start_ >= buffer_.size() / 2) {
+        buffer_.erase(buffer_.begin(), buffer_.begin() + start_);
+        start_ = 0;
+    }
+    buffer_.insert(buffer_.end(), data, data + n);
+}
+
+bool WireReader::next(WireFrame &frame)
+{
+    if (pending() < WIRE_HEADER_SIZE)
+        return false;
+    const unsigned char *p = &buffer_[start_];
+    size_t length = wire_get16(p);
+    if (pending() < WIRE_HEADER_SIZE + length)
+        return false;
+
+    frame.type = p[2];
+    frame.flags = p[3];
+    frame.seq = wire_get32(p + 4);
+    frame.time = wire_get32(p + 8);
+    frame.body.assign(p + WIRE_HEADER_SIZE, p + WIRE_HEADER_SIZE + length);
+    start_ += WIRE_HEADER_SIZE + length;
+    return true;
+}
+
+#define HELLO_FIXED 22
+#define WELCOME_FIXED 22
+
+void wire_encode_hello(WireFrame &frame, const WireHello &hello)
+{
+    frame.type = FRAME_HELLO;
+    frame.body.resize(HELLO_FIXED);
+    unsigned char *p = &frame.body[0];
+    wire_put16(p, hello.version);
+    wire_put32(p + 2, hello.caps);
+    wire_put32(p + 6, hello.session);
+    wire_put32(p + 10, hello.lastSeq);
+    wire_put64(p + 14, hello.token);
+    frame.body.insert(frame.body.end(), hello.room.begin(), hello.room.end());
+}
+
+bool wire_decode_hello(const WireFrame &frame, WireHello &hello)
+{
+    if (frame.type != FRAME_HELLO || frame.body.size() < HELLO_FIXED)
+        return false;
+    const unsigned char *p = &frame.body[0];
+    hello.version = wire_get16(p);
+    hello.caps = wire_get32(p + 2);
+    hello.session = wire_get32(p + 6);
+    hello.lastSeq = wire_get32(p + 10);
+    hello.token = wire_get64(p + 14);
+    hello.room.assign(frame.body.begin() + HELLO_FIXED, frame.body.end());
+    return true;
+}
+
+void wire_encode_welcome(WireFrame &frame, const WireWelcome &welcome)
+{
+    frame.type = FRAME_WELCOME;
+    frame.body.resize(WELCOME_FIXED);
+    unsigned char *p = &frame.body[0];
+    wire_put16(p, welcome.version);
+    wire_put32(p + 2, welcome.caps);
+    wire_put32(p + 6, welcome.session);
+    wire_put32(p + 10, welcome.clientSeq);
+    wire_put64(p + 14, welcome.token);
+}
+
+bool wire_decode_welcome(const WireFrame &frame, WireWelcome &welcome)
+{
+    if (frame.type != FRAME_WELCOME || frame.body.size() < WELCOME_FIXED)
+        return false;
+    const unsigned char *p = &frame.body[0];
+    welcome.version = wire_get16(p);
+    welcome.caps = wire_get32(p + 2);
+    welcome.session = wire_get32(p + 6);
+    welcome.clientSeq = wire_get32(p + 10);
+    welcome.token = wire_get64(p + 14);
+    return true;
+}
+
+size_t wire_unsent(int fd)
+{
+    int n = 0;
+    if (ioctl(fd, SIOCOUTQ, &n) == -1 || n < 0)
+        return 0;
+    return (size_t)n;
+}
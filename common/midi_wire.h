@@ -0,0 +1,205 @@
+/*
+ * midi_wire.h
+ *
+ *  Framing used between midiclient and simple_server. Every frame is a
+ *  fixed 12 byte header followed by a variable length body, all integers
+ *  in network byte order:
+ *
+ *    uint16 length   body length in bytes
+ *    uint8  type     one of WireFrameType
+ *    uint8  flags    type specific
+ *    uint32 seq      relay sequence number (assigned by the server)
+ *    uint32 time     sender timestamp in microseconds (wraps)
+ *
+ *  For FRAME_MIDI the body is exactly one complete MIDI message.
+ *  FRAME_JOIN (client to server) carries the room name to subscribe to.
+ *  FRAME_SNAPSHOT (server to client) carries a concatenation of complete
+ *  channel messages recreating the room state; its seq is the last room
+ *  sequence number the snapshot reflects.
+ *
+ *  Session handshake: a client opens with FRAME_HELLO (see WireHello) and
+ *  the server answers FRAME_WELCOME (see WireWelcome) before any room
+ *  traffic. Frames a client sends carry its own increasing seq so that a
+ *  resumed session can resend what the server had not seen. A session
+ *  is only resumed by a HELLO presenting both its id and the secret
+ *  token the WELCOME handed out. FRAME_PING
+ *  is answered with a FRAME_PONG echoing its time field.
+ *
+ *  FRAME_REWIND (client to server) carries a uint32 number of
+ *  milliseconds: the client wants the room from that long ago. Sent
+ *  before FRAME_HELLO it applies to the room joined; sent later, to the
+ *  current room. The server answers with the snapshot as of then and
+ *  the journaled frames since, at up to four times real time, and then
+ *  continues live from the next seq.
+ *
+ *  FRAME_SYSEX carries one chunk of a SysEx message too big to hold up
+ *  other traffic: a uint32 transfer id followed by at most
+ *  WIRE_SYSEX_CHUNK bytes of the message. SYSEX_BEGIN marks the first
+ *  chunk (starting with F0), SYSEX_END the last (ending with F7); a
+ *  message that fits one chunk has both. Chunks of one transfer arrive
+ *  in order, but may be interleaved with other transfers and with
+ *  FRAME_MIDI, which always goes first. The relay renumbers transfers
+ *  so ids are unique on each connection, and sends SysEx frames with
+ *  seq 0: they are relayed live only.
+ *
+ *  FRAME_CLOCK replaces the stream of MIDI clock ticks (0xF8) between
+ *  peers that announce CAP_CLOCK: a uint32 tick count and a uint32 tick
+ *  period in 1/256 microseconds, with time set to when that tick reached
+ *  the sender. The sender measures the tempo and sends one every few
+ *  ticks or on a tempo change; the receiver regenerates the ticks on its
+ *  own clock. Start, Stop, Continue and Song Position follow the update
+ *  fields of a FRAME_CLOCK whose tick is the one they precede, and are
+ *  played right before that regenerated tick; the relay hands them to
+ *  peers without CAP_CLOCK as FRAME_MIDI. Relayed live only, like
+ *  FRAME_SYSEX.
+ */
+
+#ifndef MIDI_WIRE_H_
+#define MIDI_WIRE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#define WIRE_HEADER_SIZE 12
+#define WIRE_MAX_BODY 65535
+
+#define PROTOCOL_VERSION 2
+
+/* Capability bits exchanged in the handshake */
+#define CAP_SNAPSHOT    0x0001  // understands FRAME_SNAPSHOT
+#define CAP_RESUME      0x0002  // session resume by sequence number
+#define CAP_HEARTBEAT   0x0004  // sends FRAME_PING, expects idle timeouts
+#define CAP_CATCHUP     0x0008  // understands FRAME_REWIND
+#define CAP_SYSEX       0x0010  // understands FRAME_SYSEX
+#define CAP_CLOCK       0x0020  // sends and regenerates FRAME_CLOCK
+
+/* FRAME_SYSEX */
+#define WIRE_SYSEX_CHUNK 1024   // message bytes per frame
+#define SYSEX_BEGIN     0x01    // flags: first chunk of a transfer
+#define SYSEX_END       0x02    // flags: last chunk of a transfer
+#define WIRE_SYSEX_BACKLOG 32768    // write SysEx only while less than this is in flight
+
+enum WireFrameType {
+    FRAME_MIDI = 1,     // one MIDI message
+    FRAME_JOIN = 2,     // subscribe to a room
+    FRAME_SNAPSHOT = 3, // room state for a late joiner
+    FRAME_HELLO = 4,    // client handshake
+    FRAME_WELCOME = 5,  // server handshake reply
+    FRAME_PING = 6,     // heartbeat
+    FRAME_PONG = 7,     // heartbeat reply
+    FRAME_REWIND = 8,   // catch up from some time ago
+    FRAME_SYSEX = 9,    // one chunk of a SysEx transfer
+    FRAME_CLOCK = 10    // MIDI clock tempo and phase
+};
+
+struct WireFrame {
+    unsigned char type;
+    unsigned char flags;
+    uint32_t seq;
+    uint32_t time;
+    std::vector<unsigned char> body;
+
+    WireFrame() : type(0), flags(0), seq(0), time(0) {}
+};
+
+/* FRAME_HELLO body */
+struct WireHello {
+    uint16_t version;
+    uint32_t caps;
+    uint32_t session;       // session to resume, 0 for a new one
+    uint32_t lastSeq;       // last room seq the client received
+    uint64_t token;         // resume token from the session's WELCOME
+    std::string room;
+
+    WireHello() : version(PROTOCOL_VERSION), caps(0), session(0), lastSeq(0), token(0) {}
+};
+
+/* FRAME_WELCOME body */
+struct WireWelcome {
+    uint16_t version;
+    uint32_t caps;          // capabilities both sides support
+    uint32_t session;       // session id to present when reconnecting
+    uint32_t clientSeq;     // last client seq the server has received
+    uint64_t token;         // secret to present with the session id
+
+    WireWelcome() : version(PROTOCOL_VERSION), caps(0), session(0), clientSeq(0), token(0) {}
+};
+
+inline void wire_put16(unsigned char *p, uint32_t v)
+{
+    p[0] = (v >> 8) & 0xFF;
+    p[1] = v & 0xFF;
+}
+
+inline void wire_put32(unsigned char *p, uint32_t v)
+{
+    p[0] = (v >> 24) & 0xFF;
+    p[1] = (v >> 16) & 0xFF;
+    p[2] = (v >> 8) & 0xFF;
+    p[3] = v & 0xFF;
+}
+
+inline void wire_put64(unsigned char *p, uint64_t v)
+{
+    wire_put32(p, (uint32_t)(v >> 32));
+    wire_put32(p + 4, (uint32_t)v);
+}
+
+inline uint32_t wire_get16(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 8) | p[1];
+}
+
+inline uint32_t wire_get32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+inline uint64_t wire_get64(const unsigned char *p)
+{
+    return ((uint64_t)wire_get32(p) << 32) | wire_get32(p + 4);
+}
+
+/* Append one encoded frame to out. Returns false if the body is too long. */
+bool wire_encode(std::vector<unsigned char> &out, unsigned char type, unsigned char flags,
+                 uint32_t seq, uint32_t time, const unsigned char *body, size_t n);
+bool wire_encode(std::vector<unsigned char> &out, const WireFrame &frame);
+
+/* Handshake bodies. The decoders return false on a malformed body. */
+void wire_encode_hello(WireFrame &frame, const WireHello &hello);
+bool wire_decode_hello(const WireFrame &frame, WireHello &hello);
+void wire_encode_welcome(WireFrame &frame, const WireWelcome &welcome);
+bool wire_decode_welcome(const WireFrame &frame, WireWelcome &welcome);
+
+/*
+ * Bytes written to a connected TCP socket that the peer has not yet
+ * acknowledged. SysEx chunks are only written while this is below
+ * WIRE_SYSEX_BACKLOG, so a dump never piles up in the kernel ahead of
+ * live frames queued after it.
+ */
+size_t wire_unsent(int fd);
+
+/*
+ * Reassembles frames from a byte stream. Feed it whatever recv() returned
+ * and pop complete frames with next().
+ */
+class WireReader {
+public:
+    WireReader() : start_(0) {}
+
+    void feed(const unsigned char *data, size_t n);
+
+    /* Pops the next complete frame, returns false if none is buffered yet */
+    bool next(WireFrame &frame);
+
+    /* Number of buffered bytes not yet consumed */
+    size_t pending() const { return buffer_.size() - start_; }
+
+private:
+    std::vector<unsigned char> buffer_;
+    size_t start_;
+};
+
+#endif /* MIDI_WIRE_H_ */
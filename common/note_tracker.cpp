@@ -0,0 +1,88 @@
+//*****************************************//
+//  note_tracker.cpp
+//
+//  Per-stream held note and pedal tracking.
+//
+//*****************************************//
+
+#include <string.h>
+#include "midi_util.h"
+#include "note_tracker.h"
+
+void NoteTracker::reset()
+{
+    memset(keys_, 0, sizeof keys_);
+    sustain_ = 0;
+    channels_ = 0;
+}
+
+// Drop the channel from the active mask once nothing is left down on it
+void NoteTracker::settle(int ch)
+{
+    if (!keys_[ch][0] && !keys_[ch][1] && !(sustain_ >> ch & 1))
+        channels_ &= (uint16_t)~(1u << ch);
+}
+
+void NoteTracker::update(const unsigned char *msg, size_t n)
+{
+    if (n < 3)
+        return;
+    unsigned char type = msg[0] & 0xF0;
+    int ch = msg[0] & 0x0F;
+    int key = msg[1] & 0x7F;
+    uint64_t bit = (uint64_t)1 << (key & 63);
+
+    if (type == MIDI_NOTE_ON && msg[2] != 0) {
+        keys_[ch][key >> 6] |= bit;
+        channels_ |= (uint16_t)(1u << ch);
+    } else if (type == MIDI_NOTE_ON || type == MIDI_NOTE_OFF) {
+        keys_[ch][key >> 6] &= ~bit;
+        settle(ch);
+    } else if (type == MIDI_CONTROL_CHANGE) {
+        switch (msg[1]) {
+        case MIDI_CC_SUSTAIN:
+            if (msg[2] >= 64) {
+                sustain_ |= (uint16_t)(1u << ch);
+                channels_ |= (uint16_t)(1u << ch);
+            } else {
+                sustain_ &= (uint16_t)~(1u << ch);
+                settle(ch);
+            }
+            break;
+        case MIDI_CC_RESET_ALL:
+            sustain_ &= (uint16_t)~(1u << ch);
+            settle(ch);
+            break;
+        case MIDI_CC_ALL_SOUND_OFF:
+        case MIDI_CC_ALL_NOTES_OFF:
+            keys_[ch][0] = keys_[ch][1] = 0;
+            settle(ch);
+            break;
+        }
+    }
+}
+
+void NoteTracker::release(std::vector<unsigned char> &out)
+{
+    uint16_t channels = channels_;
+    while (channels) {
+        int ch = __builtin_ctz(channels);
+        channels &= (uint16_t)(channels - 1);
+        for (int w = 0; w < 2; w++) {
+            uint64_t keys = keys_[ch][w];
+            while (keys) {
+                int key = w * 64 + __builtin_ctzll(keys);
+                keys &= keys - 1;
+                out.push_back((unsigned char)(MIDI_NOTE_OFF | ch));
+                out.push_back((unsigned char)key);
+                out.push_back(0);
+            }
+        }
+        if (sustain_ >> ch & 1) {
+            out.push_back((unsigned char)(MIDI_CONTROL_CHANGE | ch));
+            out.push_back(MIDI_CC_SUSTAIN);
+            out.push_back(0);
+        }
+    }
+    reset();
+}
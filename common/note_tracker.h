@@ -0,0 +1,45 @@
+/*
+ * note_tracker.h
+ *
+ *  Tracks which notes one MIDI stream has left sounding: keys held down
+ *  and channels with the sustain pedal pressed, as bitsets. It is cheap
+ *  enough to run on every message. When the stream ends without cleaning
+ *  up (disconnect, timeout, reset), release() produces exactly the note
+ *  offs and pedal releases needed to silence it, in O(active notes),
+ *  instead of an all-notes-off storm across 16 channels.
+ */
+
+#ifndef NOTE_TRACKER_H_
+#define NOTE_TRACKER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+class NoteTracker {
+public:
+    NoteTracker() { reset(); }
+
+    void reset();
+
+    /* Apply one complete MIDI message */
+    void update(const unsigned char *msg, size_t n);
+
+    /* True while any note or pedal is down */
+    bool active() const { return channels_ != 0; }
+
+    /*
+     * Append the 3 byte messages that release everything tracked (note
+     * offs, then sustain off per channel) and reset the tracker.
+     */
+    void release(std::vector<unsigned char> &out);
+
+private:
+    void settle(int ch);
+
+    uint64_t keys_[16][2];
+    uint16_t sustain_;      // channels with the pedal down
+    uint16_t channels_;     // channels with keys or the pedal down
+};
+
+#endif /* NOTE_TRACKER_H_ */
@@ -0,0 +1,103 @@
+/*
+ * send_classes.h
+ *
+ *  Priority classes for outgoing frames, shared by the client's sender
+ *  thread and the relay's per-subscriber send queues. Both keep one FIFO
+ *  per class and build every write as one deficit round-robin round: the
+ *  realtime class is always taken whole and first, the others follow
+ *  with a byte quantum each. A controller sweep or a SysEx dump therefore
+ *  never holds up a note, and neither of them starves the other.
+ *
+ *  Only continuous controller values and pressure rank below notes.
+ *  Anything that changes how the following notes sound (program and bank
+ *  changes, RPN/NRPN, pedals, channel mode messages) stays in the
+ *  realtime class so nothing can overtake it.
+ */
+
+#ifndef SEND_CLASSES_H_
+#define SEND_CLASSES_H_
+
+#include <stddef.h>
+#include "midi_util.h"
+#include "midi_wire.h"
+
+enum SendClass {
+    SEND_REALTIME,      // notes, pitch bend, program changes, pedals, control frames
+    SEND_CONTROL,       // continuous controllers and pressure
+    SEND_BULK,          // SysEx and journal replay
+    SEND_CLASSES
+};
+
+/* Bytes SEND_CONTROL and SEND_BULK may write per round */
+#define SEND_QUANTUM_CONTROL 2048
+#define SEND_QUANTUM_BULK (WIRE_HEADER_SIZE + 4 + WIRE_SYSEX_CHUNK)
+
+inline SendClass send_class(const WireFrame &frame)
+{
+    if (frame.type == FRAME_SYSEX)
+        return SEND_BULK;
+    if (frame.type != FRAME_MIDI || frame.body.empty())
+        return SEND_REALTIME;
+    const unsigned char *msg = &frame.body[0];
+    switch (msg[0] & 0xF0) {
+    case MIDI_CONTROL_CHANGE:
+        if (frame.body.size() < 3 || midi_cc_is_ordered(msg[1]))
+            return SEND_REALTIME;
+        return SEND_CONTROL;
+    case MIDI_POLY_PRESSURE:
+    case MIDI_CHANNEL_PRESSURE:
+        return SEND_CONTROL;
+    case 0xF0:
+        return msg[0] == 0xF0 ? SEND_BULK : SEND_REALTIME;
+    default:
+        return SEND_REALTIME;
+    }
+}
+
+/*
+ * Per-class byte credit. A class with frames waiting is granted its
+ * quantum at the start of every round and may write while its credit
+ * lasts; an idle class banks nothing. Credit is capped so a class held
+ * up by a full socket does not save up a burst, yet can always grow
+ * enough for the largest frame.
+ */
+class DeficitRoundRobin {
+public:
+    DeficitRoundRobin()
+    {
+        for (int i = 0; i < SEND_CLASSES; i++)
+            credit_[i] = 0;
+    }
+
+    void grant(int cls)
+    {
+        long quantum = quantumOf(cls);
+        credit_[cls] += quantum;
+        if (credit_[cls] > quantum + WIRE_HEADER_SIZE + WIRE_MAX_BODY)
+            credit_[cls] = quantum + WIRE_HEADER_SIZE + WIRE_MAX_BODY;
+    }
+
+    /* Bytes cls may still write this round */
+    long credit(int cls) const
+    {
+        return cls == SEND_REALTIME ? WIRE_HEADER_SIZE + WIRE_MAX_BODY : credit_[cls];
+    }
+
+    void charge(int cls, size_t n)
+    {
+        if (cls != SEND_REALTIME)
+            credit_[cls] -= (long)n;
+    }
+
+    void idle(int cls) { credit_[cls] = 0; }
+
+private:
+    static long quantumOf(int cls)
+    {
+        return cls == SEND_CONTROL ? SEND_QUANTUM_CONTROL : cls == SEND_BULK ? SEND_QUANTUM_BULK : 0;
+    }
+
+    long credit_[SEND_CLASSES];
+};
+
+#endif /* SEND_CLASSES_H_ */
@@ -0,0 +1,73 @@
+/*
+ * smf.h
+ *
+ *  Standard MIDI File constants and the byte level helpers shared by the
+ *  recorder and the player. All SMF integers are big-endian; delta times
+ *  are variable-length quantities of up to four 7 bit groups.
+ *
+ *  Files written here use SMF_DIVISION ticks per quarter note and a
+ *  SMF_TEMPO_US tempo, which makes one tick exactly SMF_TICK_US.
+ */
+
+#ifndef SMF_H_
+#define SMF_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#define SMF_DIVISION 1000       // ticks per quarter note
+#define SMF_TEMPO_US 500000     // microseconds per quarter note (120 bpm)
+#define SMF_TICK_US (SMF_TEMPO_US / SMF_DIVISION)
+
+#define SMF_META 0xFF
+#define SMF_META_TRACK_NAME 0x03
+#define SMF_META_END_OF_TRACK 0x2F
+#define SMF_META_TEMPO 0x51
+
+inline void smf_put_vlq(std::vector<unsigned char> &out, uint32_t v)
+{
+    unsigned char bytes[4];
+    int n = 0;
+    do {
+        bytes[n++] = v & 0x7F;
+        v >>= 7;
+    } while (v && n < 4);
+    while (n > 1)
+        out.push_back(bytes[--n] | 0x80);
+    out.push_back(bytes[0]);
+}
+
+/* Decode a VLQ at *p, advancing it. Returns false if it runs past end. */
+inline bool smf_get_vlq(const unsigned char *&p, const unsigned char *end, uint32_t &v)
+{
+    v = 0;
+    for (int i = 0; i < 4 && p < end; i++) {
+        unsigned char b = *p++;
+        v = (v << 7) | (b & 0x7F);
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+inline void smf_put32(std::vector<unsigned char> &out, uint32_t v)
+{
+    out.push_back((v >> 24) & 0xFF);
+    out.push_back((v >> 16) & 0xFF);
+    out.push_back((v >> 8) & 0xFF);
+    out.push_back(v & 0xFF);
+}
+
+/* Meta event with its delta time */
+inline void smf_put_meta(std::vector<unsigned char> &out, uint32_t delta, unsigned char type,
+                         const void *data, size_t n)
+{
+    smf_put_vlq(out, delta);
+    out.push_back(SMF_META);
+    out.push_back(type);
+    smf_put_vlq(out, (uint32_t)n);
+    out.insert(out.end(), (const unsigned char *)data, (const unsigned char *)data + n);
+}
+
+#endif /* SMF_H_ */
@@ -0,0 +1,236 @@
+//*****************************************//
+//  smf_file.cpp
+//
+//  mmap-backed Standard MIDI File reader
+//  with a merged, tempo-mapped event index.
+//
+//*****************************************//
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include "midi_util.h"
+#include "smf.h"
+#include "smf_file.h"
+
+static uint32_t get32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+bool SmfFile::open(const std::string &path)
+{
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        perror(path.c_str());
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < 14) {
+        fprintf(stderr, "%s: not a MIDI file\n", path.c_str());
+        ::close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        perror(path.c_str());
+        return false;
+    }
+    data_ = (const unsigned char *)map;
+    size_ = st.st_size;
+    // The index pass reads front to back
+    madvise(map, size_, MADV_SEQUENTIAL);
+
+    if (!index(path)) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void SmfFile::close()
+{
+    if (data_)
+        munmap((void *)data_, size_);
+    data_ = NULL;
+    size_ = 0;
+    events_.clear();
+    duration_ = 0;
+}
+
+// Read position in one MTrk chunk
+struct TrackCursor {
+    const unsigned char *p;
+    const unsigned char *end;
+    uint64_t tick;          // absolute tick of the pending event
+    unsigned char running;  // running status
+    bool done;
+
+    // Advance to the next event's delta time; false at the end of the track
+    bool advance()
+    {
+        uint32_t delta;
+        if (done || p >= end || !smf_get_vlq(p, end, delta)) {
+            done = true;
+            return false;
+        }
+        tick += delta;
+        return true;
+    }
+};
+
+typedef std::pair<uint64_t, size_t> Pending;   // (tick, track), ties go to lower tracks
+
+bool SmfFile::index(const std::string &path)
+{
+    const unsigned char *p = data_, *end = data_ + size_;
+    if (memcmp(p, "MThd", 4) || get32(p + 4) < 6) {
+        fprintf(stderr, "%s: not a MIDI file\n", path.c_str());
+        return false;
+    }
+    unsigned int format = (p[8] << 8) | p[9];
+    unsigned int division = (p[12] << 8) | p[13];
+    if (format > 1 || division == 0) {
+        fprintf(stderr, "%s: unsupported MIDI file format %u\n", path.c_str(), format);
+        return false;
+    }
+    p += 8 + get32(p + 4);
+
+    std::vector<TrackCursor> tracks;
+    while (p + 8 <= end) {
+        uint32_t length = get32(p + 4);
+        const unsigned char *body = p + 8;
+        const unsigned char *next = (size_t)(end - body) < length ? end : body + length;
+        if (!memcmp(p, "MTrk", 4)) {
+            TrackCursor t = { body, next, 0, 0, false };
+            tracks.push_back(t);
+        }
+        p = next;
+    }
+
+    // Ticks to microseconds. SMPTE divisions have a fixed tick length,
+    // metrical ones follow the tempo map.
+    bool smpte = division & 0x8000;
+    uint64_t ticksPerSecond = smpte ? (uint64_t)(256 - (division >> 8)) * (division & 0xFF) : 0;
+    uint64_t tempo = SMF_TEMPO_US;
+    uint64_t baseTick = 0, baseUs = 0;
+
+    std::priority_queue<Pending, std::vector<Pending>, std::greater<Pending> > pending;
+    for (size_t i = 0; i < tracks.size(); i++)
+        if (tracks[i].advance())
+            pending.push(Pending(tracks[i].tick, i));
+
+    events_.clear();
+    duration_ = 0;
+    while (!pending.empty()) {
+        size_t i = pending.top().second;
+        pending.pop();
+        TrackCursor &t = tracks[i];
+
+        uint64_t time = smpte ? t.tick * 1000000 / ticksPerSecond
+                              : baseUs + (t.tick - baseTick) * tempo / (division & 0x7FFF);
+
+        if (t.p >= t.end) {
+            t.done = true;
+            continue;
+        }
+        unsigned char status = *t.p;
+        if (status < 0x80) {
+            status = t.running;         // running status: data byte first
+            if (!status) {
+                t.done = true;
+                continue;
+            }
+        } else {
+            t.p++;
+        }
+
+        uint32_t length = 0;
+        if (status == SMF_META) {
+            t.running = 0;
+            if (t.p >= t.end) {
+                t.done = true;
+                continue;
+            }
+            unsigned char type = *t.p++;
+            if (!smf_get_vlq(t.p, t.end, length) || (size_t)(t.end - t.p) < length) {
+                t.done = true;
+                continue;
+            }
+            if (type == SMF_META_TEMPO && length == 3 && !smpte) {
+                baseUs = time;
+                baseTick = t.tick;
+                tempo = ((uint64_t)t.p[0] << 16) | (t.p[1] << 8) | t.p[2];
+            }
+            t.p += length;
+            if (type == SMF_META_END_OF_TRACK) {
+                // Trailing rest counts: loops have to come round on the bar
+                if (time > duration_)
+                    duration_ = time;
+                t.done = true;
+            }
+        } else if (status == 0xF0 || status == 0xF7) {
+            t.running = 0;
+            if (!smf_get_vlq(t.p, t.end, length) || (size_t)(t.end - t.p) < length) {
+                t.done = true;
+                continue;
+            }
+            // Only complete SysEx messages; F7 escapes and split packets are dropped
+            if (status == 0xF0 && length > 0 && t.p[length - 1] == 0xF7) {
+                SmfEvent e = { time, (uint32_t)(t.p - data_), length, status };
+                events_.push_back(e);
+            }
+            t.p += length;
+        } else if (midi_is_channel_message(status)) {
+            t.running = status;
+            length = (uint32_t)midi_channel_message_size(status) - 1;
+            if ((size_t)(t.end - t.p) < length) {
+                t.done = true;
+                continue;
+            }
+            SmfEvent e = { time, (uint32_t)(t.p - data_), length, status };
+            events_.push_back(e);
+            t.p += length;
+        } else {
+            t.done = true;      // system common or realtime bytes don't belong here
+            continue;
+        }
+
+        if (t.advance())
+            pending.push(Pending(t.tick, i));
+    }
+
+    if (!events_.empty() && events_.back().time > duration_)
+        duration_ = events_.back().time;
+
+    // Playback jumps around from here on
+    madvise((void *)data_, size_, MADV_RANDOM);
+    return true;
+}
+
+static bool event_before(const SmfEvent &e, uint64_t time)
+{
+    return e.time < time;
+}
+
+size_t SmfFile::find(uint64_t time) const
+{
+    return std::lower_bound(events_.begin(), events_.end(), time, event_before) - events_.begin();
+}
+
+void SmfFile::message(size_t i, std::vector<unsigned char> &out) const
+{
+    const SmfEvent &e = events_[i];
+    out.resize(e.size + 1);
+    out[0] = e.status;
+    if (e.size)
+        memcpy(&out[1], data_ + e.offset, e.size);
+}
@@ -0,0 +1,60 @@
+/*
+ * smf_file.h
+ *
+ *  Read-only Standard MIDI File (format 0 or 1) backed by mmap. Opening
+ *  it makes one pass over the tracks and builds a compact, time-sorted
+ *  index of every playable event merged across tracks, with the tempo
+ *  map already applied. Event bytes are never copied; index entries
+ *  point into the mapping, so even large files open in a single scan.
+ *
+ *  Meta events, SysEx escapes (F7) and anything else that isn't a
+ *  channel message or a complete SysEx are left out of the index.
+ */
+
+#ifndef SMF_FILE_H_
+#define SMF_FILE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+struct SmfEvent {
+    uint64_t time;          // microseconds from the start of the file
+    uint32_t offset;        // first data byte in the mapping
+    uint32_t size;          // data bytes after the status
+    unsigned char status;
+};
+
+class SmfFile {
+public:
+    SmfFile() : data_(NULL), size_(0), duration_(0) {}
+    ~SmfFile() { close(); }
+
+    /* Map and index path. Prints the reason and returns false on failure. */
+    bool open(const std::string &path);
+    void close();
+
+    const std::vector<SmfEvent> &events() const { return events_; }
+    /* Length in microseconds: the latest End of Track, or the last event */
+    uint64_t duration() const { return duration_; }
+
+    /* Index of the first event at or after time */
+    size_t find(uint64_t time) const;
+
+    /* Copy event i as a complete MIDI message into out */
+    void message(size_t i, std::vector<unsigned char> &out) const;
+
+private:
+    bool index(const std::string &path);
+
+    const unsigned char *data_;
+    size_t size_;
+    std::vector<SmfEvent> events_;
+    uint64_t duration_;
+
+    SmfFile(const SmfFile &);
+    SmfFile &operator=(const SmfFile &);
+};
+
+#endif /* SMF_FILE_H_ */
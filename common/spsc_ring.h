@@ -0,0 +1,103 @@
+/*
+ * spsc_ring.h
+ *
+ *  Lock-free single-producer/single-consumer ring of variable length
+ *  records (a 4 byte length followed by the payload). One thread may
+ *  push and one other thread may pop concurrently without locks; neither
+ *  side ever allocates once the consumer's output buffer has grown to
+ *  the largest record.
+ */
+
+#ifndef SPSC_RING_H_
+#define SPSC_RING_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <vector>
+
+class SpscRing {
+public:
+    /* capacity is rounded up to a power of two bytes */
+    explicit SpscRing(size_t capacity)
+        : head_(0), tail_(0)
+    {
+        size_t size = 64;
+        while (size < capacity)
+            size <<= 1;
+        buffer_.resize(size);
+        mask_ = size - 1;
+    }
+
+    /* Producer: append one record. Returns false if it does not fit. */
+    bool push(const void *data, size_t n)
+    {
+        return push(data, n, NULL, 0);
+    }
+
+    /* Producer: append one record made of two parts */
+    bool push(const void *first, size_t n1, const void *second, size_t n2)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t tail = tail_.load(std::memory_order_acquire);
+        uint32_t n = (uint32_t)(n1 + n2);
+        if (buffer_.size() - (head - tail) < sizeof n + n)
+            return false;
+        copyIn(head, &n, sizeof n);
+        copyIn(head + sizeof n, first, n1);
+        copyIn(head + sizeof n + n1, second, n2);
+        head_.store(head + sizeof n + n, std::memory_order_release);
+        return true;
+    }
+
+    /* Consumer: take the next record. Returns false if the ring is empty. */
+    bool pop(std::vector<unsigned char> &out)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t head = head_.load(std::memory_order_acquire);
+        if (head == tail)
+            return false;
+        uint32_t n;
+        copyOut(tail, &n, sizeof n);
+        out.resize(n);
+        copyOut(tail + sizeof n, n ? &out[0] : NULL, n);
+        tail_.store(tail + sizeof n + n, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const
+    {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+private:
+    void copyIn(size_t at, const void *src, size_t n)
+    {
+        if (!n) return;
+        size_t offset = at & mask_;
+        size_t first = n < buffer_.size() - offset ? n : buffer_.size() - offset;
+        memcpy(&buffer_[offset], src, first);
+        memcpy(&buffer_[0], (const unsigned char *)src + first, n - first);
+    }
+
+    void copyOut(size_t at, void *dst, size_t n) const
+    {
+        if (!n) return;
+        size_t offset = at & mask_;
+        size_t first = n < buffer_.size() - offset ? n : buffer_.size() - offset;
+        memcpy(dst, &buffer_[offset], first);
+        memcpy((unsigned char *)dst + first, &buffer_[0], n - first);
+    }
+
+    std::vector<unsigned char> buffer_;
+    size_t mask_;
+    // Producer and consumer indices are padded onto separate cache lines
+    // (padding rather than alignas so heap allocation works before C++17)
+    char pad0_[64];
+    std::atomic<size_t> head_;
+    char pad1_[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail_;
+    char pad2_[64 - sizeof(std::atomic<size_t>)];
+};
+
+#endif /* SPSC_RING_H_ */
@@ -39,6 +39,10 @@
 #include "RtMidi.h"
 #include <sstream>
 
+#if defined(__LINUX_ALSA__)
+#include <sys/eventfd.h>
+#endif
+
 //*********************************************************************//
 //  RtMidi Definitions
 //*********************************************************************//
@@ -267,6 +271,14 @@ void MidiApi :: error( RtMidiError::Type type, std::string errorString )
   }
 }
 
+int MidiApi :: getPortNumber( const std::string &portName )
+{
+  unsigned int nPorts = getPortCount();
+  for ( unsigned int i=0; i<nPorts; i++ )
+    if ( getPortName( i ) == portName ) return (int) i;
+  return -1;
+}
+
 //*********************************************************************//
 //  Common MidiInApi Definitions
 //*********************************************************************//
@@ -305,6 +317,35 @@ void MidiInApi :: setCallback( RtMidiIn::RtMidiCallback callback, void *userData
   inputData_.usingCallback = true;
 }
 
+// Lets every API deliver to a source callback through the plain
+// callback path; those without aggregated input have only source 0.
+static void sourceCallbackAdapter( double timeStamp, std::vector<unsigned char> *message, void *userData )
+{
+  MidiInApi::RtMidiInData *data = static_cast<MidiInApi::RtMidiInData *> (userData);
+  data->sourceCallback( timeStamp, 0, message, data->sourceUserData );
+}
+
+void MidiInApi :: setSourceCallback( RtMidiIn::RtMidiSourceCallback callback, void *userData )
+{
+  if ( inputData_.usingCallback ) {
+    errorString_ = "MidiInApi::setSourceCallback: a callback function is already set!";
+    error( RtMidiError::WARNING, errorString_ );
+    return;
+  }
+
+  if ( !callback ) {
+    errorString_ = "RtMidiIn::setSourceCallback: callback function value is invalid!";
+    error( RtMidiError::WARNING, errorString_ );
+    return;
+  }
+
+  inputData_.sourceCallback = callback;
+  inputData_.sourceUserData = userData;
+  inputData_.userCallback = sourceCallbackAdapter;
+  inputData_.userData = &inputData_;
+  inputData_.usingCallback = true;
+}
+
 void MidiInApi :: cancelCallback()
 {
   if ( !inputData_.usingCallback ) {
@@ -315,9 +356,36 @@ void MidiInApi :: cancelCallback()
 
   inputData_.userCallback = 0;
   inputData_.userData = 0;
+  inputData_.sourceCallback = 0;
+  inputData_.sourceUserData = 0;
   inputData_.usingCallback = false;
 }
 
+void MidiInApi :: setSysexCallback( RtMidiIn::RtMidiSysexCallback callback, void *userData, size_t partialBytes )
+{
+  if ( callback && getCurrentApi() != RtMidi::LINUX_ALSA ) {
+    errorString_ = "MidiInApi::setSysexCallback: sysex callbacks are not supported by this API.";
+    error( RtMidiError::WARNING, errorString_ );
+    return;
+  }
+
+  inputData_.sysexUserData = userData;
+  inputData_.sysexPartialBytes = callback ? partialBytes : 0;
+  inputData_.sysexCallback = callback;
+}
+
+int MidiInApi :: addPort( unsigned int portNumber )
+{
+  if ( !connected_ ) {
+    openPort( portNumber, std::string( "RtMidi Input" ) );
+    return connected_ ? 0 : -1;
+  }
+
+  errorString_ = "MidiInApi::addPort: aggregated input is not supported by this API.";
+  error( RtMidiError::WARNING, errorString_ );
+  return -1;
+}
+
 void MidiInApi :: ignoreTypes( bool midiSysex, bool midiTime, bool midiSense )
 {
   inputData_.ignoreFlags = 0;
@@ -326,7 +394,7 @@ void MidiInApi :: ignoreTypes( bool midiSysex, bool midiTime, bool midiSense )
   if ( midiSense ) inputData_.ignoreFlags |= 0x04;
 }
 
-double MidiInApi :: getMessage( std::vector<unsigned char> *message )
+double MidiInApi :: getMessage( std::vector<unsigned char> *message, unsigned int *source )
 {
   message->clear();
 
@@ -336,20 +404,38 @@ double MidiInApi :: getMessage( std::vector<unsigned char> *message )
     return 0.0;
   }
 
-  if ( inputData_.queue.size == 0 ) return 0.0;
+  if ( inputData_.queue.size == 0 ) {
+    clearMessageFd();
+    return 0.0;
+  }
 
   // Copy queued message to the vector pointer argument and then "pop" it.
   std::vector<unsigned char> *bytes = &(inputData_.queue.ring[inputData_.queue.front].bytes);
   message->assign( bytes->begin(), bytes->end() );
   double deltaTime = inputData_.queue.ring[inputData_.queue.front].timeStamp;
+  if ( source ) *source = inputData_.queue.ring[inputData_.queue.front].source;
   inputData_.queue.size--;
   inputData_.queue.front++;
   if ( inputData_.queue.front == inputData_.queue.ringSize )
     inputData_.queue.front = 0;
+  if ( inputData_.queue.size == 0 ) clearMessageFd();
 
   return deltaTime;
 }
 
+// The message fd is readable while the queue holds messages.  It is
+// cleared when the queue runs empty, then set again if the input
+// thread queued something in between.
+void MidiInApi :: clearMessageFd( void )
+{
+#if defined(__LINUX_ALSA__)
+  if ( inputData_.queueFd < 0 ) return;
+  eventfd_t value;
+  eventfd_read( inputData_.queueFd, &value );
+  if ( inputData_.queue.size > 0 ) eventfd_write( inputData_.queueFd, 1 );
+#endif
+}
+
 //*********************************************************************//
 //  Common MidiOutApi Definitions
 //*********************************************************************//
@@ -1071,10 +1157,106 @@ void MidiOutCore :: sendMessage( std::vector<unsigned char> *message )
 
 #include <pthread.h>
 #include <sys/time.h>
+#include <atomic>
+#include <map>
 
 // ALSA header file.
 #include <alsa/asoundlib.h>
 
+class AlsaPortRegistry;
+
+typedef std::vector<snd_seq_addr_t> AlsaSourceTable;
+
+// SysEx reaches us as sequencer events of at most 256 bytes each.  They
+// are copied once, into fixed-size chunks carved from preallocated
+// slabs, and a message is kept as a chain of chunks.  Consumers get the
+// chain as a scatter list, or flattened once when they want a vector.
+#define ALSA_SYSEX_CHUNK 256
+#define ALSA_SYSEX_SLAB 64   // chunks per slab
+
+struct AlsaSysexChunk {
+  AlsaSysexChunk *next;
+  unsigned int size;
+  unsigned char data[ALSA_SYSEX_CHUNK];
+};
+
+// One SysEx message being assembled.
+struct AlsaSysex {
+  AlsaSysexChunk *head;
+  AlsaSysexChunk *tail;
+  size_t size;
+
+  AlsaSysex() : head(0), tail(0), size(0) {}
+};
+
+class AlsaSysexPool
+{
+ public:
+  AlsaSysexPool() : free_(0) {}
+  ~AlsaSysexPool();
+
+  void append( AlsaSysex &sysex, const unsigned char *bytes, size_t n );
+  void release( AlsaSysex &sysex );
+
+ private:
+  AlsaSysexChunk *allocate( void );
+
+  AlsaSysexChunk *free_;
+  std::vector<AlsaSysexChunk *> slabs_;
+};
+
+AlsaSysexPool :: ~AlsaSysexPool()
+{
+  for ( unsigned int i=0; i<slabs_.size(); i++ ) delete [] slabs_[i];
+}
+
+// Slabs are only added when the free list runs dry, so a long dump
+// costs an allocation per ALSA_SYSEX_SLAB chunks, once.
+AlsaSysexChunk *AlsaSysexPool :: allocate( void )
+{
+  if ( !free_ ) {
+    AlsaSysexChunk *slab = new AlsaSysexChunk[ALSA_SYSEX_SLAB];
+    slabs_.push_back( slab );
+    for ( unsigned int i=0; i<ALSA_SYSEX_SLAB; i++ ) {
+      slab[i].next = free_;
+      free_ = &slab[i];
+    }
+  }
+  AlsaSysexChunk *chunk = free_;
+  free_ = chunk->next;
+  chunk->next = 0;
+  chunk->size = 0;
+  return chunk;
+}
+
+void AlsaSysexPool :: append( AlsaSysex &sysex, const unsigned char *bytes, size_t n )
+{
+  while ( n > 0 ) {
+    if ( !sysex.tail || sysex.tail->size == ALSA_SYSEX_CHUNK ) {
+      AlsaSysexChunk *chunk = allocate();
+      if ( sysex.tail ) sysex.tail->next = chunk;
+      else sysex.head = chunk;
+      sysex.tail = chunk;
+    }
+    size_t room = ALSA_SYSEX_CHUNK - sysex.tail->size;
+    size_t count = n < room ? n : room;
+    memcpy( sysex.tail->data + sysex.tail->size, bytes, count );
+    sysex.tail->size += count;
+    sysex.size += count;
+    bytes += count;
+    n -= count;
+  }
+}
+
+void AlsaSysexPool :: release( AlsaSysex &sysex )
+{
+  if ( sysex.head ) {
+    sysex.tail->next = free_;
+    free_ = sysex.head;
+  }
+  sysex = AlsaSysex();
+}
+
 // A structure to hold variables related to the ALSA API
 // implementation.
 struct AlsaMidiData {
@@ -1089,26 +1271,461 @@ struct AlsaMidiData {
   pthread_t dummy_thread_id;
   unsigned long long lastTime;
   int queue_id; // an input queue is needed to get timestamped events
-  int trigger_fds[2];
+  int trigger_fd; // eventfd that wakes the handler thread
+  AlsaPortRegistry *registry;
+  // Aggregated input: the source address of each stream, and the
+  // subscriptions made by addPort() for streams 1 and up. The handler
+  // thread reads an immutable copy of sources published by pointer
+  // swap; copies it may still be reading are retired until it stops.
+  std::vector<snd_seq_addr_t> sources;
+  std::vector<snd_seq_port_subscribe_t *> addedSubscriptions;
+  std::atomic<const AlsaSourceTable *> sourceTable;
+  std::vector<const AlsaSourceTable *> retiredSourceTables;
+  // SysEx assembly, one message in progress per source stream.
+  AlsaSysexPool sysexPool;
+  std::vector<AlsaSysex> sysex;
+  std::vector<RtMidiIn::SysexSegment> sysexSegments;
 };
 
 #define PORT_TYPE( pinfo, bits ) ((snd_seq_port_info_get_capability(pinfo) & (bits)) == (bits))
 
+#define ALSA_INPUT_CAPS  (SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ)
+#define ALSA_OUTPUT_CAPS (SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE)
+
+//*********************************************************************//
+//  API: LINUX ALSA
+//  Class Definitions: AlsaPortRegistry
+//*********************************************************************//
+
+// Walking every sequencer client and port is a round trip per port, and
+// RtMidi used to do it for every count, name and open.  The registry
+// takes one snapshot of the sequencer topology, shared by all RtMidi
+// ALSA instances in the process, and keeps it current from the System
+// Announce port (client and port start/exit/change events).  Those are
+// drained, without blocking, at the start of each query, so count,
+// name and lookup-by-name are answered from memory.  If the announce
+// subscription cannot be made, or its events overflow, the next query
+// rescans instead.
+
+struct AlsaPort {
+  snd_seq_addr_t addr;
+  unsigned int caps;
+  std::string name;
+};
+
+class AlsaPortRegistry
+{
+ public:
+  static AlsaPortRegistry *acquire( void );
+  static void release( void );
+
+  // Queries take the capability bits of one direction.
+  unsigned int count( unsigned int caps );
+  bool port( unsigned int caps, unsigned int portNumber, snd_seq_addr_t *addr, std::string *name );
+  int find( unsigned int caps, const std::string &name );
+
+ private:
+  AlsaPortRegistry( void );
+  ~AlsaPortRegistry( void );
+
+  struct Index {
+    std::vector<const AlsaPort *> ports;
+    std::map<std::string, unsigned int> names;
+  };
+
+  void refresh( void );
+  void scan( void );
+  void updatePort( int client, int port );
+  void updateClient( int client );
+  void removeClient( int client );
+  void reindex( void );
+  Index &index( unsigned int caps ) { return caps == ALSA_INPUT_CAPS ? inputs_ : outputs_; }
+
+  snd_seq_t *seq_;
+  bool announced_;   // subscribed to System Announce
+  bool stale_;       // topology must be rescanned
+  bool changed_;     // indexes must be rebuilt
+  std::map<int, std::string> clients_;
+  std::map<int, AlsaPort> ports_;   // keyed client << 8 | port, in enumeration order
+  Index inputs_;
+  Index outputs_;
+  pthread_mutex_t mutex_;
+
+  static pthread_mutex_t instanceMutex_;
+  static AlsaPortRegistry *instance_;
+  static unsigned int users_;
+};
+
+pthread_mutex_t AlsaPortRegistry :: instanceMutex_ = PTHREAD_MUTEX_INITIALIZER;
+AlsaPortRegistry *AlsaPortRegistry :: instance_ = 0;
+unsigned int AlsaPortRegistry :: users_ = 0;
+
+AlsaPortRegistry *AlsaPortRegistry :: acquire( void )
+{
+  pthread_mutex_lock( &instanceMutex_ );
+  if ( !instance_ ) instance_ = new AlsaPortRegistry;
+  users_++;
+  AlsaPortRegistry *registry = instance_;
+  pthread_mutex_unlock( &instanceMutex_ );
+  return registry;
+}
+
+void AlsaPortRegistry :: release( void )
+{
+  pthread_mutex_lock( &instanceMutex_ );
+  if ( users_ > 0 && --users_ == 0 ) {
+    delete instance_;
+    instance_ = 0;
+  }
+  pthread_mutex_unlock( &instanceMutex_ );
+}
+
+AlsaPortRegistry :: AlsaPortRegistry( void )
+  : seq_( 0 ), announced_( false ), stale_( true ), changed_( false )
+{
+  pthread_mutex_init( &mutex_, NULL );
+
+  // A private client, so announce events never mix with MIDI input.
+  if ( snd_seq_open( &seq_, "default", SND_SEQ_OPEN_DUPLEX, SND_SEQ_NONBLOCK ) < 0 ) {
+    seq_ = 0;
+    return;
+  }
+  snd_seq_set_client_name( seq_, "RtMidi Port Registry" );
+  int port = snd_seq_create_simple_port( seq_, "announce",
+                                         SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_NO_EXPORT,
+                                         SND_SEQ_PORT_TYPE_APPLICATION );
+  if ( port >= 0 &&
+       snd_seq_connect_from( seq_, port, SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE ) >= 0 )
+    announced_ = true;
+}
+
+AlsaPortRegistry :: ~AlsaPortRegistry( void )
+{
+  if ( seq_ ) snd_seq_close( seq_ );
+  pthread_mutex_destroy( &mutex_ );
+}
+
+unsigned int AlsaPortRegistry :: count( unsigned int caps )
+{
+  pthread_mutex_lock( &mutex_ );
+  refresh();
+  unsigned int n = index( caps ).ports.size();
+  pthread_mutex_unlock( &mutex_ );
+  return n;
+}
+
+bool AlsaPortRegistry :: port( unsigned int caps, unsigned int portNumber, snd_seq_addr_t *addr, std::string *name )
+{
+  pthread_mutex_lock( &mutex_ );
+  refresh();
+  const Index &ix = index( caps );
+  bool found = portNumber < ix.ports.size();
+  if ( found ) {
+    if ( addr ) *addr = ix.ports[portNumber]->addr;
+    if ( name ) *name = ix.ports[portNumber]->name;
+  }
+  pthread_mutex_unlock( &mutex_ );
+  return found;
+}
+
+int AlsaPortRegistry :: find( unsigned int caps, const std::string &name )
+{
+  pthread_mutex_lock( &mutex_ );
+  refresh();
+  const Index &ix = index( caps );
+  std::map<std::string, unsigned int>::const_iterator it = ix.names.find( name );
+  int portNumber = it == ix.names.end() ? -1 : (int) it->second;
+  pthread_mutex_unlock( &mutex_ );
+  return portNumber;
+}
+
+// Apply any announce events that arrived since the last query.
+void AlsaPortRegistry :: refresh( void )
+{
+  if ( !seq_ ) return;
+
+  if ( !announced_ ) stale_ = true;
+  while ( announced_ && snd_seq_event_input_pending( seq_, 1 ) > 0 ) {
+    snd_seq_event_t *ev;
+    int result = snd_seq_event_input( seq_, &ev );
+    if ( result == -ENOSPC ) {
+      // Lost some: the snapshot can no longer be trusted.
+      stale_ = true;
+      continue;
+    }
+    if ( result < 0 ) break;
+
+    switch ( ev->type ) {
+    case SND_SEQ_EVENT_CLIENT_START:
+    case SND_SEQ_EVENT_CLIENT_CHANGE:
+      updateClient( ev->data.addr.client );
+      break;
+    case SND_SEQ_EVENT_CLIENT_EXIT:
+      removeClient( ev->data.addr.client );
+      break;
+    case SND_SEQ_EVENT_PORT_START:
+    case SND_SEQ_EVENT_PORT_CHANGE:
+    case SND_SEQ_EVENT_PORT_EXIT:
+      updatePort( ev->data.addr.client, ev->data.addr.port );
+      break;
+    default:
+      break;
+    }
+    snd_seq_free_event( ev );
+  }
+
+  if ( stale_ ) scan();
+  if ( changed_ ) reindex();
+}
+
+void AlsaPortRegistry :: scan( void )
+{
+  snd_seq_client_info_t *cinfo;
+  snd_seq_port_info_t *pinfo;
+  snd_seq_client_info_alloca( &cinfo );
+  snd_seq_port_info_alloca( &pinfo );
+
+  clients_.clear();
+  ports_.clear();
+  snd_seq_client_info_set_client( cinfo, -1 );
+  while ( snd_seq_query_next_client( seq_, cinfo ) >= 0 ) {
+    int client = snd_seq_client_info_get_client( cinfo );
+    if ( client == 0 ) continue;
+    clients_[client] = snd_seq_client_info_get_name( cinfo );
+    snd_seq_port_info_set_client( pinfo, client );
+    snd_seq_port_info_set_port( pinfo, -1 );
+    while ( snd_seq_query_next_port( seq_, pinfo ) >= 0 ) {
+      if ( ( snd_seq_port_info_get_type( pinfo ) & SND_SEQ_PORT_TYPE_MIDI_GENERIC ) == 0 ) continue;
+      AlsaPort &port = ports_[client << 8 | snd_seq_port_info_get_port( pinfo )];
+      port.addr.client = client;
+      port.addr.port = snd_seq_port_info_get_port( pinfo );
+      port.caps = snd_seq_port_info_get_capability( pinfo );
+    }
+  }
+  stale_ = false;
+  changed_ = true;
+}
+
+// Re-read one port; it is dropped if it is gone or no longer MIDI.
+void AlsaPortRegistry :: updatePort( int client, int port )
+{
+  if ( client == 0 || stale_ ) return;
+  changed_ = true;
+
+  snd_seq_port_info_t *pinfo;
+  snd_seq_port_info_alloca( &pinfo );
+  if ( snd_seq_get_any_port_info( seq_, client, port, pinfo ) < 0 ||
+       ( snd_seq_port_info_get_type( pinfo ) & SND_SEQ_PORT_TYPE_MIDI_GENERIC ) == 0 ) {
+    ports_.erase( client << 8 | port );
+    return;
+  }
+  if ( !clients_.count( client ) ) updateClient( client );
+  AlsaPort &entry = ports_[client << 8 | port];
+  entry.addr.client = client;
+  entry.addr.port = port;
+  entry.caps = snd_seq_port_info_get_capability( pinfo );
+}
+
+void AlsaPortRegistry :: updateClient( int client )
+{
+  if ( client == 0 || stale_ ) return;
+  changed_ = true;
+
+  snd_seq_client_info_t *cinfo;
+  snd_seq_client_info_alloca( &cinfo );
+  if ( snd_seq_get_any_client_info( seq_, client, cinfo ) < 0 ) {
+    removeClient( client );
+    return;
+  }
+  clients_[client] = snd_seq_client_info_get_name( cinfo );
+}
+
+void AlsaPortRegistry :: removeClient( int client )
+{
+  changed_ = true;
+  clients_.erase( client );
+  ports_.erase( ports_.lower_bound( client << 8 ), ports_.lower_bound( ( client + 1 ) << 8 ) );
+}
+
+// Rebuild the per-direction port numbering and name lookup.
+void AlsaPortRegistry :: reindex( void )
+{
+  inputs_ = Index();
+  outputs_ = Index();
+  for ( std::map<int, AlsaPort>::iterator it = ports_.begin(); it != ports_.end(); ++it ) {
+    AlsaPort &port = it->second;
+    std::ostringstream os;
+    os << clients_[port.addr.client];
+    os << " ";                                    // These lines added to make sure devices are listed
+    os << (int) port.addr.client;                 // with full portnames added to ensure individual device names
+    os << ":";
+    os << (int) port.addr.port;
+    port.name = os.str();
+
+    if ( ( port.caps & ALSA_INPUT_CAPS ) == ALSA_INPUT_CAPS ) {
+      inputs_.names.insert( std::make_pair( port.name, (unsigned int) inputs_.ports.size() ) );
+      inputs_.ports.push_back( &port );
+    }
+    if ( ( port.caps & ALSA_OUTPUT_CAPS ) == ALSA_OUTPUT_CAPS ) {
+      outputs_.names.insert( std::make_pair( port.name, (unsigned int) outputs_.ports.size() ) );
+      outputs_.ports.push_back( &port );
+    }
+  }
+  changed_ = false;
+}
+
 //*********************************************************************//
 //  API: LINUX ALSA
 //  Class Definitions: MidiInAlsa
 //*********************************************************************//
 
+// The stream index for an event's sender.  Senders that were not
+// subscribed through openPort()/addPort(), such as connections made
+// to a virtual port, are reported as stream 0.
+static unsigned int alsaSourceIndex( AlsaMidiData *apiData, const snd_seq_addr_t &sender )
+{
+  const AlsaSourceTable *table = apiData->sourceTable.load( std::memory_order_acquire );
+  if ( table == NULL ) return 0;
+  for ( unsigned int i=1; i<table->size(); i++ ) {
+    if ( (*table)[i].client == sender.client && (*table)[i].port == sender.port )
+      return i;
+  }
+  return 0;
+}
+
+// Publish a copy of apiData->sources to the handler thread.
+static void alsaPublishSources( AlsaMidiData *apiData )
+{
+  const AlsaSourceTable *old =
+    apiData->sourceTable.exchange( new AlsaSourceTable( apiData->sources ), std::memory_order_acq_rel );
+  if ( old ) apiData->retiredSourceTables.push_back( old );
+}
+
+// Free superseded tables. Only while the handler thread is not running.
+static void alsaFreeRetiredSources( AlsaMidiData *apiData )
+{
+  for ( unsigned int i=0; i<apiData->retiredSourceTables.size(); i++ )
+    delete apiData->retiredSourceTables[i];
+  apiData->retiredSourceTables.clear();
+}
+
+// The time since the previous message, in seconds.
+static double alsaTimeStamp( MidiInApi::RtMidiInData *data, AlsaMidiData *apiData, const snd_seq_event_t *ev )
+{
+  unsigned long long time, lastTime;
+  double timeStamp = 0.0;
+
+  // Method 1: Use the system time.
+  //(void)gettimeofday(&tv, (struct timezone *)NULL);
+  //time = (tv.tv_sec * 1000000) + tv.tv_usec;
+
+  // Method 2: Use the ALSA sequencer event time data.
+  // (thanks to Pedro Lopez-Cabanillas!).
+  time = ( ev->time.time.tv_sec * 1000000 ) + ( ev->time.time.tv_nsec/1000 );
+  lastTime = time;
+  time -= apiData->lastTime;
+  apiData->lastTime = lastTime;
+  if ( data->firstMessage == true )
+    data->firstMessage = false;
+  else
+    timeStamp = time * 0.000001;
+  return timeStamp;
+}
+
+// Add one SysEx event to its source's message.  With a SysEx callback
+// the message is delivered from the chunk chain, in pieces if a
+// partial size is set; otherwise a complete message is flattened into
+// \e message and true is returned.
+static bool alsaSysex( MidiInApi::RtMidiInData *data, AlsaMidiData *apiData, const snd_seq_event_t *ev,
+                       MidiInApi::MidiMessage &message )
+{
+  const unsigned char *bytes = (const unsigned char *) ev->data.ext.ptr;
+  size_t n = ev->data.ext.len;
+  if ( n == 0 ) return false;
+
+  unsigned int source = alsaSourceIndex( apiData, ev->source );
+  if ( source >= apiData->sysex.size() ) apiData->sysex.resize( source + 1 );
+  AlsaSysex &sysex = apiData->sysex[source];
+  if ( bytes[0] == 0xF0 && sysex.size > 0 ) {
+    // The previous message from this source never ended.
+#if defined(__RTMIDI_DEBUG__)
+    std::cerr << "\nMidiInAlsa::alsaMidiHandler: discarding unterminated sysex!\n\n";
+#endif
+    apiData->sysexPool.release( sysex );
+  }
+  apiData->sysexPool.append( sysex, bytes, n );
+  bool complete = bytes[n-1] == 0xF7;
+
+  if ( data->sysexCallback ) {
+    if ( !complete && ( data->sysexPartialBytes == 0 || sysex.size < data->sysexPartialBytes ) )
+      return false;
+    std::vector<RtMidiIn::SysexSegment> &segments = apiData->sysexSegments;
+    segments.clear();
+    for ( AlsaSysexChunk *chunk = sysex.head; chunk; chunk = chunk->next ) {
+      RtMidiIn::SysexSegment segment = { chunk->data, chunk->size };
+      segments.push_back( segment );
+    }
+    data->sysexCallback( alsaTimeStamp( data, apiData, ev ), source, &segments[0], segments.size(),
+                         complete, data->sysexUserData );
+    apiData->sysexPool.release( sysex );
+    return false;
+  }
+
+  if ( !complete ) return false;
+  message.bytes.resize( sysex.size );
+  unsigned char *out = &message.bytes[0];
+  for ( AlsaSysexChunk *chunk = sysex.head; chunk; chunk = chunk->next ) {
+    memcpy( out, chunk->data, chunk->size );
+    out += chunk->size;
+  }
+  message.timeStamp = alsaTimeStamp( data, apiData, ev );
+  message.source = source;
+  apiData->sysexPool.release( sysex );
+  return true;
+}
+
+// Hand a batch of decoded messages to the user: to the callback one
+// after another, or into the queue with a single size update.
+static void alsaPublish( MidiInApi::RtMidiInData *data, std::vector<MidiInApi::MidiMessage> &batch, unsigned int count )
+{
+  if ( data->sourceCallback ) {
+    for ( unsigned int i=0; i<count; i++ )
+      data->sourceCallback( batch[i].timeStamp, batch[i].source, &batch[i].bytes, data->sourceUserData );
+    return;
+  }
+  if ( data->usingCallback ) {
+    RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) data->userCallback;
+    for ( unsigned int i=0; i<count; i++ )
+      callback( batch[i].timeStamp, &batch[i].bytes, data->userData );
+    return;
+  }
+
+  // As long as we haven't reached our queue size limit, push the messages.
+  unsigned int room = data->queue.ringSize - data->queue.size;
+  unsigned int n = count < room ? count : room;
+  for ( unsigned int i=0; i<n; i++ ) {
+    data->queue.ring[data->queue.back].bytes.swap( batch[i].bytes );
+    data->queue.ring[data->queue.back].timeStamp = batch[i].timeStamp;
+    data->queue.ring[data->queue.back].source = batch[i].source;
+    if ( ++data->queue.back == data->queue.ringSize )
+      data->queue.back = 0;
+  }
+  data->queue.size += n;
+  if ( n > 0 && data->queueFd >= 0 ) eventfd_write( data->queueFd, 1 );
+  if ( n < count )
+    std::cerr << "\nMidiInAlsa: message queue limit reached!!\n\n";
+}
+
 static void *alsaMidiHandler( void *ptr )
 {
   MidiInApi::RtMidiInData *data = static_cast<MidiInApi::RtMidiInData *> (ptr);
   AlsaMidiData *apiData = static_cast<AlsaMidiData *> (data->apiData);
 
   long nBytes;
-  unsigned long long time, lastTime;
-  bool continueSysex = false;
   bool doDecode = false;
   MidiInApi::MidiMessage message;
+  std::vector<MidiInApi::MidiMessage> batch;
+  unsigned int batchCount;
   int poll_fd_count;
   struct pollfd *poll_fds;
 
@@ -1135,126 +1752,105 @@ static void *alsaMidiHandler( void *ptr )
   poll_fd_count = snd_seq_poll_descriptors_count( apiData->seq, POLLIN ) + 1;
   poll_fds = (struct pollfd*)alloca( poll_fd_count * sizeof( struct pollfd ));
   snd_seq_poll_descriptors( apiData->seq, poll_fds + 1, poll_fd_count - 1, POLLIN );
-  poll_fds[0].fd = apiData->trigger_fds[0];
+  poll_fds[0].fd = apiData->trigger_fd;
   poll_fds[0].events = POLLIN;
 
   while ( data->doInput ) {
 
+    // One read from the kernel per wakeup fills the input buffer.
     if ( snd_seq_event_input_pending( apiData->seq, 1 ) == 0 ) {
       // No data pending
       if ( poll( poll_fds, poll_fd_count, -1) >= 0 ) {
         if ( poll_fds[0].revents & POLLIN ) {
-          bool dummy;
-          int res = read( poll_fds[0].fd, &dummy, sizeof(dummy) );
-          (void) res;
+          eventfd_t dummy;
+          eventfd_read( poll_fds[0].fd, &dummy );
         }
       }
       continue;
     }
 
-    // If here, there should be data.
-    result = snd_seq_event_input( apiData->seq, &ev );
-    if ( result == -ENOSPC ) {
-      std::cerr << "\nMidiInAlsa::alsaMidiHandler: MIDI input buffer overrun!\n\n";
-      continue;
-    }
-    else if ( result <= 0 ) {
-      std::cerr << "\nMidiInAlsa::alsaMidiHandler: unknown MIDI input error!\n";
-      perror("System reports");
-      continue;
-    }
+    // Then everything buffered is decoded into one batch.
+    batchCount = 0;
+    do {
+      result = snd_seq_event_input( apiData->seq, &ev );
+      if ( result == -ENOSPC ) {
+        std::cerr << "\nMidiInAlsa::alsaMidiHandler: MIDI input buffer overrun!\n\n";
+        continue;
+      }
+      else if ( result == -EAGAIN ) {
+        break;
+      }
+      else if ( result < 0 ) {
+        std::cerr << "\nMidiInAlsa::alsaMidiHandler: unknown MIDI input error!\n";
+        perror("System reports");
+        break;
+      }
 
-    // This is a bit weird, but we now have to decode an ALSA MIDI
-    // event (back) into MIDI bytes.  We'll ignore non-MIDI types.
-    if ( !continueSysex ) message.bytes.clear();
+      // This is a bit weird, but we now have to decode an ALSA MIDI
+      // event (back) into MIDI bytes.  We'll ignore non-MIDI types.
+      message.bytes.clear();
 
-    doDecode = false;
-    switch ( ev->type ) {
+      doDecode = false;
+      switch ( ev->type ) {
 
-    case SND_SEQ_EVENT_PORT_SUBSCRIBED:
+      case SND_SEQ_EVENT_PORT_SUBSCRIBED:
 #if defined(__RTMIDI_DEBUG__)
-      std::cout << "MidiInAlsa::alsaMidiHandler: port connection made!\n";
+        std::cout << "MidiInAlsa::alsaMidiHandler: port connection made!\n";
 #endif
-      break;
+        break;
 
-    case SND_SEQ_EVENT_PORT_UNSUBSCRIBED:
+      case SND_SEQ_EVENT_PORT_UNSUBSCRIBED:
 #if defined(__RTMIDI_DEBUG__)
-      std::cerr << "MidiInAlsa::alsaMidiHandler: port connection has closed!\n";
-      std::cout << "sender = " << (int) ev->data.connect.sender.client << ":"
-                << (int) ev->data.connect.sender.port
-                << ", dest = " << (int) ev->data.connect.dest.client << ":"
-                << (int) ev->data.connect.dest.port
-                << std::endl;
+        std::cerr << "MidiInAlsa::alsaMidiHandler: port connection has closed!\n";
+        std::cout << "sender = " << (int) ev->data.connect.sender.client << ":"
+                  << (int) ev->data.connect.sender.port
+                  << ", dest = " << (int) ev->data.connect.dest.client << ":"
+                  << (int) ev->data.connect.dest.port
+                  << std::endl;
 #endif
-      break;
+        break;
 
-    case SND_SEQ_EVENT_QFRAME: // MIDI time code
-      if ( !( data->ignoreFlags & 0x02 ) ) doDecode = true;
-      break;
+      case SND_SEQ_EVENT_QFRAME: // MIDI time code
+        if ( !( data->ignoreFlags & 0x02 ) ) doDecode = true;
+        break;
 
-    case SND_SEQ_EVENT_TICK: // 0xF9 ... MIDI timing tick
-      if ( !( data->ignoreFlags & 0x02 ) ) doDecode = true;
-      break;
+      case SND_SEQ_EVENT_TICK: // 0xF9 ... MIDI timing tick
+        if ( !( data->ignoreFlags & 0x02 ) ) doDecode = true;
+        break;
 
-    case SND_SEQ_EVENT_CLOCK: // 0xF8 ... MIDI timing (clock) tick
-      if ( !( data->ignoreFlags & 0x02 ) ) doDecode = true;
-      break;
+      case SND_SEQ_EVENT_CLOCK: // 0xF8 ... MIDI timing (clock) tick
+        if ( !( data->ignoreFlags & 0x02 ) ) doDecode = true;
+        break;
 
-    case SND_SEQ_EVENT_SENSING: // Active sensing
-      if ( !( data->ignoreFlags & 0x04 ) ) doDecode = true;
-      break;
+      case SND_SEQ_EVENT_SENSING: // Active sensing
+        if ( !( data->ignoreFlags & 0x04 ) ) doDecode = true;
+        break;
 
-		case SND_SEQ_EVENT_SYSEX:
-      if ( (data->ignoreFlags & 0x01) ) break;
-      if ( ev->data.ext.len > apiData->bufferSize ) {
-        apiData->bufferSize = ev->data.ext.len;
-        free( buffer );
-        buffer = (unsigned char *) malloc( apiData->bufferSize );
-        if ( buffer == NULL ) {
-          data->doInput = false;
-          std::cerr << "\nMidiInAlsa::alsaMidiHandler: error resizing buffer memory!\n\n";
-          break;
+      case SND_SEQ_EVENT_SYSEX:
+        // The ALSA sequencer has a maximum buffer size for MIDI sysex
+        // events of 256 bytes.  If a device sends sysex messages larger
+        // than this, they are segmented into 256 byte chunks, which
+        // alsaSysex() chains back together without the decoder.
+        if ( (data->ignoreFlags & 0x01) ) break;
+        if ( data->sysexCallback && batchCount > 0 ) {
+          // Keep the callback in order with the messages before it.
+          alsaPublish( data, batch, batchCount );
+          batchCount = 0;
         }
-      }
+        alsaSysex( data, apiData, ev, message );
+        break;
 
-    default:
-      doDecode = true;
-    }
+      default:
+        doDecode = true;
+      }
 
-    if ( doDecode ) {
+      if ( doDecode ) {
 
-      nBytes = snd_midi_event_decode( apiData->coder, buffer, apiData->bufferSize, ev );
-      if ( nBytes > 0 ) {
-        // The ALSA sequencer has a maximum buffer size for MIDI sysex
-        // events of 256 bytes.  If a device sends sysex messages larger
-        // than this, they are segmented into 256 byte chunks.  So,
-        // we'll watch for this and concatenate sysex chunks into a
-        // single sysex message if necessary.
-        if ( !continueSysex )
+        nBytes = snd_midi_event_decode( apiData->coder, buffer, apiData->bufferSize, ev );
+        if ( nBytes > 0 ) {
           message.bytes.assign( buffer, &buffer[nBytes] );
-        else
-          message.bytes.insert( message.bytes.end(), buffer, &buffer[nBytes] );
-
-        continueSysex = ( ( ev->type == SND_SEQ_EVENT_SYSEX ) && ( message.bytes.back() != 0xF7 ) );
-        if ( !continueSysex ) {
-
-          // Calculate the time stamp:
-          message.timeStamp = 0.0;
-
-          // Method 1: Use the system time.
-          //(void)gettimeofday(&tv, (struct timezone *)NULL);
-          //time = (tv.tv_sec * 1000000) + tv.tv_usec;
-
-          // Method 2: Use the ALSA sequencer event time data.
-          // (thanks to Pedro Lopez-Cabanillas!).
-          time = ( ev->time.time.tv_sec * 1000000 ) + ( ev->time.time.tv_nsec/1000 );
-          lastTime = time;
-          time -= apiData->lastTime;
-          apiData->lastTime = lastTime;
-          if ( data->firstMessage == true )
-            data->firstMessage = false;
-          else
-            message.timeStamp = time * 0.000001;
+          message.timeStamp = alsaTimeStamp( data, apiData, ev );
+          message.source = alsaSourceIndex( apiData, ev->source );
         }
         else {
 #if defined(__RTMIDI_DEBUG__)
@@ -1262,28 +1858,23 @@ static void *alsaMidiHandler( void *ptr )
 #endif
         }
       }
-    }
 
-    snd_seq_free_event( ev );
-    if ( message.bytes.size() == 0 || continueSysex ) continue;
+      // Events live in the input buffer, so there is nothing to free.
+      if ( message.bytes.size() == 0 ) continue;
 
-    if ( data->usingCallback ) {
-      RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) data->userCallback;
-      callback( message.timeStamp, &message.bytes, data->userData );
-    }
-    else {
-      // As long as we haven't reached our queue size limit, push the message.
-      if ( data->queue.size < data->queue.ringSize ) {
-        data->queue.ring[data->queue.back++] = message;
-        if ( data->queue.back == data->queue.ringSize )
-          data->queue.back = 0;
-        data->queue.size++;
-      }
-      else
-        std::cerr << "\nMidiInAlsa: message queue limit reached!!\n\n";
-    }
+      // Batch slots keep their byte storage from one wakeup to the next.
+      if ( batchCount == batch.size() ) batch.resize( batchCount + 1 );
+      batch[batchCount].bytes.swap( message.bytes );
+      batch[batchCount].timeStamp = message.timeStamp;
+      batch[batchCount].source = message.source;
+      batchCount++;
+    } while ( data->doInput && snd_seq_event_input_pending( apiData->seq, 0 ) > 0 );
+
+    if ( batchCount > 0 ) alsaPublish( data, batch, batchCount );
   }
 
+  for ( unsigned int i=0; i<apiData->sysex.size(); i++ )
+    apiData->sysexPool.release( apiData->sysex[i] );
   if ( buffer ) free( buffer );
   snd_midi_event_free( apiData->coder );
   apiData->coder = 0;
@@ -1305,20 +1896,22 @@ MidiInAlsa :: ~MidiInAlsa()
   AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
   if ( inputData_.doInput ) {
     inputData_.doInput = false;
-    int res = write( data->trigger_fds[1], &inputData_.doInput, sizeof(inputData_.doInput) );
-    (void) res;
+    eventfd_write( data->trigger_fd, 1 );
     if ( !pthread_equal(data->thread, data->dummy_thread_id) )
       pthread_join( data->thread, NULL );
   }
 
   // Cleanup.
-  close ( data->trigger_fds[0] );
-  close ( data->trigger_fds[1] );
+  if ( data->trigger_fd >= 0 ) close ( data->trigger_fd );
+  if ( inputData_.queueFd >= 0 ) close ( inputData_.queueFd );
   if ( data->vport >= 0 ) snd_seq_delete_port( data->seq, data->vport );
 #ifndef AVOID_TIMESTAMPING
   snd_seq_free_queue( data->seq, data->queue_id );
 #endif
   snd_seq_close( data->seq );
+  AlsaPortRegistry::release();
+  alsaFreeRetiredSources( data );
+  delete data->sourceTable.load();
   delete data;
 }
 
@@ -1344,13 +1937,16 @@ void MidiInAlsa :: initialize( const std::string& clientName )
   data->subscription = 0;
   data->dummy_thread_id = pthread_self();
   data->thread = data->dummy_thread_id;
-  data->trigger_fds[0] = -1;
-  data->trigger_fds[1] = -1;
+  data->trigger_fd = -1;
+  data->registry = AlsaPortRegistry::acquire();
+  data->sourceTable = NULL;
   apiData_ = (void *) data;
   inputData_.apiData = (void *) data;
 
-   if ( pipe(data->trigger_fds) == -1 ) {
-    errorString_ = "MidiInAlsa::initialize: error creating pipe objects.";
+  data->trigger_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  inputData_.queueFd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  if ( data->trigger_fd == -1 || inputData_.queueFd == -1 ) {
+    errorString_ = "MidiInAlsa::initialize: error creating eventfd objects.";
     error( RtMidiError::DRIVER_ERROR, errorString_ );
     return;
   }
@@ -1368,66 +1964,18 @@ void MidiInAlsa :: initialize( const std::string& clientName )
 #endif
 }
 
-// This function is used to count or get the pinfo structure for a given port number.
-unsigned int portInfo( snd_seq_t *seq, snd_seq_port_info_t *pinfo, unsigned int type, int portNumber )
-{
-  snd_seq_client_info_t *cinfo;
-  int client;
-  int count = 0;
-  snd_seq_client_info_alloca( &cinfo );
-
-  snd_seq_client_info_set_client( cinfo, -1 );
-  while ( snd_seq_query_next_client( seq, cinfo ) >= 0 ) {
-    client = snd_seq_client_info_get_client( cinfo );
-    if ( client == 0 ) continue;
-    // Reset query info
-    snd_seq_port_info_set_client( pinfo, client );
-    snd_seq_port_info_set_port( pinfo, -1 );
-    while ( snd_seq_query_next_port( seq, pinfo ) >= 0 ) {
-      unsigned int atyp = snd_seq_port_info_get_type( pinfo );
-      if ( ( atyp & SND_SEQ_PORT_TYPE_MIDI_GENERIC ) == 0 ) continue;
-      unsigned int caps = snd_seq_port_info_get_capability( pinfo );
-      if ( ( caps & type ) != type ) continue;
-      if ( count == portNumber ) return 1;
-      ++count;
-    }
-  }
-
-  // If a negative portNumber was used, return the port count.
-  if ( portNumber < 0 ) return count;
-  return 0;
-}
-
 unsigned int MidiInAlsa :: getPortCount()
 {
-  snd_seq_port_info_t *pinfo;
-  snd_seq_port_info_alloca( &pinfo );
-
   AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
-  return portInfo( data->seq, pinfo, SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ, -1 );
+  return data->registry->count( ALSA_INPUT_CAPS );
 }
 
 std::string MidiInAlsa :: getPortName( unsigned int portNumber )
 {
-  snd_seq_client_info_t *cinfo;
-  snd_seq_port_info_t *pinfo;
-  snd_seq_client_info_alloca( &cinfo );
-  snd_seq_port_info_alloca( &pinfo );
-
   std::string stringName;
   AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
-  if ( portInfo( data->seq, pinfo, SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ, (int) portNumber ) ) {
-    int cnum = snd_seq_port_info_get_client( pinfo );
-    snd_seq_get_any_client_info( data->seq, cnum, cinfo );
-    std::ostringstream os;
-    os << snd_seq_client_info_get_name( cinfo );
-    os << " ";                                    // These lines added to make sure devices are listed
-    os << snd_seq_port_info_get_client( pinfo );  // with full portnames added to ensure individual device names
-    os << ":";
-    os << snd_seq_port_info_get_port( pinfo );
-    stringName = os.str();
+  if ( data->registry->port( ALSA_INPUT_CAPS, portNumber, NULL, &stringName ) )
     return stringName;
-  }
 
   // If we get here, we didn't find a match.
   errorString_ = "MidiInAlsa::getPortName: error looking for port name!";
@@ -1435,6 +1983,12 @@ std::string MidiInAlsa :: getPortName( unsigned int portNumber )
   return stringName;
 }
 
+int MidiInAlsa :: getPortNumber( const std::string &portName )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  return data->registry->find( ALSA_INPUT_CAPS, portName );
+}
+
 void MidiInAlsa :: openPort( unsigned int portNumber, const std::string portName )
 {
   if ( connected_ ) {
@@ -1450,10 +2004,9 @@ void MidiInAlsa :: openPort( unsigned int portNumber, const std::string portName
     return;
   }
 
-  snd_seq_port_info_t *src_pinfo;
-  snd_seq_port_info_alloca( &src_pinfo );
+  snd_seq_addr_t sender, receiver;
   AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
-  if ( portInfo( data->seq, src_pinfo, SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ, (int) portNumber ) == 0 ) {
+  if ( !data->registry->port( ALSA_INPUT_CAPS, portNumber, &sender, NULL ) ) {
     std::ostringstream ost;
     ost << "MidiInAlsa::openPort: the 'portNumber' argument (" << portNumber << ") is invalid.";
     errorString_ = ost.str();
@@ -1461,9 +2014,6 @@ void MidiInAlsa :: openPort( unsigned int portNumber, const std::string portName
     return;
   }
 
-  snd_seq_addr_t sender, receiver;
-  sender.client = snd_seq_port_info_get_client( src_pinfo );
-  sender.port = snd_seq_port_info_get_port( src_pinfo );
   receiver.client = snd_seq_client_id( data->seq );
 
   snd_seq_port_info_t *pinfo;
@@ -1514,6 +2064,9 @@ void MidiInAlsa :: openPort( unsigned int portNumber, const std::string portName
     }
   }
 
+  data->sources.assign( 1, sender );
+  alsaPublishSources( data );
+
   if ( inputData_.doInput == false ) {
     // Start the input queue
 #ifndef AVOID_TIMESTAMPING
@@ -1543,6 +2096,51 @@ void MidiInAlsa :: openPort( unsigned int portNumber, const std::string portName
   connected_ = true;
 }
 
+int MidiInAlsa :: addPort( unsigned int portNumber )
+{
+  if ( !connected_ ) return MidiInApi::addPort( portNumber );
+
+  snd_seq_addr_t sender, receiver;
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  if ( !data->registry->port( ALSA_INPUT_CAPS, portNumber, &sender, NULL ) ) {
+    std::ostringstream ost;
+    ost << "MidiInAlsa::addPort: the 'portNumber' argument (" << portNumber << ") is invalid.";
+    errorString_ = ost.str();
+    error( RtMidiError::INVALID_PARAMETER, errorString_ );
+    return -1;
+  }
+  receiver.client = snd_seq_client_id( data->seq );
+  receiver.port = data->vport;
+
+  for ( unsigned int i=0; i<data->sources.size(); i++ )
+    if ( data->sources[i].client == sender.client && data->sources[i].port == sender.port )
+      return (int) i;
+
+  snd_seq_port_subscribe_t *subscription;
+  if ( snd_seq_port_subscribe_malloc( &subscription ) < 0 ) {
+    errorString_ = "MidiInAlsa::addPort: ALSA error allocation port subscription.";
+    error( RtMidiError::DRIVER_ERROR, errorString_ );
+    return -1;
+  }
+  snd_seq_port_subscribe_set_sender( subscription, &sender );
+  snd_seq_port_subscribe_set_dest( subscription, &receiver );
+
+  // Known before the first event from it can arrive.
+  data->sources.push_back( sender );
+  alsaPublishSources( data );
+
+  if ( snd_seq_subscribe_port( data->seq, subscription ) ) {
+    snd_seq_port_subscribe_free( subscription );
+    data->sources.pop_back();
+    alsaPublishSources( data );
+    errorString_ = "MidiInAlsa::addPort: ALSA error making port connection.";
+    error( RtMidiError::DRIVER_ERROR, errorString_ );
+    return -1;
+  }
+  data->addedSubscriptions.push_back( subscription );
+  return (int) data->sources.size() - 1;
+}
+
 void MidiInAlsa :: openVirtualPort( std::string portName )
 {
   AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
@@ -1615,6 +2213,13 @@ void MidiInAlsa :: closePort( void )
       snd_seq_port_subscribe_free( data->subscription );
       data->subscription = 0;
     }
+    for ( unsigned int i=0; i<data->addedSubscriptions.size(); i++ ) {
+      snd_seq_unsubscribe_port( data->seq, data->addedSubscriptions[i] );
+      snd_seq_port_subscribe_free( data->addedSubscriptions[i] );
+    }
+    data->addedSubscriptions.clear();
+    data->sources.clear();
+    alsaPublishSources( data );
     // Stop the input queue
 #ifndef AVOID_TIMESTAMPING
     snd_seq_stop_queue( data->seq, data->queue_id, NULL );
@@ -1626,11 +2231,11 @@ void MidiInAlsa :: closePort( void )
   // Stop thread to avoid triggering the callback, while the port is intended to be closed
   if ( inputData_.doInput ) {
     inputData_.doInput = false;
-    int res = write( data->trigger_fds[1], &inputData_.doInput, sizeof(inputData_.doInput) );
-    (void) res;
+    eventfd_write( data->trigger_fd, 1 );
     if ( !pthread_equal(data->thread, data->dummy_thread_id) )
       pthread_join( data->thread, NULL );
   }
+  alsaFreeRetiredSources( data );
 }
 
 //*********************************************************************//
@@ -1654,6 +2259,7 @@ MidiOutAlsa :: ~MidiOutAlsa()
   if ( data->coder ) snd_midi_event_free( data->coder );
   if ( data->buffer ) free( data->buffer );
   snd_seq_close( data->seq );
+  AlsaPortRegistry::release();
   delete data;
 }
 
@@ -1694,39 +2300,22 @@ void MidiOutAlsa :: initialize( const std::string& clientName )
     return;
   }
   snd_midi_event_init( data->coder );
+  data->registry = AlsaPortRegistry::acquire();
   apiData_ = (void *) data;
 }
 
 unsigned int MidiOutAlsa :: getPortCount()
 {
-	snd_seq_port_info_t *pinfo;
-	snd_seq_port_info_alloca( &pinfo );
-
   AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
-  return portInfo( data->seq, pinfo, SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE, -1 );
+  return data->registry->count( ALSA_OUTPUT_CAPS );
 }
 
 std::string MidiOutAlsa :: getPortName( unsigned int portNumber )
 {
-  snd_seq_client_info_t *cinfo;
-  snd_seq_port_info_t *pinfo;
-  snd_seq_client_info_alloca( &cinfo );
-  snd_seq_port_info_alloca( &pinfo );
-
   std::string stringName;
   AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
-  if ( portInfo( data->seq, pinfo, SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE, (int) portNumber ) ) {
-    int cnum = snd_seq_port_info_get_client(pinfo);
-    snd_seq_get_any_client_info( data->seq, cnum, cinfo );
-    std::ostringstream os;
-    os << snd_seq_client_info_get_name(cinfo);
-    os << " ";                                    // These lines added to make sure devices are listed
-    os << snd_seq_port_info_get_client( pinfo );  // with full portnames added to ensure individual device names
-    os << ":";
-    os << snd_seq_port_info_get_port(pinfo);
-    stringName = os.str();
+  if ( data->registry->port( ALSA_OUTPUT_CAPS, portNumber, NULL, &stringName ) )
     return stringName;
-  }
 
   // If we get here, we didn't find a match.
   errorString_ = "MidiOutAlsa::getPortName: error looking for port name!";
@@ -1734,6 +2323,12 @@ std::string MidiOutAlsa :: getPortName( unsigned int portNumber )
   return stringName;
 }
 
+int MidiOutAlsa :: getPortNumber( const std::string &portName )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  return data->registry->find( ALSA_OUTPUT_CAPS, portName );
+}
+
 void MidiOutAlsa :: openPort( unsigned int portNumber, const std::string portName )
 {
   if ( connected_ ) {
@@ -1749,10 +2344,9 @@ void MidiOutAlsa :: openPort( unsigned int portNumber, const std::string portNam
     return;
   }
 
-	snd_seq_port_info_t *pinfo;
-	snd_seq_port_info_alloca( &pinfo );
+  snd_seq_addr_t sender, receiver;
   AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
-  if ( portInfo( data->seq, pinfo, SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE, (int) portNumber ) == 0 ) {
+  if ( !data->registry->port( ALSA_OUTPUT_CAPS, portNumber, &receiver, NULL ) ) {
     std::ostringstream ost;
     ost << "MidiOutAlsa::openPort: the 'portNumber' argument (" << portNumber << ") is invalid.";
     errorString_ = ost.str();
@@ -1760,9 +2354,6 @@ void MidiOutAlsa :: openPort( unsigned int portNumber, const std::string portNam
     return;
   }
 
-  snd_seq_addr_t sender, receiver;
-  receiver.client = snd_seq_port_info_get_client( pinfo );
-  receiver.port = snd_seq_port_info_get_port( pinfo );
   sender.client = snd_seq_client_id( data->seq );
 
   if ( data->vport < 0 ) {
@@ -2416,15 +3007,33 @@ void MidiOutWinMM :: sendMessage( std::vector<unsigned char> *message )
 #include <jack/jack.h>
 #include <jack/midiport.h>
 #include <jack/ringbuffer.h>
+#include <pthread.h>
 
 #define JACK_RINGBUFFER_SIZE 16384 // Default size for ringbuffer
+#define JACK_MESSAGE_RESERVE 256   // Bytes preallocated per input message
+
+// Outgoing messages travel to the process callback as one record each in
+// a single ringbuffer: this header, then the message bytes. The header
+// is always written together with its payload, so the reader never sees
+// the two out of step.
+//
+// jack_ringbuffer is single-producer, so sendMessage() callers take
+// writeMutex around the space check and the two writes. Only those
+// (non-realtime) sender threads ever contend for it; the process
+// callback is the single consumer and never locks, so the realtime side
+// stays lock-free. The critical section is a couple of memcpys.
+struct JackMidiRecord {
+  jack_nframes_t time;   // frame time the message is due
+  uint32_t size;         // message bytes following the header
+};
 
 struct JackMidiData {
   jack_client_t *client;
   jack_port_t *port;
-  jack_ringbuffer_t *buffSize;
-  jack_ringbuffer_t *buffMessage;
+  jack_ringbuffer_t *buffer;
+  pthread_mutex_t writeMutex;  // serializes senders; the process callback takes no lock
   jack_time_t lastTime;
+  MidiInApi :: MidiMessage message;  // callback delivery, reused every event
   MidiInApi :: RtMidiInData *rtMidiIn;
   };
 
@@ -2439,47 +3048,53 @@ static int jackProcessIn( jack_nframes_t nframes, void *arg )
   MidiInApi :: RtMidiInData *rtData = jData->rtMidiIn;
   jack_midi_event_t event;
   jack_time_t time;
+  double timeStamp;
 
   // Is port created?
   if ( jData->port == NULL ) return 0;
   void *buff = jack_port_get_buffer( jData->port, nframes );
 
+  // Each event carries its frame offset within the cycle. Stamp it from
+  // the time of the cycle's first frame so the events of one period keep
+  // their spacing instead of all sharing the time the callback ran.
+  jack_time_t cycleTime = jack_frames_to_time( jData->client, jack_last_frame_time( jData->client ) );
+  double usPerFrame = 1000000.0 / jack_get_sample_rate( jData->client );
+
   // We have midi events in buffer
   int evCount = jack_midi_get_event_count( buff );
   for (int j = 0; j < evCount; j++) {
-    MidiInApi::MidiMessage message;
-    message.bytes.clear();
-
     jack_midi_event_get( &event, buff, j );
 
-    for ( unsigned int i = 0; i < event.size; i++ )
-      message.bytes.push_back( event.buffer[i] );
-
     // Compute the delta time.
-    time = jack_get_time();
+    time = cycleTime + (jack_time_t) ( event.time * usPerFrame );
+    timeStamp = 0.0;
     if ( rtData->firstMessage == true )
       rtData->firstMessage = false;
     else
-      message.timeStamp = ( time - jData->lastTime ) * 0.000001;
+      timeStamp = ( time - jData->lastTime ) * 0.000001;
 
     jData->lastTime = time;
 
-    if ( !rtData->continueSysex ) {
-      if ( rtData->usingCallback ) {
-        RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) rtData->userCallback;
-        callback( message.timeStamp, &message.bytes, rtData->userData );
-      }
-      else {
-        // As long as we haven't reached our queue size limit, push the message.
-        if ( rtData->queue.size < rtData->queue.ringSize ) {
-          rtData->queue.ring[rtData->queue.back++] = message;
-          if ( rtData->queue.back == rtData->queue.ringSize )
-            rtData->queue.back = 0;
-          rtData->queue.size++;
-        }
-        else
-          std::cerr << "\nMidiInJack: message queue limit reached!!\n\n";
+    if ( rtData->continueSysex ) continue;
+
+    // Copy the event straight into storage that keeps its capacity
+    if ( rtData->usingCallback ) {
+      RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) rtData->userCallback;
+      jData->message.bytes.assign( event.buffer, event.buffer + event.size );
+      callback( timeStamp, &jData->message.bytes, rtData->userData );
+    }
+    else {
+      // As long as we haven't reached our queue size limit, push the message.
+      if ( rtData->queue.size < rtData->queue.ringSize ) {
+        MidiInApi::MidiMessage &slot = rtData->queue.ring[rtData->queue.back++];
+        slot.bytes.assign( event.buffer, event.buffer + event.size );
+        slot.timeStamp = timeStamp;
+        if ( rtData->queue.back == rtData->queue.ringSize )
+          rtData->queue.back = 0;
+        rtData->queue.size++;
       }
+      else
+        std::cerr << "\nMidiInJack: message queue limit reached!!\n\n";
     }
   }
 
@@ -2501,6 +3116,11 @@ void MidiInJack :: initialize( const std::string& clientName )
   data->client = NULL;
   this->clientName = clientName;
 
+  // Keep the process callback from allocating for ordinary messages
+  data->message.bytes.reserve( JACK_MESSAGE_RESERVE );
+  for ( unsigned int i = 0; i < inputData_.queue.ringSize; i++ )
+    inputData_.queue.ring[i].bytes.reserve( JACK_MESSAGE_RESERVE );
+
   connect();
 }
 
@@ -2637,7 +3257,7 @@ static int jackProcessOut( jack_nframes_t nframes, void *arg )
 {
   JackMidiData *data = (JackMidiData *) arg;
   jack_midi_data_t *midiData;
-  int space;
+  JackMidiRecord record;
 
   // Is port created?
   if ( data->port == NULL ) return 0;
@@ -2645,11 +3265,33 @@ static int jackProcessOut( jack_nframes_t nframes, void *arg )
   void *buff = jack_port_get_buffer( data->port, nframes );
   jack_midi_clear_buffer( buff );
 
-  while ( jack_ringbuffer_read_space( data->buffSize ) > 0 ) {
-    jack_ringbuffer_read( data->buffSize, (char *) &space, (size_t) sizeof(space) );
-    midiData = jack_midi_event_reserve( buff, 0, space );
-
-    jack_ringbuffer_read( data->buffMessage, (char *) midiData, (size_t) space );
+  // Messages stamped during the previous cycle are played at the same
+  // offsets in this one: a constant one period of latency, but their
+  // spacing is kept to the frame. Late ones go out at the start of the
+  // cycle and ones due after it stay queued.
+  jack_nframes_t start = jack_last_frame_time( data->client ) - nframes;
+  jack_nframes_t last = 0;
+
+  while ( jack_ringbuffer_read_space( data->buffer ) >= sizeof(record) ) {
+    jack_ringbuffer_peek( data->buffer, (char *) &record, sizeof(record) );
+    if ( jack_ringbuffer_read_space( data->buffer ) < sizeof(record) + record.size )
+      break; // Payload still being written
+
+    jack_nframes_t offset = 0;
+    if ( (int32_t) ( record.time - start ) > 0 ) {
+      offset = record.time - start;
+      if ( offset >= nframes ) break;
+    }
+    // Events must not go back in time within the buffer
+    if ( offset < last ) offset = last;
+    last = offset;
+
+    jack_ringbuffer_read_advance( data->buffer, sizeof(record) );
+    midiData = jack_midi_event_reserve( buff, offset, record.size );
+    if ( midiData )
+      jack_ringbuffer_read( data->buffer, (char *) midiData, record.size );
+    else
+      jack_ringbuffer_read_advance( data->buffer, record.size ); // Port buffer full
   }
 
   return 0;
@@ -2667,6 +3309,8 @@ void MidiOutJack :: initialize( const std::string& clientName )
 
   data->port = NULL;
   data->client = NULL;
+  data->buffer = NULL;
+  pthread_mutex_init( &data->writeMutex, NULL );
   this->clientName = clientName;
 
   connect();
@@ -2686,8 +3330,7 @@ void MidiOutJack :: connect()
   }
 
   jack_set_process_callback( data->client, jackProcessOut, data );
-  data->buffSize = jack_ringbuffer_create( JACK_RINGBUFFER_SIZE );
-  data->buffMessage = jack_ringbuffer_create( JACK_RINGBUFFER_SIZE );
+  data->buffer = jack_ringbuffer_create( JACK_RINGBUFFER_SIZE );
   jack_activate( data->client );
 }
 
@@ -2699,10 +3342,10 @@ MidiOutJack :: ~MidiOutJack()
   if ( data->client ) {
     // Cleanup
     jack_client_close( data->client );
-    jack_ringbuffer_free( data->buffSize );
-    jack_ringbuffer_free( data->buffMessage );
+    jack_ringbuffer_free( data->buffer );
   }
 
+  pthread_mutex_destroy( &data->writeMutex );
   delete data;
 }
 
@@ -2805,13 +3448,26 @@ void MidiOutJack :: closePort()
 
 void MidiOutJack :: sendMessage( std::vector<unsigned char> *message )
 {
-  int nBytes = message->size();
   JackMidiData *data = static_cast<JackMidiData *> (apiData_);
+  JackMidiRecord record;
 
-  // Write full message to buffer
-  jack_ringbuffer_write( data->buffMessage, ( const char * ) &( *message )[0],
-                         message->size() );
-  jack_ringbuffer_write( data->buffSize, ( char * ) &nBytes, sizeof( nBytes ) );
+  if ( data->client == NULL || message->empty() ) return;
+
+  // Stamped under the lock so records enter the ringbuffer in time order
+  record.size = message->size();
+  pthread_mutex_lock( &data->writeMutex );
+  record.time = jack_frame_time( data->client );
+
+  // Write header and message as one record, or not at all
+  if ( jack_ringbuffer_write_space( data->buffer ) < sizeof(record) + record.size ) {
+    pthread_mutex_unlock( &data->writeMutex );
+    errorString_ = "MidiOutJack::sendMessage: ringbuffer full, message dropped.";
+    error( RtMidiError::WARNING, errorString_ );
+    return;
+  }
+  jack_ringbuffer_write( data->buffer, ( const char * ) &record, sizeof(record) );
+  jack_ringbuffer_write( data->buffer, ( const char * ) &( *message )[0], record.size );
+  pthread_mutex_unlock( &data->writeMutex );
 }
 
 #endif  // __UNIX_JACK__
@@ -150,6 +150,9 @@ class RtMidi
   //! Pure virtual getPortName() function.
   virtual std::string getPortName( unsigned int portNumber = 0 ) = 0;
 
+  //! Pure virtual getPortNumber() function.
+  virtual int getPortNumber( const std::string &portName ) = 0;
+
   //! Pure virtual closePort() function.
   virtual void closePort( void ) = 0;
 
@@ -210,6 +213,24 @@ class RtMidiIn : public RtMidi
   //! User callback function type definition.
   typedef void (*RtMidiCallback)( double timeStamp, std::vector<unsigned char> *message, void *userData);
 
+  //! User callback function type for aggregated input, which also receives the message's source index (see addPort()).
+  typedef void (*RtMidiSourceCallback)( double timeStamp, unsigned int source, std::vector<unsigned char> *message, void *userData);
+
+  //! One contiguous piece of a SysEx message handed to a RtMidiSysexCallback.
+  struct SysexSegment {
+    const unsigned char *data;
+    size_t size;
+  };
+
+  //! SysEx callback function type: the message (or the next part of it) as a scatter list.
+  /*!
+    \e complete is false for a partial delivery, in which case later
+    calls continue the same message.  The segments are only valid
+    during the call.
+  */
+  typedef void (*RtMidiSysexCallback)( double timeStamp, unsigned int source, const SysexSegment *segments,
+                                       unsigned int count, bool complete, void *userData );
+
   //! Default constructor that allows an optional api, client name and queue size.
   /*!
     An exception will be thrown if a MIDI system initialization
@@ -258,6 +279,19 @@ class RtMidiIn : public RtMidi
   */
   void openVirtualPort( const std::string portName = std::string( "RtMidi Input" ) );
 
+  //! Subscribe one more MIDI input port to this instance (ALSA only).
+  /*!
+    Messages from all ports subscribed to an instance share its single
+    handler thread, queue and time base.  Each is tagged with the index
+    of its source: 0 for the port given to openPort(), then 1, 2, ... in
+    the order ports are added.  The tag is available from getMessage()
+    and setSourceCallback().  If no port is open yet, this opens
+    \e portNumber as source 0.
+
+    \return The source index, or -1 if the port could not be added.
+  */
+  int addPort( unsigned int portNumber );
+
   //! Set a callback function to be invoked for incoming MIDI messages.
   /*!
     The callback function will be called whenever an incoming MIDI
@@ -271,6 +305,28 @@ class RtMidiIn : public RtMidi
   */
   void setCallback( RtMidiCallback callback, void *userData = 0 );
 
+  //! Set a callback function that also receives each message's source index.
+  /*!
+    As setCallback(), for instances aggregating several ports with
+    addPort().  APIs without aggregated input always report source 0.
+  */
+  void setSourceCallback( RtMidiSourceCallback callback, void *userData = 0 );
+
+  //! Set a callback function that receives SysEx messages without copying them into a vector (ALSA only).
+  /*!
+    SysEx is then delivered here, as a list of segments borrowed from
+    the input thread, instead of through the queue or the other
+    callbacks; those keep receiving all other messages.  SysEx must not
+    be ignored (see ignoreTypes()).
+
+    \param callback The function to call, or NULL to go back to normal delivery.
+    \param userData Optionally, a pointer passed to the callback.
+    \param partialBytes If not 0, a message is also delivered in parts
+                        once this many bytes of it are waiting, so
+                        long dumps can be streamed on as they arrive.
+  */
+  void setSysexCallback( RtMidiSysexCallback callback, void *userData = 0, size_t partialBytes = 0 );
+
   //! Cancel use of the current callback function (if one exists).
   /*!
     Subsequent incoming MIDI messages will be written to the queue
@@ -297,6 +353,12 @@ class RtMidiIn : public RtMidi
   */
   std::string getPortName( unsigned int portNumber = 0 );
 
+  //! Return the number of the MIDI input port with the given name (as returned by getPortName()).
+  /*!
+    \retval -1 is returned if no port has that name.
+  */
+  int getPortNumber( const std::string &portName );
+
   //! Specify whether certain MIDI message types should be queued or ignored during input.
   /*!
     By default, MIDI timing and active sensing messages are ignored
@@ -317,6 +379,22 @@ class RtMidiIn : public RtMidi
   */
   double getMessage( std::vector<unsigned char> *message );
 
+  //! As getMessage(), also storing the message's source index (see addPort()) in \e source.
+  double getMessage( std::vector<unsigned char> *message, unsigned int *source );
+
+  //! Return a file descriptor that polls readable while messages are queued (ALSA only).
+  /*!
+    Lets an application wait for input in its own poll/epoll loop
+    instead of calling getMessage() on a timer.  Once it is readable,
+    call getMessage() until it returns an empty message; the
+    descriptor is cleared when the queue empties.  It is owned by
+    RtMidiIn and must not be read or closed.  It never becomes
+    readable while a callback is set.
+
+    \retval -1 is returned if the API does not provide one.
+  */
+  int getMessageFd( void );
+
   //! Set an error callback function to be invoked when an error has occured.
   /*!
     The callback function will be called whenever an error has occured. It is best
@@ -401,6 +479,9 @@ class RtMidiOut : public RtMidi
   */
   std::string getPortName( unsigned int portNumber = 0 );
 
+  //! Return the number of the MIDI output port with the given name, or -1 if there is none.
+  int getPortNumber( const std::string &portName );
+
   //! Immediately send a single message out an open MIDI output port.
   /*!
       An exception is thrown if an error occurs during output or an
@@ -446,6 +527,7 @@ class MidiApi
 
   virtual unsigned int getPortCount( void ) = 0;
   virtual std::string getPortName( unsigned int portNumber ) = 0;
+  virtual int getPortNumber( const std::string &portName );
 
   inline bool isPortOpen() const { return connected_; }
   void setErrorCallback( RtMidiErrorCallback errorCallback, void *userData );
@@ -471,19 +553,24 @@ class MidiInApi : public MidiApi
   MidiInApi( unsigned int queueSizeLimit );
   virtual ~MidiInApi( void );
   void setCallback( RtMidiIn::RtMidiCallback callback, void *userData );
+  void setSourceCallback( RtMidiIn::RtMidiSourceCallback callback, void *userData );
+  void setSysexCallback( RtMidiIn::RtMidiSysexCallback callback, void *userData, size_t partialBytes );
   void cancelCallback( void );
   virtual void ignoreTypes( bool midiSysex, bool midiTime, bool midiSense );
-  double getMessage( std::vector<unsigned char> *message );
+  virtual int addPort( unsigned int portNumber );
+  double getMessage( std::vector<unsigned char> *message, unsigned int *source = 0 );
+  int getMessageFd( void ) const { return inputData_.queueFd; }
 
   // A MIDI structure used internally by the class to store incoming
   // messages.  Each message represents one and only one MIDI message.
   struct MidiMessage { 
     std::vector<unsigned char> bytes; 
     double timeStamp;
+    unsigned int source;
 
     // Default constructor.
   MidiMessage()
-  :bytes(0), timeStamp(0.0) {}
+  :bytes(0), timeStamp(0.0), source(0) {}
   };
 
   struct MidiQueue {
@@ -510,16 +597,25 @@ class MidiInApi : public MidiApi
     bool usingCallback;
     RtMidiIn::RtMidiCallback userCallback;
     void *userData;
+    RtMidiIn::RtMidiSourceCallback sourceCallback;
+    void *sourceUserData;
+    RtMidiIn::RtMidiSysexCallback sysexCallback;
+    void *sysexUserData;
+    size_t sysexPartialBytes;
     bool continueSysex;
+    int queueFd;
 
     // Default constructor.
   RtMidiInData()
   : ignoreFlags(7), doInput(false), firstMessage(true),
       apiData(0), usingCallback(false), userCallback(0), userData(0),
-      continueSysex(false) {}
+      sourceCallback(0), sourceUserData(0), sysexCallback(0), sysexUserData(0),
+      sysexPartialBytes(0), continueSysex(false), queueFd(-1) {}
   };
 
  protected:
+  void clearMessageFd( void );
+
   RtMidiInData inputData_;
 };
 
@@ -543,12 +639,18 @@ inline void RtMidiIn :: openPort( unsigned int portNumber, const std::string por
 inline void RtMidiIn :: openVirtualPort( const std::string portName ) { rtapi_->openVirtualPort( portName ); }
 inline void RtMidiIn :: closePort( void ) { rtapi_->closePort(); }
 inline bool RtMidiIn :: isPortOpen() const { return rtapi_->isPortOpen(); }
+inline int RtMidiIn :: addPort( unsigned int portNumber ) { return ((MidiInApi *)rtapi_)->addPort( portNumber ); }
 inline void RtMidiIn :: setCallback( RtMidiCallback callback, void *userData ) { ((MidiInApi *)rtapi_)->setCallback( callback, userData ); }
+inline void RtMidiIn :: setSourceCallback( RtMidiSourceCallback callback, void *userData ) { ((MidiInApi *)rtapi_)->setSourceCallback( callback, userData ); }
+inline void RtMidiIn :: setSysexCallback( RtMidiSysexCallback callback, void *userData, size_t partialBytes ) { ((MidiInApi *)rtapi_)->setSysexCallback( callback, userData, partialBytes ); }
 inline void RtMidiIn :: cancelCallback( void ) { ((MidiInApi *)rtapi_)->cancelCallback(); }
 inline unsigned int RtMidiIn :: getPortCount( void ) { return rtapi_->getPortCount(); }
 inline std::string RtMidiIn :: getPortName( unsigned int portNumber ) { return rtapi_->getPortName( portNumber ); }
+inline int RtMidiIn :: getPortNumber( const std::string &portName ) { return rtapi_->getPortNumber( portName ); }
 inline void RtMidiIn :: ignoreTypes( bool midiSysex, bool midiTime, bool midiSense ) { ((MidiInApi *)rtapi_)->ignoreTypes( midiSysex, midiTime, midiSense ); }
 inline double RtMidiIn :: getMessage( std::vector<unsigned char> *message ) { return ((MidiInApi *)rtapi_)->getMessage( message ); }
+inline double RtMidiIn :: getMessage( std::vector<unsigned char> *message, unsigned int *source ) { return ((MidiInApi *)rtapi_)->getMessage( message, source ); }
+inline int RtMidiIn :: getMessageFd( void ) { return ((MidiInApi *)rtapi_)->getMessageFd(); }
 inline void RtMidiIn :: setErrorCallback( RtMidiErrorCallback errorCallback, void *userData ) { rtapi_->setErrorCallback(errorCallback, userData); }
 
 inline RtMidi::Api RtMidiOut :: getCurrentApi( void ) throw() { return rtapi_->getCurrentApi(); }
@@ -558,6 +660,7 @@ inline void RtMidiOut :: closePort( void ) { rtapi_->closePort(); }
 inline bool RtMidiOut :: isPortOpen() const { return rtapi_->isPortOpen(); }
 inline unsigned int RtMidiOut :: getPortCount( void ) { return rtapi_->getPortCount(); }
 inline std::string RtMidiOut :: getPortName( unsigned int portNumber ) { return rtapi_->getPortName( portNumber ); }
+inline int RtMidiOut :: getPortNumber( const std::string &portName ) { return rtapi_->getPortNumber( portName ); }
 inline void RtMidiOut :: sendMessage( std::vector<unsigned char> *message ) { ((MidiOutApi *)rtapi_)->sendMessage( message ); }
 inline void RtMidiOut :: setErrorCallback( RtMidiErrorCallback errorCallback, void *userData ) { rtapi_->setErrorCallback(errorCallback, userData); }
 
@@ -664,6 +767,8 @@ class MidiInAlsa: public MidiInApi
   void closePort( void );
   unsigned int getPortCount( void );
   std::string getPortName( unsigned int portNumber );
+  int getPortNumber( const std::string &portName );
+  int addPort( unsigned int portNumber );
 
  protected:
   void initialize( const std::string& clientName );
@@ -680,6 +785,7 @@ class MidiOutAlsa: public MidiOutApi
   void closePort( void );
   unsigned int getPortCount( void );
   std::string getPortName( unsigned int portNumber );
+  int getPortNumber( const std::string &portName );
   void sendMessage( std::vector<unsigned char> *message );
 
  protected:
@@ -0,0 +1,627 @@
+//*****************************************//
+//  journal.cpp
+//
+//  Segmented append-only room journal:
+//  background writer and seeking reader.
+//
+//*****************************************//
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "midi_util.h"
+#include "midi_wire.h"
+#include "journal.h"
+
+#define JOURNAL_DIR_TICK_US 20000   // coarsest directory mtime granularity expected
+
+static void put64(unsigned char *p, uint64_t v)
+{
+    wire_put32(p, (uint32_t)(v >> 32));
+    wire_put32(p + 4, (uint32_t)v);
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+    return ((uint64_t)wire_get32(p) << 32) | wire_get32(p + 4);
+}
+
+std::string journal_room_dir(const std::string &dir, const std::string &room)
+{
+    std::string name;
+    for (size_t i = 0; i < room.size(); i++) {
+        char c = room[i];
+        bool safe = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                    (c >= '0' && c <= '9') || c == '-' || c == '_';
+        name += safe ? c : '_';
+    }
+    return dir + "/" + name;
+}
+
+// Apply a snapshot (a run of channel messages) to a state model
+static void apply_snapshot(MidiState &state, const unsigned char *p, size_t n)
+{
+    size_t i = 0;
+    while (i < n) {
+        size_t size = midi_channel_message_size(p[i]);
+        if (size == 0 || i + size > n)
+            break;
+        state.update(p + i, size);
+        i += size;
+    }
+}
+
+/*
+ * Writer, relay thread side
+ */
+
+Journal::Journal(const std::string &dir)
+    : dir_(dir), nextId_(1), ring_(JOURNAL_RING_BYTES), running_(true), dropped_(0)
+{
+    mkdir(dir_.c_str(), 0777);
+    thread_ = std::thread(&Journal::run, this);
+}
+
+Journal::~Journal()
+{
+    // The writer is still running, so the backlog drains
+    for (retry(); !backlog_.empty(); retry())
+        usleep(1000);
+    running_ = false;
+    notify_.signal();
+    thread_.join();
+    if (dropped_)
+        fprintf(stderr, "journal: %lu records dropped\n", (unsigned long)dropped_);
+}
+
+// Appends behind a waiting open would be ignored by the writer anyway
+void Journal::post(const Record &r, const void *payload, size_t n)
+{
+    retry();
+    if (backlog_.empty() && ring_.push(&r, sizeof r, payload, n)) {
+        notify_.notify();
+        return;
+    }
+    if (r.op == OP_APPEND) {
+        dropped_++;
+        return;
+    }
+    const unsigned char *p = (const unsigned char *)payload;
+    std::vector<unsigned char> record((const unsigned char *)&r, (const unsigned char *)(&r + 1));
+    record.insert(record.end(), p, p + n);
+    backlog_.push_back(record);
+}
+
+void Journal::retry()
+{
+    if (backlog_.empty())
+        return;
+    while (!backlog_.empty() && ring_.push(&backlog_.front()[0], backlog_.front().size()))
+        backlog_.pop_front();
+    notify_.notify();
+}
+
+uint32_t Journal::open(const std::string &room, uint64_t time)
+{
+    Record r;
+    r.op = OP_OPEN;
+    r.journal = nextId_++;
+    r.seq = 0;
+    r.time = time;
+    r.session = 0;
+    post(r, room.data(), room.size());
+    return r.journal;
+}
+
+void Journal::append(uint32_t journal, uint32_t seq, uint64_t time, uint32_t session,
+                     const unsigned char *msg, size_t n)
+{
+    // Record lengths are 16 bits, like wire frame bodies
+    if (n > WIRE_MAX_BODY) {
+        dropped_++;
+        return;
+    }
+    Record r;
+    r.op = OP_APPEND;
+    r.journal = journal;
+    r.seq = seq;
+    r.time = time;
+    r.session = session;
+    post(r, msg, n);
+}
+
+void Journal::close(uint32_t journal)
+{
+    Record r;
+    r.op = OP_CLOSE;
+    r.journal = journal;
+    r.seq = 0;
+    r.time = 0;
+    r.session = 0;
+    post(r, NULL, 0);
+}
+
+/*
+ * Writer thread side
+ */
+
+void Journal::run()
+{
+    std::vector<unsigned char> record;
+    uint64_t lastFlush = monotonic_us();
+    for (;;) {
+        while (ring_.pop(record))
+            apply(record);
+
+        uint64_t now = monotonic_us();
+        if (!running_ || now - lastFlush >= JOURNAL_FLUSH_MS * 1000) {
+            std::map<uint32_t, RoomJournal>::iterator it;
+            for (it = rooms_.begin(); it != rooms_.end(); ++it)
+                flush(it->second);
+            lastFlush = now;
+        }
+        if (!running_)
+            break;
+
+        notify_.arm();
+        if (!ring_.empty() || !running_) {
+            notify_.disarm();
+            continue;
+        }
+        notify_.wait((int)((lastFlush + JOURNAL_FLUSH_MS * 1000 - now) / 1000) + 1);
+    }
+    std::map<uint32_t, RoomJournal>::iterator it;
+    for (it = rooms_.begin(); it != rooms_.end(); ++it)
+        finish(it->second);
+    rooms_.clear();
+}
+
+void Journal::apply(const std::vector<unsigned char> &record)
+{
+    Record r;
+    memcpy(&r, &record[0], sizeof r);
+    const unsigned char *payload = &record[0] + sizeof r;
+    size_t n = record.size() - sizeof r;
+
+    if (r.op == OP_OPEN) {
+        RoomJournal &j = rooms_[r.journal];
+        j.dir = journal_room_dir(dir_, std::string((const char *)payload, n));
+        mkdir(j.dir.c_str(), 0777);
+        j.fd = -1;
+        j.indexFd = -1;
+        j.written = j.offset = 0;
+        j.seq = 0;
+        j.time = r.time;
+        j.sinceCheckpoint = 0;
+        j.lastCheckpoint = r.time;
+        return;
+    }
+
+    std::map<uint32_t, RoomJournal>::iterator it = rooms_.find(r.journal);
+    if (it == rooms_.end())
+        return;
+    if (r.op == OP_APPEND && n > 0) {
+        write(it->second, r.seq, r.time, r.session, payload, n);
+    } else if (r.op == OP_CLOSE) {
+        finish(it->second);
+        rooms_.erase(it);
+    }
+}
+
+void Journal::write(RoomJournal &j, uint32_t seq, uint64_t time, uint32_t session,
+                    const unsigned char *msg, size_t n)
+{
+    if (j.fd < 0 || j.offset + JOURNAL_RECORD_HEADER + n > JOURNAL_SEGMENT_BYTES)
+        if (!startSegment(j, time))
+            return;
+    append(j, JOURNAL_MIDI, seq, time, session, msg, n);
+    j.state.update(msg, n);
+    j.seq = seq;
+    j.time = time;
+
+    if (++j.sinceCheckpoint >= JOURNAL_CHECKPOINT_RECORDS ||
+            time - j.lastCheckpoint >= (uint64_t)JOURNAL_CHECKPOINT_MS * 1000)
+        checkpoint(j);
+    if (j.buffer.size() >= JOURNAL_WRITE_BYTES)
+        flush(j);
+}
+
+void Journal::append(RoomJournal &j, unsigned char type, uint32_t seq, uint64_t time,
+                     uint32_t session, const unsigned char *body, size_t n)
+{
+    unsigned char h[JOURNAL_RECORD_HEADER];
+    h[0] = JOURNAL_MARKER;
+    h[1] = type;
+    wire_put16(h + 2, (uint32_t)n);
+    wire_put32(h + 4, seq);
+    put64(h + 8, time);
+    wire_put32(h + 16, session);
+    j.buffer.insert(j.buffer.end(), h, h + sizeof h);
+    j.buffer.insert(j.buffer.end(), body, body + n);
+    j.offset += sizeof h + n;
+}
+
+// Close the current segment and open the next, starting with a checkpoint
+bool Journal::startSegment(RoomJournal &j, uint64_t time)
+{
+    if (j.fd >= 0)
+        finish(j);
+
+    char name[32];
+    snprintf(name, sizeof name, "/%020llu", (unsigned long long)time);
+    std::string base = j.dir + name;
+    j.fd = ::open((base + ".seg").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (j.fd == -1) {
+        perror(("journal: " + base + ".seg").c_str());
+        return false;
+    }
+    // Fixed size up front: no metadata updates while appending, and the
+    // zeroed tail marks where the data ends
+    if (posix_fallocate(j.fd, 0, JOURNAL_SEGMENT_BYTES) != 0 &&
+            ftruncate(j.fd, JOURNAL_SEGMENT_BYTES) == -1) {
+        perror(("journal: " + base + ".seg").c_str());
+        ::close(j.fd);
+        j.fd = -1;
+        return false;
+    }
+    j.indexFd = ::open((base + ".idx").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
+
+    unsigned char h[JOURNAL_HEADER_BYTES] = { 'M', 'J', 'N', 'L' };
+    wire_put32(h + 4, JOURNAL_VERSION);
+    put64(h + 8, time);
+    j.buffer.assign(h, h + sizeof h);
+    j.index.clear();
+    j.written = 0;
+    j.offset = sizeof h;
+    checkpoint(j);
+    return true;
+}
+
+void Journal::checkpoint(RoomJournal &j)
+{
+    snapshot_.clear();
+    j.state.snapshot(snapshot_);
+    if (j.offset + JOURNAL_RECORD_HEADER + snapshot_.size() > JOURNAL_SEGMENT_BYTES) {
+        startSegment(j, j.time);    // which checkpoints first thing
+        return;
+    }
+
+    unsigned char e[JOURNAL_INDEX_ENTRY];
+    put64(e, j.time);
+    wire_put32(e + 8, j.seq);
+    wire_put32(e + 12, (uint32_t)j.offset);
+    j.index.insert(j.index.end(), e, e + sizeof e);
+
+    append(j, JOURNAL_CHECKPOINT, j.seq, j.time, 0,
+           snapshot_.empty() ? NULL : &snapshot_[0], snapshot_.size());
+    j.sinceCheckpoint = 0;
+    j.lastCheckpoint = j.time;
+}
+
+/*
+ * Write out the buffered records. The first byte goes last: it is the
+ * marker (or header magic) readers check, so a concurrent reader sees
+ * either none or all of the batch.
+ */
+void Journal::flush(RoomJournal &j)
+{
+    if (j.fd < 0 || j.buffer.empty())
+        return;
+    const unsigned char *p = &j.buffer[0];
+    size_t n = j.buffer.size();
+    if (pwrite(j.fd, p + 1, n - 1, j.written + 1) != (ssize_t)(n - 1) ||
+            pwrite(j.fd, p, 1, j.written) != 1)
+        perror(("journal: " + j.dir).c_str());
+    j.written += n;
+    j.buffer.clear();
+
+    // Index entries only once the data they point at is in place
+    if (!j.index.empty() && j.indexFd >= 0) {
+        if (::write(j.indexFd, &j.index[0], j.index.size()) != (ssize_t)j.index.size())
+            perror(("journal: " + j.dir).c_str());
+        j.index.clear();
+    }
+}
+
+void Journal::finish(RoomJournal &j)
+{
+    flush(j);
+    if (j.fd >= 0)
+        ::close(j.fd);
+    if (j.indexFd >= 0)
+        ::close(j.indexFd);
+    j.fd = j.indexFd = -1;
+}
+
+/*
+ * Reader
+ */
+
+bool JournalReader::open(const std::string &dir, const std::string &room)
+{
+    unmap();
+    roomDir_ = journal_room_dir(dir, room);
+    segments_.clear();
+    index_.clear();
+    indexSegment_ = indexBytes_ = 0;
+    dirTime_ = listedAt_ = 0;
+    segment_ = 0;
+    offset_ = JOURNAL_HEADER_BYTES;
+    scan();
+    return !segments_.empty();
+}
+
+/*
+ * Pick up new segments. The directory is only listed again once its
+ * mtime moved, or while it is too recent to tell (a file created within
+ * the same timestamp tick as the last listing leaves it unchanged).
+ */
+void JournalReader::scanSegments()
+{
+    struct stat st;
+    if (stat(roomDir_.c_str(), &st) == -1)
+        return;
+    uint64_t mtime = (uint64_t)st.st_mtim.tv_sec * 1000000 + st.st_mtim.tv_nsec / 1000;
+    if (mtime == dirTime_ && listedAt_ > mtime + JOURNAL_DIR_TICK_US)
+        return;
+    uint64_t now = realtime_us();
+
+    DIR *d = opendir(roomDir_.c_str());
+    if (!d)
+        return;
+    std::vector<std::string> names;
+    while (struct dirent *e = readdir(d)) {
+        std::string name = e->d_name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".seg") == 0)
+            names.push_back(name.substr(0, name.size() - 4));
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    dirTime_ = mtime;
+    listedAt_ = now;
+
+    // Segments only ever get added after the newest; anything else starts over
+    if (names.size() < segments_.size() || !std::equal(segments_.begin(), segments_.end(), names.begin())) {
+        index_.clear();
+        indexSegment_ = 0;
+        indexBytes_ = 0;
+    }
+    segments_.swap(names);
+}
+
+// Pick up segments and the index entries written since the last look
+void JournalReader::scan()
+{
+    scanSegments();
+    for (size_t i = indexSegment_; i < segments_.size(); i++) {
+        if (i != indexSegment_) {
+            indexSegment_ = i;
+            indexBytes_ = 0;
+        }
+        FILE *f = fopen((roomDir_ + "/" + segments_[i] + ".idx").c_str(), "rb");
+        if (!f)
+            continue;
+        unsigned char e[JOURNAL_INDEX_ENTRY];
+        if (fseek(f, (long)indexBytes_, SEEK_SET) == 0) {
+            while (fread(e, 1, sizeof e, f) == sizeof e) {
+                IndexEntry entry;
+                entry.time = get64(e);
+                entry.seq = wire_get32(e + 8);
+                entry.offset = wire_get32(e + 12);
+                entry.segment = i;
+                index_.push_back(entry);
+                indexBytes_ += sizeof e;
+            }
+        }
+        fclose(f);
+    }
+}
+
+bool JournalReader::map(size_t segment)
+{
+    unmap();
+    if (segment >= segments_.size())
+        return false;
+    std::string path = roomDir_ + "/" + segments_[segment] + ".seg";
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= JOURNAL_HEADER_BYTES)
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+        return false;
+    map_ = (const unsigned char *)p;
+    mapSize_ = st.st_size;
+    segment_ = segment;
+    return true;
+}
+
+void JournalReader::unmap()
+{
+    if (map_)
+        munmap((void *)map_, mapSize_);
+    map_ = NULL;
+    mapSize_ = 0;
+}
+
+// Read the record at the current position, moving on to later segments
+bool JournalReader::read(unsigned char &type, JournalEntry &entry)
+{
+    for (;;) {
+        if (!map_ && !map(segment_))
+            return false;
+        // Segments in another format are skipped
+        bool valid = memcmp(map_, "MJNL", 4) == 0 && wire_get32(map_ + 4) == JOURNAL_VERSION;
+        if (valid && offset_ + JOURNAL_RECORD_HEADER <= mapSize_ && map_[offset_] == JOURNAL_MARKER) {
+            const unsigned char *h = map_ + offset_;
+            size_t n = wire_get16(h + 2);
+            if (offset_ + JOURNAL_RECORD_HEADER + n > mapSize_)
+                return false;
+            type = h[1];
+            entry.seq = wire_get32(h + 4);
+            entry.time = get64(h + 8);
+            entry.session = wire_get32(h + 16);
+            entry.body.assign(h + JOURNAL_RECORD_HEADER, h + JOURNAL_RECORD_HEADER + n);
+            offset_ += JOURNAL_RECORD_HEADER + n;
+            return true;
+        }
+        // End of this segment's data: continue in the next one if there is one
+        if (segment_ + 1 >= segments_.size())
+            scanSegments();
+        if (segment_ + 1 >= segments_.size())
+            return false;
+        if (!map(segment_ + 1))
+            return false;
+        offset_ = JOURNAL_HEADER_BYTES;
+    }
+}
+
+bool JournalReader::seek(uint64_t time, std::vector<unsigned char> &state, uint32_t &seq)
+{
+    scan();
+    state.clear();
+    seq = 0;
+    if (index_.empty())
+        return false;
+
+    // Last checkpoint before time, else the very first one. One taken at
+    // time already holds the records at time, which next() has to return.
+    std::vector<IndexEntry>::const_iterator it =
+        std::lower_bound(index_.begin(), index_.end(), time, IndexEntry::before);
+    const IndexEntry &start = it == index_.begin() ? index_.front() : *(it - 1);
+    if (!map(start.segment))
+        return false;
+    offset_ = start.offset;
+
+    MidiState model;
+    JournalEntry entry;
+    unsigned char type;
+    if (read(type, entry) && type == JOURNAL_CHECKPOINT) {
+        if (!entry.body.empty())
+            apply_snapshot(model, &entry.body[0], entry.body.size());
+        seq = entry.seq;
+    }
+
+    // Replay forward to time
+    for (;;) {
+        size_t segment = segment_, offset = offset_;
+        if (!read(type, entry))
+            break;
+        if (entry.time >= time) {
+            if (segment != segment_)
+                map(segment);
+            offset_ = offset;
+            break;
+        }
+        if (type == JOURNAL_MIDI && !entry.body.empty()) {
+            model.update(&entry.body[0], entry.body.size());
+            seq = entry.seq;
+        }
+    }
+    model.snapshot(state);
+    return true;
+}
+
+bool JournalReader::next(JournalEntry &entry)
+{
+    unsigned char type;
+    while (read(type, entry))
+        if (type == JOURNAL_MIDI)
+            return true;
+    return false;
+}
+
+/*
+ * Feed
+ */
+
+JournalFeed::JournalFeed(const std::string &dir, const std::string &room, uint64_t time)
+    : ring_(JOURNAL_FEED_BYTES), status_(PENDING), running_(true), done_(false), seq_(0),
+      holding_(false)
+{
+    thread_ = std::thread(&JournalFeed::run, this, dir, room, time);
+}
+
+JournalFeed::~JournalFeed()
+{
+    stop();
+    thread_.join();
+}
+
+void JournalFeed::stop()
+{
+    running_ = false;
+    space_.signal();
+}
+
+const JournalEntry *JournalFeed::peek()
+{
+    if (holding_)
+        return &held_;
+    if (!ring_.pop(scratch_))
+        return NULL;
+    space_.notify();
+    Record r;
+    memcpy(&r, &scratch_[0], sizeof r);
+    held_.seq = r.seq;
+    held_.time = r.time;
+    held_.session = r.session;
+    held_.body.assign(scratch_.begin() + sizeof r, scratch_.end());
+    holding_ = true;
+    return &held_;
+}
+
+void JournalFeed::pop()
+{
+    holding_ = false;
+}
+
+bool JournalFeed::push(const JournalEntry &entry)
+{
+    Record r;
+    r.time = entry.time;
+    r.seq = entry.seq;
+    r.session = entry.session;
+    return ring_.push(&r, sizeof r, entry.body.data(), entry.body.size());
+}
+
+void JournalFeed::run(std::string dir, std::string room, uint64_t time)
+{
+    JournalReader reader;
+    if (!reader.open(dir, room) || !reader.seek(time, state_, seq_)) {
+        status_.store(FAILED, std::memory_order_release);
+        done_.store(true, std::memory_order_release);
+        return;
+    }
+    status_.store(READY, std::memory_order_release);
+
+    JournalEntry entry;
+    bool have = false;
+    while (running_) {
+        if (!have)
+            have = reader.next(entry);
+        if (have && push(entry)) {
+            have = false;
+            continue;
+        }
+        // Ring full: wait for the relay to take some. At the end of the
+        // journal: look again once the writer has had time to flush.
+        space_.arm();
+        if (!running_ || (have && push(entry))) {
+            space_.disarm();
+            have = false;
+            continue;
+        }
+        space_.wait(have ? -1 : JOURNAL_FLUSH_MS);
+    }
+    done_.store(true, std::memory_order_release);
+}
@@ -0,0 +1,261 @@
+/*
+ * journal.h
+ *
+ *  Append-only journal of everything published in each room, for replay
+ *  and catch-up. Every room gets a directory of fixed-size segment files
+ *  named by the wall time of their first record:
+ *
+ *    <dir>/<room>/<time>.seg   16 byte header ("MJNL", version), then records
+ *    <dir>/<room>/<time>.idx   one entry per checkpoint in the segment
+ *
+ *  A record is a 20 byte header followed by its body:
+ *
+ *    uint8  marker   JOURNAL_MARKER (a zero byte ends the segment)
+ *    uint8  type     JOURNAL_MIDI or JOURNAL_CHECKPOINT
+ *    uint16 length   body length
+ *    uint32 seq      room sequence number
+ *    uint64 time     wall clock microseconds
+ *    uint32 session  publisher's session, 0 for files and legacy clients
+ *
+ *  A checkpoint's body is a MidiState snapshot of the room as of its seq.
+ *  Checkpoints open every segment and follow every JOURNAL_CHECKPOINT_RECORDS
+ *  records or JOURNAL_CHECKPOINT_MS, so a reader can start anywhere by
+ *  loading the nearest earlier checkpoint and replaying forward. Index
+ *  entries (uint64 time, uint32 seq, uint32 offset) make finding that
+ *  checkpoint a search over a few small files. Room seqs restart when a
+ *  room is reopened; time is what orders the journal.
+ *
+ *  The relay thread only posts records into a lock-free ring. A writer
+ *  thread keeps its own state model for the checkpoints and writes in
+ *  large sequential chunks, flushed at least every JOURNAL_FLUSH_MS.
+ *  Appends that don't fit the ring are dropped and counted; opening and
+ *  closing a room's journal wait for room instead (see retry()).
+ */
+
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "event_notifier.h"
+#include "midi_state.h"
+#include "spsc_ring.h"
+
+#define JOURNAL_SEGMENT_BYTES (8 << 20)
+#define JOURNAL_HEADER_BYTES 16
+#define JOURNAL_RECORD_HEADER 20
+#define JOURNAL_INDEX_ENTRY 16
+#define JOURNAL_MARKER 0xA5
+#define JOURNAL_VERSION 2
+#define JOURNAL_CHECKPOINT_RECORDS 4096
+#define JOURNAL_CHECKPOINT_MS 10000
+#define JOURNAL_FLUSH_MS 250
+#define JOURNAL_WRITE_BYTES (256 << 10)     // buffered before a write()
+#define JOURNAL_RING_BYTES (1 << 20)
+#define JOURNAL_FEED_BYTES (256 << 10)  // records a JournalFeed reads ahead
+
+enum JournalRecordType {
+    JOURNAL_MIDI = 1,
+    JOURNAL_CHECKPOINT = 2
+};
+
+/* Directory a room's journal lives in */
+std::string journal_room_dir(const std::string &dir, const std::string &room);
+
+class Journal {
+public:
+    explicit Journal(const std::string &dir);
+    ~Journal();     // flushes everything
+
+    /* Relay thread API */
+    uint32_t open(const std::string &room, uint64_t time);
+    void append(uint32_t journal, uint32_t seq, uint64_t time, uint32_t session,
+                const unsigned char *msg, size_t n);
+    void close(uint32_t journal);
+
+    /* Relay thread: post open and close records that found the ring full */
+    void retry();
+
+    const std::string &dir() const { return dir_; }
+    unsigned long dropped() const { return dropped_; }
+
+private:
+    enum Op { OP_OPEN, OP_APPEND, OP_CLOSE };
+
+    struct Record {
+        uint64_t time;
+        uint32_t journal;
+        uint32_t seq;
+        uint32_t session;
+        unsigned char op;
+    };
+
+    struct RoomJournal {
+        std::string dir;
+        int fd;                     // current segment, -1 until the first record
+        int indexFd;
+        uint64_t written;           // segment bytes already written
+        uint64_t offset;            // segment bytes written or buffered
+        std::vector<unsigned char> buffer;
+        std::vector<unsigned char> index;   // entries waiting for their data
+        MidiState state;
+        uint32_t seq;               // last seq applied to state
+        uint64_t time;              // and its time
+        unsigned int sinceCheckpoint;
+        uint64_t lastCheckpoint;
+    };
+
+    void post(const Record &r, const void *payload, size_t n);
+    void run();
+    void apply(const std::vector<unsigned char> &record);
+    void write(RoomJournal &j, uint32_t seq, uint64_t time, uint32_t session,
+               const unsigned char *msg, size_t n);
+    void append(RoomJournal &j, unsigned char type, uint32_t seq, uint64_t time, uint32_t session,
+                const unsigned char *body, size_t n);
+    bool startSegment(RoomJournal &j, uint64_t time);
+    void checkpoint(RoomJournal &j);
+    void flush(RoomJournal &j);
+    void finish(RoomJournal &j);
+
+    std::string dir_;
+    uint32_t nextId_;               // relay thread only
+    std::deque<std::vector<unsigned char> > backlog_;  // relay thread only
+
+    SpscRing ring_;
+    EventNotifier notify_;
+    std::atomic<bool> running_;
+    std::atomic<unsigned long> dropped_;
+    std::thread thread_;
+
+    std::map<uint32_t, RoomJournal> rooms_;     // writer thread only
+    std::vector<unsigned char> snapshot_;   // writer thread only
+};
+
+struct JournalEntry {
+    uint32_t seq;
+    uint64_t time;
+    uint32_t session;                   // publisher's session, 0 if none
+    std::vector<unsigned char> body;    // one MIDI message
+};
+
+/*
+ * Reads one room's journal. Segments are mapped, not read, so seeking
+ * costs a binary search of the index plus replay from one checkpoint.
+ * The reader follows a journal that is still being written: next()
+ * returns false at the current end and picks up new data on later calls.
+ */
+class JournalReader {
+public:
+    JournalReader()
+        : indexSegment_(0), indexBytes_(0), dirTime_(0), listedAt_(0), segment_(0), offset_(0),
+          map_(NULL), mapSize_(0) {}
+    ~JournalReader() { unmap(); }
+
+    /* Open the journal of a room. False if there is none. */
+    bool open(const std::string &dir, const std::string &room);
+
+    /*
+     * Position the reader at time. state receives a snapshot recreating
+     * the room as of the last record before time (empty if there was
+     * none) and seq that record's seq; next() continues from there.
+     */
+    bool seek(uint64_t time, std::vector<unsigned char> &state, uint32_t &seq);
+
+    /* Next MIDI record, false at the end of what has been written */
+    bool next(JournalEntry &entry);
+
+private:
+    struct IndexEntry {
+        uint64_t time;
+        uint32_t seq;
+        uint32_t offset;
+        size_t segment;
+
+        static bool before(const IndexEntry &e, uint64_t time) { return e.time < time; }
+    };
+
+    void scanSegments();
+    void scan();
+    bool map(size_t segment);
+    void unmap();
+    bool read(unsigned char &type, JournalEntry &entry);
+
+    std::string roomDir_;
+    std::vector<std::string> segments_;     // oldest first
+    std::vector<IndexEntry> index_;         // ordered by time
+    size_t indexSegment_;       // segment whose index was read last
+    size_t indexBytes_;         // how much of it
+    uint64_t dirTime_;          // mtime of the room directory at the last listing (us)
+    uint64_t listedAt_;         // wall time of that listing (us)
+    size_t segment_;
+    size_t offset_;
+    const unsigned char *map_;
+    size_t mapSize_;
+
+    JournalReader(const JournalReader &);
+    JournalReader &operator=(const JournalReader &);
+};
+
+/*
+ * A JournalReader on a thread of its own for one catching-up client, so
+ * listing the journal, loading the index, mapping segments and replaying
+ * from a checkpoint never hold up the relay thread. The reader seeks,
+ * then keeps following the journal into a ring until the feed is
+ * stopped; the relay thread polls status() and takes records with
+ * peek() and pop().
+ */
+class JournalFeed {
+public:
+    enum Status { PENDING, READY, FAILED };
+
+    JournalFeed(const std::string &dir, const std::string &room, uint64_t time);
+    ~JournalFeed();     // stops and joins the reader thread
+
+    /* Relay thread API */
+    Status status() const { return (Status)status_.load(std::memory_order_acquire); }
+
+    /* Once READY: what JournalReader::seek() returned */
+    std::vector<unsigned char> &state() { return state_; }
+    uint32_t seq() const { return seq_; }
+
+    /* Next record, NULL if the reader has not got any further yet */
+    const JournalEntry *peek();
+    void pop();
+
+    /* Ask the reader thread to finish; stopped() once it has */
+    void stop();
+    bool stopped() const { return done_.load(std::memory_order_acquire); }
+
+private:
+    struct Record {
+        uint64_t time;
+        uint32_t seq;
+        uint32_t session;
+    };
+
+    bool push(const JournalEntry &entry);
+    void run(std::string dir, std::string room, uint64_t time);
+
+    SpscRing ring_;
+    EventNotifier space_;               // relay -> reader: ring drained or stop
+    std::atomic<int> status_;
+    std::atomic<bool> running_;
+    std::atomic<bool> done_;
+    std::vector<unsigned char> state_;  // written by the reader before READY
+    uint32_t seq_;
+    JournalEntry held_;                 // relay thread only
+    bool holding_;
+    std::vector<unsigned char> scratch_;
+    std::thread thread_;
+
+    JournalFeed(const JournalFeed &);
+    JournalFeed &operator=(const JournalFeed &);
+};
+
+#endif /* JOURNAL_H_ */
@@ -0,0 +1,105 @@
+//*****************************************//
+//  player.cpp
+//
+//  Standard MIDI File playback scheduling.
+//
+//*****************************************//
+
+#include "midi_util.h"
+#include "player.h"
+
+uint64_t Player::wallTime(uint64_t position) const
+{
+    if (position <= anchorPos_)
+        return anchorWall_;
+    return anchorWall_ + (uint64_t)((position - anchorPos_) / scale_);
+}
+
+uint64_t Player::position(uint64_t now) const
+{
+    if (now <= anchorWall_)
+        return anchorPos_;
+    return anchorPos_ + (uint64_t)((now - anchorWall_) * scale_);
+}
+
+/*
+ * Continue from position at wall time wall, silencing what was sounding
+ * and setting each channel up the way the file had it by then.
+ */
+void Player::jump(uint64_t position, uint64_t wall)
+{
+    releases_.erase(releases_.begin(), releases_.begin() + releaseAt_);
+    releaseAt_ = 0;
+    notes_.release(releases_);
+    cursor_ = file_.find(position);
+    anchorPos_ = position;
+    anchorWall_ = wall;
+
+    state_.reset();
+    std::vector<unsigned char> message;
+    for (size_t i = 0; i < cursor_; i++) {
+        file_.message(i, message);
+        state_.update(&message[0], message.size());
+    }
+    state_.settings(releases_);
+}
+
+void Player::seek(uint64_t position, uint64_t now)
+{
+    jump(position, now);
+}
+
+void Player::setTempoScale(double scale, uint64_t now)
+{
+    if (scale <= 0)
+        return;
+    // Re-anchor so the change applies from here on
+    anchorPos_ = position(now);
+    anchorWall_ = now;
+    scale_ = scale;
+}
+
+uint64_t Player::nextDue() const
+{
+    if (releaseAt_ < releases_.size())
+        return anchorWall_ ? anchorWall_ : 1;
+    const std::vector<SmfEvent> &events = file_.events();
+    if (cursor_ < events.size())
+        return wallTime(events[cursor_].time);
+    if (loop_ && file_.duration() > 0)
+        return wallTime(file_.duration());
+    return 0;
+}
+
+bool Player::next(uint64_t now, std::vector<unsigned char> &message, uint64_t &due)
+{
+    if (releaseAt_ < releases_.size()) {
+        size_t n = midi_channel_message_size(releases_[releaseAt_]);
+        message.assign(releases_.begin() + releaseAt_, releases_.begin() + releaseAt_ + n);
+        releaseAt_ += n;
+        if (releaseAt_ == releases_.size()) {
+            releases_.clear();
+            releaseAt_ = 0;
+        }
+        due = now;
+        return true;
+    }
+
+    const std::vector<SmfEvent> &events = file_.events();
+    if (cursor_ == events.size()) {
+        if (!loop_ || file_.duration() == 0)
+            return false;
+        uint64_t end = wallTime(file_.duration());
+        if (end > now)
+            return false;
+        jump(0, end);
+        return next(now, message, due);
+    }
+
+    due = wallTime(events[cursor_].time);
+    if (due > now)
+        return false;
+    file_.message(cursor_++, message);
+    notes_.update(&message[0], message.size());
+    return true;
+}
@@ -0,0 +1,70 @@
+/*
+ * player.h
+ *
+ *  Schedules the events of a Standard MIDI File against the relay's
+ *  clock, with seek, looping and tempo scaling. Every event carries the
+ *  exact wall time it was due, so it is stamped precisely even when the
+ *  poll loop wakes a little late. Jumps (seek, loop wrap) first release
+ *  whatever the file left sounding, then restore the program, bank,
+ *  controllers and bend in effect at the new position.
+ */
+
+#ifndef PLAYER_H_
+#define PLAYER_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "midi_state.h"
+#include "note_tracker.h"
+#include "smf_file.h"
+
+struct PlaybackConfig {
+    std::string path;
+    std::string room;
+    bool loop;
+    double tempoScale;      // 2.0 plays twice as fast
+
+    PlaybackConfig() : loop(false), tempoScale(1.0) {}
+};
+
+class Player {
+public:
+    Player() : cursor_(0), anchorWall_(0), anchorPos_(0), scale_(1.0), loop_(false), releaseAt_(0) {}
+
+    bool open(const std::string &path) { return file_.open(path); }
+
+    /* Start (or restart) playing from position (microseconds into the file) */
+    void seek(uint64_t position, uint64_t now);
+    void setLoop(bool loop) { loop_ = loop; }
+    void setTempoScale(double scale, uint64_t now);
+
+    /* Position in the file at wall time now */
+    uint64_t position(uint64_t now) const;
+
+    /* Wall time the next event is due, 0 once finished */
+    uint64_t nextDue() const;
+
+    /* Pop the next event due by now along with the wall time it was due */
+    bool next(uint64_t now, std::vector<unsigned char> &message, uint64_t &due);
+
+    bool finished() const { return nextDue() == 0; }
+
+private:
+    uint64_t wallTime(uint64_t position) const;
+    void jump(uint64_t position, uint64_t wall);
+
+    SmfFile file_;
+    size_t cursor_;             // next event in the index
+    uint64_t anchorWall_;       // wall time at which...
+    uint64_t anchorPos_;        // ...playback was at this file position
+    double scale_;
+    bool loop_;
+
+    NoteTracker notes_;
+    MidiState state_;           // scratch for restoring the state at a jump target
+    std::vector<unsigned char> releases_;   // pending after a jump: note offs, then settings
+    size_t releaseAt_;
+};
+
+#endif /* PLAYER_H_ */
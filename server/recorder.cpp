@@ -0,0 +1,342 @@
+//*****************************************//
+//  recorder.cpp
+//
+//  Background Standard MIDI File writer
+//  for relayed rooms.
+//
+//*****************************************//
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "midi_util.h"
+#include "smf.h"
+#include "recorder.h"
+
+#define COPY_CHUNK (1 << 20)
+
+Recorder::Recorder(const std::string &dir)
+    : dir_(dir), nextId_(1), ring_(RECORDER_RING_BYTES), running_(true), dropped_(0)
+{
+    thread_ = std::thread(&Recorder::run, this);
+}
+
+Recorder::~Recorder()
+{
+    // The writer is still running, so the backlog drains
+    for (retry(); !backlog_.empty(); retry())
+        usleep(1000);
+    running_ = false;
+    notify_.signal();
+    thread_.join();
+    if (dropped_)
+        fprintf(stderr, "recorder: %lu records dropped\n", (unsigned long)dropped_);
+}
+
+/*
+ * Relay thread side
+ */
+
+/*
+ * Events behind a waiting control record would reach the writer before
+ * the recording or track they belong to, so they are dropped until the
+ * backlog has gone through.
+ */
+void Recorder::post(const Record &r, const void *payload, size_t n)
+{
+    retry();
+    if (backlog_.empty() && ring_.push(&r, sizeof r, payload, n)) {
+        notify_.notify();
+        return;
+    }
+    if (r.op == OP_EVENT) {
+        dropped_++;
+        return;
+    }
+    const unsigned char *p = (const unsigned char *)payload;
+    std::vector<unsigned char> record((const unsigned char *)&r, (const unsigned char *)(&r + 1));
+    record.insert(record.end(), p, p + n);
+    backlog_.push_back(record);
+}
+
+void Recorder::retry()
+{
+    if (backlog_.empty())
+        return;
+    while (!backlog_.empty() && ring_.push(&backlog_.front()[0], backlog_.front().size()))
+        backlog_.pop_front();
+    notify_.notify();
+}
+
+uint32_t Recorder::open(const std::string &room)
+{
+    Record r;
+    r.op = OP_OPEN;
+    r.recording = nextId_++;
+    r.track = 0;
+    r.time = monotonic_us();
+    post(r, room.data(), room.size());
+    return r.recording;
+}
+
+void Recorder::track(uint32_t recording, unsigned int track, const std::string &name)
+{
+    Record r;
+    r.op = OP_TRACK;
+    r.recording = recording;
+    r.track = (uint16_t)track;
+    r.time = 0;
+    post(r, name.data(), name.size());
+}
+
+void Recorder::event(uint32_t recording, unsigned int track, uint64_t time,
+                     const unsigned char *msg, size_t n)
+{
+    // SMF tracks hold channel messages and SysEx, nothing else
+    if (n == 0 || (!midi_is_channel_message(msg[0]) && msg[0] != 0xF0))
+        return;
+    Record r;
+    r.op = OP_EVENT;
+    r.recording = recording;
+    r.track = (uint16_t)track;
+    r.time = time;
+    post(r, msg, n);
+}
+
+void Recorder::close(uint32_t recording)
+{
+    Record r;
+    r.op = OP_CLOSE;
+    r.recording = recording;
+    r.track = 0;
+    r.time = 0;
+    post(r, NULL, 0);
+}
+
+/*
+ * Writer thread side
+ */
+
+void Recorder::run()
+{
+    std::vector<unsigned char> record;
+    for (;;) {
+        while (ring_.pop(record))
+            apply(record);
+        if (!running_)
+            break;
+        notify_.arm();
+        if (!ring_.empty() || !running_) {
+            notify_.disarm();
+            continue;
+        }
+        notify_.wait(-1);
+    }
+    std::map<uint32_t, Recording>::iterator it;
+    for (it = recordings_.begin(); it != recordings_.end(); ++it)
+        finish(it->second);
+    recordings_.clear();
+}
+
+// Room names become part of a file name; keep them to a safe alphabet
+static std::string file_name(const std::string &room)
+{
+    std::string name;
+    for (size_t i = 0; i < room.size(); i++) {
+        char c = room[i];
+        bool safe = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                    (c >= '0' && c <= '9') || c == '-' || c == '_';
+        name += safe ? c : '_';
+    }
+    return name;
+}
+
+void Recorder::apply(const std::vector<unsigned char> &record)
+{
+    Record r;
+    memcpy(&r, &record[0], sizeof r);
+    const unsigned char *payload = &record[0] + sizeof r;
+    size_t n = record.size() - sizeof r;
+
+    if (r.op == OP_OPEN) {
+        Recording &rec = recordings_[r.recording];
+        rec.room.assign((const char *)payload, n);
+        rec.start = 0;
+        rec.started = false;
+
+        char stamp[32];
+        time_t now = time(NULL);
+        strftime(stamp, sizeof stamp, "%Y%m%d-%H%M%S", localtime(&now));
+        std::string base = dir_ + "/" + file_name(rec.room) + "-" + stamp;
+        rec.path = base + ".mid";
+        for (int i = 2; access(rec.path.c_str(), F_OK) == 0; i++) {
+            char suffix[16];
+            snprintf(suffix, sizeof suffix, "-%d.mid", i);
+            rec.path = base + suffix;
+        }
+        printf("recorder: recording room '%s' to %s\n", rec.room.c_str(), rec.path.c_str());
+        return;
+    }
+
+    std::map<uint32_t, Recording>::iterator it = recordings_.find(r.recording);
+    if (it == recordings_.end())
+        return;
+    Recording &rec = it->second;
+
+    switch (r.op) {
+    case OP_TRACK:
+        if (Track *t = trackFor(rec, r.track))
+            t->name.assign((const char *)payload, n);
+        break;
+    case OP_EVENT:
+        write(rec, r.track, r.time, payload, n);
+        break;
+    case OP_CLOSE:
+        finish(rec);
+        recordings_.erase(it);
+        break;
+    }
+}
+
+// Track number n of a recording, creating its spool file on first use
+Recorder::Track *Recorder::trackFor(Recording &rec, unsigned int track)
+{
+    while (rec.tracks.size() <= track) {
+        Track t;
+        char suffix[32];
+        snprintf(suffix, sizeof suffix, ".track%u", (unsigned)rec.tracks.size());
+        t.spoolPath = rec.path + suffix;
+        t.spool = fopen(t.spoolPath.c_str(), "w+b");
+        if (!t.spool)
+            perror(("recorder: " + t.spoolPath).c_str());
+        else
+            setvbuf(t.spool, NULL, _IOFBF, RECORDER_BUFFER_BYTES);
+        t.bytes = 0;
+        t.lastTick = 0;
+        t.failed = false;
+        rec.tracks.push_back(t);
+    }
+    return &rec.tracks[track];
+}
+
+void Recorder::write(Recording &rec, unsigned int track, uint64_t time,
+                     const unsigned char *msg, size_t n)
+{
+    Track *t = trackFor(rec, track);
+    if (!t->spool || t->failed)
+        return;
+    if (!rec.started) {
+        rec.start = time;
+        rec.started = true;
+    }
+    uint64_t tick = time > rec.start ? (time - rec.start) / SMF_TICK_US : 0;
+    if (tick < t->lastTick)
+        tick = t->lastTick;
+
+    scratch_.clear();
+    smf_put_vlq(scratch_, (uint32_t)(tick - t->lastTick));
+    if (msg[0] == 0xF0) {
+        // SysEx: F0, length of the rest, the rest (ending in F7)
+        scratch_.push_back(0xF0);
+        smf_put_vlq(scratch_, (uint32_t)(n - 1));
+        scratch_.insert(scratch_.end(), msg + 1, msg + n);
+    } else {
+        scratch_.insert(scratch_.end(), msg, msg + n);
+    }
+    if (fwrite(&scratch_[0], 1, scratch_.size(), t->spool) != scratch_.size()) {
+        // Part of this event may be in the spool: the track ends before it
+        perror(("recorder: " + t->spoolPath).c_str());
+        t->failed = true;
+        return;
+    }
+    t->lastTick = tick;
+    t->bytes += (uint32_t)scratch_.size();
+}
+
+/*
+ * Bytes of t's spool to copy into the .mid. Buffered data that could not
+ * be written back would leave a hole, so then the track loses its events.
+ */
+static uint32_t spooled(const std::string &path, FILE *spool, uint32_t bytes)
+{
+    long size = -1;
+    if (fflush(spool) == 0 && fseek(spool, 0, SEEK_END) == 0)
+        size = ftell(spool);
+    rewind(spool);
+    if (size < (long)bytes) {
+        fprintf(stderr, "recorder: %s: spool incomplete, track left empty\n", path.c_str());
+        return 0;
+    }
+    return bytes;
+}
+
+static void put_chunk_header(std::vector<unsigned char> &out, const char *id, uint32_t length)
+{
+    out.insert(out.end(), id, id + 4);
+    smf_put32(out, length);
+}
+
+static const unsigned char END_OF_TRACK[] = { 0x00, SMF_META, SMF_META_END_OF_TRACK, 0x00 };
+
+// Assemble the .mid from the spooled tracks and remove the spool files
+void Recorder::finish(Recording &rec)
+{
+    FILE *out = fopen(rec.path.c_str(), "wb");
+    if (!out)
+        perror(("recorder: " + rec.path).c_str());
+    else
+        setvbuf(out, NULL, _IOFBF, COPY_CHUNK);
+
+    std::vector<unsigned char> head;
+    put_chunk_header(head, "MThd", 6);
+    size_t tracks = rec.tracks.size() + 1;
+    head.push_back(0);
+    head.push_back(1);                      // format 1
+    head.push_back((tracks >> 8) & 0xFF);
+    head.push_back(tracks & 0xFF);
+    head.push_back((SMF_DIVISION >> 8) & 0xFF);
+    head.push_back(SMF_DIVISION & 0xFF);
+
+    // Conductor track: tempo and the room name
+    std::vector<unsigned char> conductor;
+    unsigned char tempo[3] = { (SMF_TEMPO_US >> 16) & 0xFF, (SMF_TEMPO_US >> 8) & 0xFF, SMF_TEMPO_US & 0xFF };
+    smf_put_meta(conductor, 0, SMF_META_TEMPO, tempo, sizeof tempo);
+    smf_put_meta(conductor, 0, SMF_META_TRACK_NAME, rec.room.data(), rec.room.size());
+    conductor.insert(conductor.end(), END_OF_TRACK, END_OF_TRACK + sizeof END_OF_TRACK);
+    put_chunk_header(head, "MTrk", (uint32_t)conductor.size());
+    head.insert(head.end(), conductor.begin(), conductor.end());
+    if (out)
+        fwrite(&head[0], 1, head.size(), out);
+
+    std::vector<unsigned char> chunk(COPY_CHUNK);
+    for (size_t i = 0; i < rec.tracks.size(); i++) {
+        Track &t = rec.tracks[i];
+        if (out) {
+            std::vector<unsigned char> name;
+            smf_put_meta(name, 0, SMF_META_TRACK_NAME, t.name.data(), t.name.size());
+            uint32_t bytes = t.spool ? spooled(t.spoolPath, t.spool, t.bytes) : 0;
+            uint32_t body = (uint32_t)name.size() + bytes + sizeof END_OF_TRACK;
+            head.clear();
+            put_chunk_header(head, "MTrk", body);
+            head.insert(head.end(), name.begin(), name.end());
+            fwrite(&head[0], 1, head.size(), out);
+            if (bytes) {
+                size_t left = bytes, n;
+                while (left && (n = fread(&chunk[0], 1, left < chunk.size() ? left : chunk.size(), t.spool)) > 0) {
+                    fwrite(&chunk[0], 1, n, out);
+                    left -= n;
+                }
+            }
+            fwrite(END_OF_TRACK, 1, sizeof END_OF_TRACK, out);
+        }
+        if (t.spool) {
+            fclose(t.spool);
+            unlink(t.spoolPath.c_str());
+        }
+    }
+    if (out) {
+        fclose(out);
+        printf("recorder: wrote %s (%u tracks)\n", rec.path.c_str(), (unsigned)tracks);
+    }
+}
@@ -0,0 +1,97 @@
+/*
+ * recorder.h
+ *
+ *  Records relayed rooms to Standard MIDI Files (type 1): a conductor
+ *  track naming the room, then one track per publisher. The relay thread
+ *  only copies small records into a lock-free ring; a writer thread
+ *  spools each track to a temporary file with large buffered writes and
+ *  assembles the .mid when the recording is closed, so recording never
+ *  blocks fan-out. Events that don't fit the ring are dropped and
+ *  counted; opening, naming and closing are never dropped but wait on the
+ *  relay thread until retry() finds room for them. A track whose spool
+ *  file fails to write is cut off at its last complete event.
+ */
+
+#ifndef RECORDER_H_
+#define RECORDER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "event_notifier.h"
+#include "spsc_ring.h"
+
+#define RECORDER_RING_BYTES (1 << 20)
+#define RECORDER_BUFFER_BYTES (1 << 16)     // stdio buffer per spool file
+
+class Recorder {
+public:
+    explicit Recorder(const std::string &dir);
+    ~Recorder();    // finishes every open recording
+
+    /* Relay thread API. Returns the id later calls refer to. */
+    uint32_t open(const std::string &room);
+    void track(uint32_t recording, unsigned int track, const std::string &name);
+    void event(uint32_t recording, unsigned int track, uint64_t time,
+               const unsigned char *msg, size_t n);
+    void close(uint32_t recording);
+
+    /* Relay thread: post control records that found the ring full earlier */
+    void retry();
+
+    unsigned long dropped() const { return dropped_; }
+
+private:
+    enum Op { OP_OPEN, OP_TRACK, OP_EVENT, OP_CLOSE };
+
+    struct Record {
+        uint64_t time;
+        uint32_t recording;
+        uint16_t track;
+        unsigned char op;
+    };
+
+    struct Track {
+        std::string name;
+        std::string spoolPath;
+        FILE *spool;
+        uint32_t bytes;         // complete events written to the spool so far
+        uint64_t lastTick;
+        bool failed;            // a write failed: nothing more goes to the spool
+    };
+
+    struct Recording {
+        std::string room;
+        std::string path;
+        uint64_t start;         // time of the first event
+        bool started;
+        std::vector<Track> tracks;
+    };
+
+    void post(const Record &r, const void *payload, size_t n);
+    void run();
+    void apply(const std::vector<unsigned char> &record);
+    Track *trackFor(Recording &rec, unsigned int track);
+    void write(Recording &rec, unsigned int track, uint64_t time, const unsigned char *msg, size_t n);
+    void finish(Recording &rec);
+
+    std::string dir_;
+    uint32_t nextId_;           // relay thread only
+    std::deque<std::vector<unsigned char> > backlog_;  // relay thread only
+
+    SpscRing ring_;
+    EventNotifier notify_;
+    std::atomic<bool> running_;
+    std::atomic<unsigned long> dropped_;
+    std::thread thread_;
+
+    std::map<uint32_t, Recording> recordings_;  // writer thread only
+    std::vector<unsigned char> scratch_;        // writer thread only
+};
+
+#endif /* RECORDER_H_ */
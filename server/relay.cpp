@@ -0,0 +1,939 @@
+//*****************************************//
+//  relay.cpp
+//
+//  poll() event loop that fans MIDI frames
+//  out from each client to all the others.
+//
+//*****************************************//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "midi_util.h"
+#include "relay.h"
+
+#define POLL_INTERVAL_MS 100    // housekeeping period (lag checks)
+#define SESSION_LINGER_MS 30000 // how long a dropped session can be resumed
+#define RECV_CHUNK 4096
+#define MAX_REWIND_MS 3600000   // catch-up requests reach back at most an hour
+#define CATCHUP_RETRY_MS 10     // poll interval while waiting for the journal reader
+#define CATCHUP_SPLICE_MS 2000  // how long to wait for the journal to catch up
+#define CATCHUP_SPEEDUP 4       // replay runs at most this many times real time
+#define SYSEX_RETRY_MS 5        // poll interval while SysEx waits for the socket to drain
+
+// get sockaddr, IPv4 or IPv6:
+static void *get_in_addr(struct sockaddr *sa)
+{
+    if (sa->sa_family == AF_INET) {
+        return &(((struct sockaddr_in*)sa)->sin_addr);
+    }
+
+    return &(((struct sockaddr_in6*)sa)->sin6_addr);
+}
+
+Relay::Relay(int listenfd, const RelayConfig &config)
+    : listenfd_(listenfd), config_(config), recorder_(NULL), journal_(NULL), nextTransfer_(1),
+      lastExpire_(0)
+{
+    if (!config_.recordDir.empty())
+        recorder_ = new Recorder(config_.recordDir);
+    if (!config_.journalDir.empty())
+        journal_ = new Journal(config_.journalDir);
+    for (size_t i = 0; i < config_.playback.size(); i++)
+        startPlayback(config_.playback[i]);
+}
+
+Relay::~Relay()
+{
+    for (size_t i = 0; i < clients_.size(); i++) {
+        close(clients_[i]->fd);
+        delete clients_[i];
+    }
+    for (size_t i = 0; i < players_.size(); i++)
+        delete players_[i];
+    std::map<std::string, Room *>::iterator it;
+    for (it = rooms_.begin(); it != rooms_.end(); ++it) {
+        if (recorder_)
+            recorder_->close(it->second->recording);
+        if (journal_)
+            journal_->close(it->second->journal);
+        delete it->second;
+    }
+    for (size_t i = 0; i < retired_.size(); i++)
+        delete retired_[i];
+    delete recorder_;
+    delete journal_;
+}
+
+void Relay::run(volatile bool &done)
+{
+    std::vector<struct pollfd> fds;
+
+    while (!done) {
+        fds.resize(clients_.size() + 1);
+        fds[0].fd = listenfd_;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        for (size_t i = 0; i < clients_.size(); i++) {
+            fds[i + 1].fd = clients_[i]->fd;
+            fds[i + 1].events = POLLIN;
+            if (clients_[i]->queue.writable())
+                fds[i + 1].events |= POLLOUT;
+            fds[i + 1].revents = 0;
+        }
+
+        if (poll(&fds[0], fds.size(), pollTimeout(monotonic_us())) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        // Only the clients that were polled; accepted ones join next round
+        size_t polled = fds.size() - 1;
+        for (size_t i = 0; i < polled; i++) {
+            if (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))
+                readClient(clients_[i]);
+        }
+        if (fds[0].revents & POLLIN)
+            acceptClient();
+
+        // Push out whatever the reads and players produced, then check for laggards
+        uint64_t now = monotonic_us();
+        play(now);
+        catchUp(now);
+        flushCoalescers(now);
+        expire(now);
+        for (size_t i = 0; i < clients_.size(); i++) {
+            RelayClient *c = clients_[i];
+            if (c->closing || c->queue.empty())
+                continue;
+            if (!c->queue.flush(c->fd))
+                closeClient(c, "send failed");
+            else if (!c->queue.healthy(now))
+                closeClient(c, "lagging");
+        }
+        sweep();
+    }
+}
+
+// Sleep until the next housekeeping tick or coalesced value, whichever is first
+int Relay::pollTimeout(uint64_t now) const
+{
+    uint64_t due = now + POLL_INTERVAL_MS * 1000;
+    for (size_t i = 0; i < clients_.size(); i++) {
+        if (!clients_[i]->coalescer)
+            continue;
+        uint64_t next = clients_[i]->coalescer->nextDue();
+        if (next && next < due)
+            due = next;
+    }
+    for (size_t i = 0; i < players_.size(); i++) {
+        uint64_t next = players_[i]->player.nextDue();
+        if (next && next < due)
+            due = next;
+    }
+    for (size_t i = 0; i < clients_.size(); i++) {
+        const RelayClient *c = clients_[i];
+        if (c->catchup && c->queue.size() < config_.queue.maxFrames / 2 &&
+                now + CATCHUP_RETRY_MS * 1000 < due)
+            due = now + CATCHUP_RETRY_MS * 1000;
+        if (c->queue.throttled() && now + SYSEX_RETRY_MS * 1000 < due)
+            due = now + SYSEX_RETRY_MS * 1000;
+    }
+    return due <= now ? 0 : (int)((due - now + 999) / 1000);
+}
+
+// Queue controller values whose coalescing window has closed
+void Relay::flushCoalescers(uint64_t now)
+{
+    std::vector<CoalescedMessage> due;
+    for (size_t i = 0; i < clients_.size(); i++) {
+        RelayClient *c = clients_[i];
+        if (!c->coalescer || c->closing)
+            continue;
+        due.clear();
+        c->coalescer->flush(now, due);
+        for (size_t j = 0; j < due.size(); j++) {
+            WireFrame frame;
+            frame.type = FRAME_MIDI;
+            frame.seq = due[j].tag;
+            frame.time = (uint32_t)now;
+            frame.body.assign(due[j].bytes, due[j].bytes + 3);
+            if (!c->queue.push(frame, now)) {
+                closeClient(c, "send queue overflow");
+                break;
+            }
+        }
+    }
+}
+
+void Relay::acceptClient()
+{
+    struct sockaddr_storage their_addr; // connector's address information
+    socklen_t sin_size = sizeof their_addr;
+    char s[INET6_ADDRSTRLEN];
+
+    int fd = accept(listenfd_, (struct sockaddr *)&their_addr, &sin_size);
+    if (fd == -1) {
+        perror("accept");
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    inet_ntop(their_addr.ss_family,
+        get_in_addr((struct sockaddr *)&their_addr),
+        s, sizeof s);
+    printf("server: got connection from %s\n", s);
+
+    RelayClient *client = new RelayClient(fd, s, config_);
+    client->lastHeard = monotonic_us();
+    clients_.push_back(client);
+}
+
+void Relay::readClient(RelayClient *client)
+{
+    unsigned char buf[RECV_CHUNK];
+    while (!client->closing) {
+        ssize_t numbytes = recv(client->fd, buf, sizeof buf, 0);
+        if (numbytes == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                closeClient(client, "recv failed");
+            break;
+        }
+        if (numbytes == 0) {
+            closeClient(client, "disconnected");
+            break;
+        }
+        client->reader.feed(buf, numbytes);
+        client->lastHeard = monotonic_us();
+
+        WireFrame frame;
+        while (!client->closing && client->reader.next(frame))
+            handleFrame(client, frame);
+    }
+}
+
+void Relay::handleFrame(RelayClient *client, WireFrame &frame)
+{
+    switch (frame.type) {
+    case FRAME_MIDI:
+        if (frame.body.empty())
+            break;
+        // Sequenced clients resend after a resume; skip what we already have
+        if (frame.seq != 0) {
+            if (frame.seq <= client->clientSeq)
+                break;
+            client->clientSeq = frame.seq;
+        }
+        if (!client->room)
+            join(client, DEFAULT_ROOM);
+        client->notes.update(&frame.body[0], frame.body.size());
+        publish(client, frame);
+        break;
+    case FRAME_SYSEX:
+    case FRAME_CLOCK:
+        if (frame.body.size() < (frame.type == FRAME_SYSEX ? 4u : 8u)) {
+            closeClient(client, "protocol error");
+            break;
+        }
+        if (frame.seq != 0) {
+            if (frame.seq <= client->clientSeq)
+                break;
+            client->clientSeq = frame.seq;
+        }
+        if (!client->room)
+            join(client, DEFAULT_ROOM);
+        if (frame.type == FRAME_SYSEX) {
+            relaySysex(client, frame);
+        } else {
+            frame.seq = 0;
+            forward(client, frame, CAP_CLOCK);
+            if (frame.body.size() > 8) {
+                // A transport message: peers that don't regenerate the clock play it as is
+                WireFrame message;
+                message.type = FRAME_MIDI;
+                message.time = frame.time;
+                message.body.assign(frame.body.begin() + 8, frame.body.end());
+                forward(client, message, CAP_CLOCK, false);
+            }
+        }
+        break;
+    case FRAME_HELLO:
+        hello(client, frame);
+        break;
+    case FRAME_PING:
+        frame.type = FRAME_PONG;
+        frame.body.clear();
+        send(client, frame);
+        break;
+    case FRAME_PONG:
+        break;
+    case FRAME_REWIND:
+        if (frame.body.size() != 4) {
+            closeClient(client, "protocol error");
+            break;
+        }
+        client->rewindMs = wire_get32(&frame.body[0]);
+        if (client->rewindMs > MAX_REWIND_MS)
+            client->rewindMs = MAX_REWIND_MS;
+        // Already in a room: catch up there now, otherwise on joining
+        if (client->room && !client->catchup)
+            startCatchup(client);
+        break;
+    case FRAME_JOIN:
+        if (frame.body.empty() || frame.body.size() > MAX_ROOM_NAME) {
+            closeClient(client, "bad room name");
+            break;
+        }
+        join(client, std::string(frame.body.begin(), frame.body.end()));
+        break;
+    default:
+        closeClient(client, "protocol error");
+        break;
+    }
+}
+
+// Open a file and stream it into its room, starting now
+void Relay::startPlayback(const PlaybackConfig &config)
+{
+    FilePublisher *p = new FilePublisher(config.path);
+    if (!p->player.open(config.path)) {
+        delete p;
+        return;
+    }
+    std::string name = config.room.empty() ? DEFAULT_ROOM : config.room;
+    p->room = openRoom(name);
+    p->room->players++;
+    p->player.setLoop(config.loop);
+    p->player.setTempoScale(config.tempoScale, monotonic_us());
+    p->player.seek(0, monotonic_us());
+    players_.push_back(p);
+    printf("server: playing %s into room '%s'\n", config.path.c_str(), name.c_str());
+}
+
+// Publish every file event that has come due, retiring finished players
+void Relay::play(uint64_t now)
+{
+    size_t kept = 0;
+    WireFrame frame;
+    frame.type = FRAME_MIDI;
+    for (size_t i = 0; i < players_.size(); i++) {
+        FilePublisher *p = players_[i];
+        uint64_t due;
+        while (p->player.next(now, frame.body, due)) {
+            // Stamped with when it was due, not when the loop got to it
+            frame.time = (uint32_t)due;
+            if (frame.body[0] == 0xF0 && frame.body.size() > WIRE_SYSEX_CHUNK) {
+                // Too big for one frame: chunked, like a client's dump
+                playSysex(p, frame);
+                continue;
+            }
+            p->notes.update(&frame.body[0], frame.body.size());
+            publish(p, frame);
+        }
+        if (!p->player.finished()) {
+            players_[kept++] = p;
+            continue;
+        }
+        printf("server: finished playing %s\n", p->addr.c_str());
+        releaseNotes(p);
+        Room *room = p->room;
+        room->players--;
+        delete p;
+        closeRoomIfUnused(room);
+    }
+    players_.resize(kept);
+}
+
+// Stamp a MIDI frame with the room seq, record it and fan it out
+void Relay::publish(Publisher *from, WireFrame &frame)
+{
+    Room *room = from->room;
+    room->state.update(&frame.body[0], frame.body.size());
+    frame.seq = ++room->seq;
+    room->remember(frame, from->session);
+    broadcast(from, frame);
+
+    if (journal_)
+        journal_->append(room->journal, frame.seq, realtime_us(), from->session,
+                         &frame.body[0], frame.body.size());
+    if (recorder_) {
+        if (from->track < 0) {
+            from->track = room->tracks++;
+            recorder_->track(room->recording, from->track, from->addr);
+        }
+        recorder_->event(room->recording, from->track, monotonic_us(),
+                         &frame.body[0], frame.body.size());
+    }
+}
+
+void Relay::broadcast(Publisher *from, const WireFrame &frame)
+{
+    uint64_t now = monotonic_us();
+    std::vector<RelayClient *> &members = from->room->members;
+    for (size_t i = 0; i < members.size(); i++) {
+        RelayClient *c = members[i];
+        if (c == from || c->closing || c->catchup)
+            continue;
+        if (c->coalescer && !c->coalescer->offer(&frame.body[0], frame.body.size(), now, frame.seq))
+            continue;
+        if (!c->queue.push(frame, now))
+            closeClient(c, "send queue overflow");
+    }
+}
+
+/*
+ * Forward one SysEx chunk to the members that take them. Transfers get
+ * a relay-wide id so they stay distinct on every subscriber connection;
+ * chunks of a transfer whose first chunk never arrived are dropped.
+ */
+void Relay::relaySysex(RelayClient *from, WireFrame &frame)
+{
+    uint32_t transfer = wire_get32(&frame.body[0]);
+    if (frame.flags & SYSEX_BEGIN) {
+        from->sysexFrom = transfer;
+        from->sysexTransfer = nextTransfer_++;
+        if (nextTransfer_ == 0)
+            nextTransfer_ = 1;
+    } else if (!from->sysexTransfer || transfer != from->sysexFrom) {
+        return;
+    }
+    wire_put32(&frame.body[0], from->sysexTransfer);
+    if (frame.flags & SYSEX_END)
+        from->sysexTransfer = 0;
+    frame.seq = 0;
+    forward(from, frame, CAP_SYSEX);
+}
+
+/*
+ * Forward a file's SysEx message as one chunked transfer. Like SysEx
+ * from clients it goes live to the members that take FRAME_SYSEX and
+ * is neither journaled nor recorded.
+ */
+void Relay::playSysex(FilePublisher *from, const WireFrame &message)
+{
+    uint32_t transfer = nextTransfer_++;
+    if (nextTransfer_ == 0)
+        nextTransfer_ = 1;
+    WireFrame frame;
+    frame.type = FRAME_SYSEX;
+    frame.time = message.time;
+    size_t n = message.body.size();
+    for (size_t done = 0; done < n; ) {
+        size_t chunk = n - done < WIRE_SYSEX_CHUNK ? n - done : WIRE_SYSEX_CHUNK;
+        frame.flags = (done == 0 ? SYSEX_BEGIN : 0) | (done + chunk == n ? SYSEX_END : 0);
+        frame.body.resize(4 + chunk);
+        wire_put32(&frame.body[0], transfer);
+        memcpy(&frame.body[4], &message.body[done], chunk);
+        done += chunk;
+        forward(from, frame, CAP_SYSEX);
+    }
+}
+
+// Queue a live-only frame to the other members that announced cap (with),
+// or to those that did not
+void Relay::forward(Publisher *from, const WireFrame &frame, uint32_t cap, bool with)
+{
+    uint64_t now = monotonic_us();
+    std::vector<RelayClient *> &members = from->room->members;
+    for (size_t i = 0; i < members.size(); i++) {
+        RelayClient *c = members[i];
+        if (c == from || c->closing || c->catchup || ((c->caps & cap) != 0) != with)
+            continue;
+        if (!c->queue.push(frame, now))
+            closeClient(c, "send queue overflow");
+    }
+}
+
+// Queue a control frame to one client
+void Relay::send(RelayClient *client, const WireFrame &frame)
+{
+    if (!client->queue.push(frame, monotonic_us()))
+        closeClient(client, "send queue overflow");
+}
+
+/*
+ * Fill buf from the kernel's random pool. Session tokens must not be
+ * guessable from anything a client sees, so there is no weaker fallback:
+ * the server exits if the pool cannot be read.
+ */
+static void random_bytes(void *buf, size_t n)
+{
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    ssize_t got = fd == -1 ? -1 : read(fd, buf, n);
+    if (fd != -1)
+        close(fd);
+    if (got != (ssize_t)n) {
+        perror("server: /dev/urandom");
+        exit(1);
+    }
+}
+
+// Handshake: negotiate capabilities, start or resume a session, join the room
+void Relay::hello(RelayClient *client, const WireFrame &frame)
+{
+    WireHello hello;
+    if (client->session || !wire_decode_hello(frame, hello) || hello.room.size() > MAX_ROOM_NAME) {
+        closeClient(client, "bad hello");
+        return;
+    }
+    if (hello.version != PROTOCOL_VERSION) {
+        closeClient(client, "protocol version mismatch");
+        return;
+    }
+
+    // Only the holder of the session's token may take it over
+    bool resumed = false;
+    std::map<uint32_t, Lingering>::iterator it = sessions_.find(hello.session);
+    if (it != sessions_.end() && it->second.token != hello.token)
+        it = sessions_.end();
+    RelayClient *stale = hello.session ? findSession(hello.session) : NULL;
+    if (stale && stale->token != hello.token)
+        stale = NULL;
+    if (stale) {
+        // The old connection died without the server noticing yet: take it over
+        client->session = hello.session;
+        client->token = stale->token;
+        client->clientSeq = stale->clientSeq;
+        stale->session = 0;
+        // Its notes are still being played, not left behind
+        if (stale->room && stale->room->name == (hello.room.empty() ? DEFAULT_ROOM : hello.room)) {
+            client->notes = stale->notes;
+            stale->notes.reset();
+        }
+        closeClient(stale, "session resumed elsewhere");
+        resumed = true;
+    } else if (hello.session && it != sessions_.end()) {
+        client->session = hello.session;
+        client->token = hello.token;
+        client->clientSeq = it->second.clientSeq;
+        sessions_.erase(it);
+        resumed = true;
+    } else {
+        uint32_t session;
+        do
+            random_bytes(&session, sizeof session);
+        while (session == 0 || findSession(session) || sessions_.count(session) ||
+               session == hello.session);
+        client->session = session;
+        random_bytes(&client->token, sizeof client->token);
+    }
+    client->caps = hello.caps & SERVER_CAPS;
+
+    WireWelcome welcome;
+    welcome.caps = client->caps;
+    welcome.session = client->session;
+    welcome.clientSeq = client->clientSeq;
+    welcome.token = client->token;
+    WireFrame reply;
+    wire_encode_welcome(reply, welcome);
+    reply.time = frame.time;
+    send(client, reply);
+
+    printf("server: %s %s session %08x\n", client->addr.c_str(),
+        resumed ? "resumed" : "started", client->session);
+
+    uint32_t resumeFrom = (resumed && (client->caps & CAP_RESUME)) ? hello.lastSeq : 0;
+    join(client, hello.room.empty() ? DEFAULT_ROOM : hello.room, resumeFrom);
+}
+
+// The connected client holding session, if any
+RelayClient *Relay::findSession(uint32_t session) const
+{
+    for (size_t i = 0; i < clients_.size(); i++) {
+        if (clients_[i]->session == session)
+            return clients_[i];
+    }
+    return NULL;
+}
+
+// Close idle heartbeat sessions and forget sessions past their linger time
+void Relay::expire(uint64_t now)
+{
+    if (now - lastExpire_ < POLL_INTERVAL_MS * 1000)
+        return;
+    lastExpire_ = now;
+
+    if (recorder_)
+        recorder_->retry();
+    if (journal_)
+        journal_->retry();
+
+    uint64_t idle = (uint64_t)config_.idleTimeoutMs * 1000;
+    for (size_t i = 0; i < clients_.size(); i++) {
+        RelayClient *c = clients_[i];
+        if (!c->closing && (c->caps & CAP_HEARTBEAT) && idle && now - c->lastHeard > idle)
+            closeClient(c, "idle timeout");
+    }
+
+    std::map<uint32_t, Lingering>::iterator it = sessions_.begin();
+    while (it != sessions_.end()) {
+        if (now >= it->second.expires)
+            sessions_.erase(it++);
+        else
+            ++it;
+    }
+}
+
+/*
+ * Move a client into the named room and bring it up to date. A resuming
+ * client gets the frames after resumeFrom from the room history when it
+ * still has them, less the ones it published itself, everyone else the
+ * state snapshot.
+ */
+void Relay::join(RelayClient *client, const std::string &name, uint32_t resumeFrom)
+{
+    if (client->room && client->room->name == name)
+        return;
+    leave(client);
+
+    Room *room = openRoom(name);
+    room->members.push_back(client);
+    client->room = room;
+    client->track = -1;
+    printf("server: %s joined room '%s'\n", client->addr.c_str(), name.c_str());
+
+    if (resumeFrom && resumeFrom <= room->seq &&
+            (room->history.empty() ? resumeFrom == room->seq : room->history.front().frame.seq <= resumeFrom + 1)) {
+        uint64_t now = monotonic_us();
+        for (size_t i = 0; i < room->history.size(); i++) {
+            const WireFrame &frame = room->history[i].frame;
+            if (frame.seq <= resumeFrom || room->history[i].session == client->session)
+                continue;
+            if (!client->queue.push(frame, now)) {
+                closeClient(client, "send queue overflow");
+                return;
+            }
+        }
+        resendControllers(client, now);
+        return;
+    }
+
+    if (client->rewindMs && startCatchup(client))
+        return;
+
+    WireFrame snapshot;
+    snapshot.type = FRAME_SNAPSHOT;
+    snapshot.seq = room->seq;
+    snapshot.time = (uint32_t)monotonic_us();
+    room->state.snapshot(snapshot.body);
+    if (snapshot.body.empty())
+        return;
+    if (!client->queue.push(snapshot, monotonic_us()))
+        closeClient(client, "send queue overflow");
+}
+
+/*
+ * The send lanes deliver frames out of seq order: a control change queued
+ * behind realtime traffic goes out after frames with higher seqs, and a
+ * coalescer holds values back under their original seq. The lastSeq a
+ * client resumes from can therefore already be past control frames it
+ * never received, which no resume replay brings back. Send a resumed
+ * client the current value of every continuous controller and the
+ * channel and key pressure instead.
+ */
+void Relay::resendControllers(RelayClient *client, uint64_t now)
+{
+    Room *room = client->room;
+    std::vector<unsigned char> bytes;
+    room->state.controllers(bytes);
+    WireFrame frame;
+    frame.type = FRAME_MIDI;
+    frame.seq = room->seq;
+    frame.time = (uint32_t)now;
+    for (size_t i = 0; i < bytes.size(); ) {
+        size_t n = midi_channel_message_size(bytes[i]);
+        frame.body.assign(bytes.begin() + i, bytes.begin() + i + n);
+        i += n;
+        if (!client->queue.push(frame, now)) {
+            closeClient(client, "send queue overflow");
+            return;
+        }
+    }
+}
+
+// Silence whatever a departing publisher left sounding in its room
+void Relay::releaseNotes(Publisher *from)
+{
+    if (!from->notes.active())
+        return;
+    std::vector<unsigned char> bytes;
+    from->notes.release(bytes);
+    WireFrame frame;
+    frame.type = FRAME_MIDI;
+    frame.time = (uint32_t)monotonic_us();
+    for (size_t i = 0; i + 3 <= bytes.size(); i += 3) {
+        frame.body.assign(bytes.begin() + i, bytes.begin() + i + 3);
+        publish(from, frame);
+    }
+}
+
+// Remove a client from its room, discarding the room once empty
+void Relay::leave(RelayClient *client)
+{
+    Room *room = client->room;
+    if (!room)
+        return;
+    releaseNotes(client);
+    client->room = NULL;
+    endCatchup(client);
+    for (size_t i = 0; i < room->members.size(); i++) {
+        if (room->members[i] == client) {
+            room->members.erase(room->members.begin() + i);
+            break;
+        }
+    }
+    closeRoomIfUnused(room);
+}
+
+// The named room, created (and its recording started) on first use
+Room *Relay::openRoom(const std::string &name)
+{
+    Room *&room = rooms_[name];
+    if (!room) {
+        room = new Room(name);
+        room->opened = realtime_us();
+        if (recorder_)
+            room->recording = recorder_->open(name);
+        if (journal_)
+            room->journal = journal_->open(name, room->opened);
+    }
+    return room;
+}
+
+// Discard a room nobody is in and nothing is playing into
+void Relay::closeRoomIfUnused(Room *room)
+{
+    if (!room->members.empty() || room->players)
+        return;
+    if (recorder_)
+        recorder_->close(room->recording);
+    if (journal_)
+        journal_->close(room->journal);
+    rooms_.erase(room->name);
+    delete room;
+}
+
+/*
+ * Bring a client up to date from client->rewindMs ago: the journaled state
+ * as of then, followed by everything since (see catchUp). Returns false,
+ * leaving the caller to send a plain snapshot, if there is no journal to
+ * serve it from. The journal itself is searched off the relay thread.
+ */
+bool Relay::startCatchup(RelayClient *client)
+{
+    Room *room = client->room;
+    uint64_t from = realtime_us() - (uint64_t)client->rewindMs * 1000;
+    client->rewindMs = 0;
+    if (!journal_ || room->seq == 0)
+        return false;
+    // Seqs only mean something within the room's current lifetime
+    if (from < room->opened)
+        from = room->opened;
+
+    // The search runs on the feed's own thread; catchUp() picks it up
+    client->catchup = new JournalFeed(journal_->dir(), room->name, from);
+    client->catchupStart = 0;
+    client->catchupFrom = from;
+    client->catchupSeq = 0;
+    client->catchupDeadline = 0;
+    return true;
+}
+
+/*
+ * Start replay once the feed has found the starting point: the snapshot
+ * as of then goes first. A journal that has nothing for the room falls
+ * back to the current snapshot. Returns false if the client is done
+ * catching up (or closed).
+ */
+bool Relay::beginReplay(RelayClient *client, uint64_t now)
+{
+    Room *room = client->room;
+    JournalFeed *feed = client->catchup;
+    WireFrame snapshot;
+    snapshot.type = FRAME_SNAPSHOT;
+    snapshot.time = (uint32_t)now;
+    bool found = feed->status() == JournalFeed::READY && feed->seq() <= room->seq;
+    if (found) {
+        snapshot.seq = feed->seq();
+        snapshot.body.swap(feed->state());
+    } else {
+        endCatchup(client);
+        snapshot.seq = room->seq;
+        room->state.snapshot(snapshot.body);
+    }
+    if (!snapshot.body.empty() && !client->queue.push(snapshot, now)) {
+        closeClient(client, "send queue overflow");
+        return false;
+    }
+    if (!found)
+        return false;
+    client->catchupStart = now;
+    client->catchupSeq = snapshot.seq;
+    printf("server: %s catching up in room '%s' from seq %u\n",
+        client->addr.c_str(), room->name.c_str(), snapshot.seq);
+    return true;
+}
+
+/*
+ * Feed catching-up clients from the journal at up to CATCHUP_SPEEDUP times
+ * the pace it was played at, so a rewind is heard as music rather than one
+ * burst, while keeping their send queues no more than half full. Replay
+ * goes on the bulk lane, behind anything live for the same client.
+ */
+void Relay::catchUp(uint64_t now)
+{
+    WireFrame frame;
+    frame.type = FRAME_MIDI;
+    for (size_t i = 0; i < clients_.size(); i++) {
+        RelayClient *c = clients_[i];
+        if (!c->catchup || c->closing)
+            continue;
+        if (!c->catchupStart) {
+            if (c->catchup->status() == JournalFeed::PENDING || !beginReplay(c, now))
+                continue;
+        }
+        while (c->catchup && !c->closing && c->queue.size() < config_.queue.maxFrames / 2) {
+            const JournalEntry *entry = c->catchup->peek();
+            if (!entry) {
+                splice(c, now);
+                break;
+            }
+            if (entry->time < c->room->opened || entry->seq <= c->catchupSeq || entry->body.empty()) {
+                c->catchup->pop();
+                continue;
+            }
+            if (entry->seq > c->room->seq) {
+                splice(c, now);
+                break;
+            }
+            if (entry->time > c->catchupFrom + (now - c->catchupStart) * CATCHUP_SPEEDUP)
+                break;
+            // Never echo a client's own playing back to it
+            if (!c->session || entry->session != c->session) {
+                frame.seq = entry->seq;
+                frame.time = (uint32_t)entry->time;
+                frame.body = entry->body;
+                c->queue.replay(frame, now);
+            }
+            c->catchupSeq = entry->seq;
+            c->catchupDeadline = 0;
+            c->catchup->pop();
+            if (c->catchupSeq == c->room->seq)
+                splice(c, now);
+        }
+    }
+}
+
+/*
+ * Hand a client over to live fan-out. Its reader thread may still be
+ * busy, so the feed is only stopped here and deleted by sweep() once it
+ * has finished.
+ */
+void Relay::endCatchup(RelayClient *client)
+{
+    if (!client->catchup)
+        return;
+    client->catchup->stop();
+    retired_.push_back(client->catchup);
+    client->catchup = NULL;
+}
+
+/*
+ * Hand a caught-up client over to live fan-out. The journal trails the
+ * room by up to its flush interval, so the last stretch comes from the
+ * room history; if even that doesn't reach back far enough the client
+ * gets the current snapshot. Live frames would overtake replay still on
+ * the bulk lane, so that has to be written out first. Returns false while
+ * still waiting.
+ */
+bool Relay::splice(RelayClient *client, uint64_t now)
+{
+    if (client->queue.size(SEND_BULK))
+        return false;
+    Room *room = client->room;
+    uint32_t last = client->catchupSeq;
+    if (last < room->seq) {
+        if (!room->history.empty() && room->history.front().frame.seq <= last + 1) {
+            for (size_t i = 0; i < room->history.size(); i++) {
+                const WireFrame &frame = room->history[i].frame;
+                if (frame.seq <= last || (client->session && room->history[i].session == client->session))
+                    continue;
+                if (!client->queue.push(frame, now)) {
+                    closeClient(client, "send queue overflow");
+                    return true;
+                }
+            }
+        } else if (!client->catchupDeadline) {
+            client->catchupDeadline = now + CATCHUP_SPLICE_MS * 1000;
+            return false;
+        } else if (now < client->catchupDeadline) {
+            return false;
+        } else {
+            WireFrame snapshot;
+            snapshot.type = FRAME_SNAPSHOT;
+            snapshot.seq = room->seq;
+            snapshot.time = (uint32_t)now;
+            room->state.snapshot(snapshot.body);
+            if (!client->queue.push(snapshot, now)) {
+                closeClient(client, "send queue overflow");
+                return true;
+            }
+        }
+    }
+    endCatchup(client);
+    printf("server: %s caught up at seq %u\n", client->addr.c_str(), room->seq);
+    return true;
+}
+
+void Relay::closeClient(RelayClient *client, const char *reason)
+{
+    if (client->closing)
+        return;
+    client->closing = true;
+    printf("server: closing %s (%s, %lu frames dropped)\n",
+        client->addr.c_str(), reason, client->queue.dropped());
+}
+
+// Remove clients marked as closing
+void Relay::sweep()
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < clients_.size(); i++) {
+        RelayClient *c = clients_[i];
+        if (c->closing) {
+            if (c->session) {
+                Lingering &l = sessions_[c->session];
+                l.token = c->token;
+                l.clientSeq = c->clientSeq;
+                l.expires = monotonic_us() + (uint64_t)SESSION_LINGER_MS * 1000;
+            }
+            leave(c);
+            close(c->fd);
+            delete c;
+        } else {
+            clients_[kept++] = c;
+        }
+    }
+    clients_.resize(kept);
+
+    kept = 0;
+    for (size_t i = 0; i < retired_.size(); i++) {
+        if (retired_[i]->stopped())
+            delete retired_[i];
+        else
+            retired_[kept++] = retired_[i];
+    }
+    retired_.resize(kept);
+}
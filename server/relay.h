@@ -0,0 +1,188 @@
+/*
+ * relay.h
+ *
+ *  Single threaded poll() based MIDI relay. Every connected client is
+ *  both a publisher and a subscriber of exactly one room: MIDI frames
+ *  received from one client are stamped with the room sequence number
+ *  and fanned out to the send queues of the other members. Clients start
+ *  in DEFAULT_ROOM and move with a FRAME_JOIN; joining delivers the room
+ *  state snapshot before any live traffic.
+ *
+ *  When a publisher leaves a room, by disconnect, timeout or moving to
+ *  another room, the notes and pedals it left down are released on its
+ *  behalf.
+ *
+ *  With RelayConfig::recordDir set, every room is recorded to a Standard
+ *  MIDI File with one track per publisher (see recorder.h).
+ *
+ *  With RelayConfig::journalDir set, everything published is also
+ *  appended to a per-room journal (see journal.h).
+ *
+ *  A client can ask to start from some time ago (FRAME_REWIND). It then
+ *  gets the journaled state and frames since, as fast as its connection
+ *  takes them, and is spliced into live fan-out by seq once caught up.
+ *
+ *  Large SysEx travels as FRAME_SYSEX chunks. They are forwarded live to
+ *  the members that announced CAP_SYSEX, behind all channel traffic on
+ *  each send queue, and are not part of the room seq, state, journal or
+ *  recording. MIDI clock tempo updates (FRAME_CLOCK) are forwarded the
+ *  same way to members with CAP_CLOCK.
+ *
+ *  RelayConfig::playback streams Standard MIDI Files into rooms through
+ *  the same path, each as a publisher that is not a member; a room stays
+ *  open while a file is playing into it.
+ *
+ *  Clients that open with FRAME_HELLO get a session: heartbeats keep it
+ *  alive, and after a dropped connection the same session id and its
+ *  secret token can be presented again within SESSION_LINGER_MS to
+ *  resume both directions by sequence number (room history is replayed
+ *  if it still covers the gap, otherwise the state snapshot is sent).
+ */
+
+#ifndef RELAY_H_
+#define RELAY_H_
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "cc_coalescer.h"
+#include "midi_wire.h"
+#include "journal.h"
+#include "note_tracker.h"
+#include "player.h"
+#include "recorder.h"
+#include "room.h"
+#include "send_queue.h"
+
+#define DEFAULT_ROOM "lobby"
+#define MAX_ROOM_NAME 64
+#define SERVER_CAPS (CAP_SNAPSHOT | CAP_RESUME | CAP_HEARTBEAT | CAP_CATCHUP | CAP_SYSEX | \
+                     CAP_CLOCK)
+
+struct RelayConfig {
+    QueueConfig queue;          // per-subscriber send queue
+    unsigned int coalesceUs;    // per-subscriber CC coalescing window (0 = off)
+
+    unsigned int idleTimeoutMs; // drop heartbeat sessions silent this long
+
+    std::string recordDir;      // record every room as an SMF here (empty = off)
+    std::string journalDir;     // journal every room here (empty = off)
+    std::vector<PlaybackConfig> playback;   // files streamed into rooms
+
+    RelayConfig() : coalesceUs(0), idleTimeoutMs(10000) {}
+};
+
+/* Anything that publishes MIDI into a room: a client or a file player */
+struct Publisher {
+    std::string addr;           // printable peer address or file name
+    Room *room;
+    NoteTracker notes;          // what this publisher has left sounding in its room
+    int track;                  // recorder track in the current room, -1 until it publishes
+    uint32_t session;           // 0 for files and clients that never sent FRAME_HELLO
+
+    explicit Publisher(const std::string &addr) : addr(addr), room(NULL), track(-1), session(0) {}
+};
+
+struct RelayClient : Publisher {
+    int fd;
+    WireReader reader;
+    SendQueue queue;
+    CcCoalescer *coalescer;     // NULL when coalescing is off
+    uint32_t caps;              // negotiated capabilities
+    uint64_t token;             // proves ownership of session on resume
+    uint32_t clientSeq;         // last client seq received
+    uint64_t lastHeard;         // time of the last frame from this client
+    uint32_t rewindMs;          // catch-up requested for the next join
+    JournalFeed *catchup;       // non-NULL while replaying the journal
+    uint64_t catchupStart;      // when replay began, 0 while the journal is searched
+    uint64_t catchupFrom;       // journal time replay started from
+    uint32_t catchupSeq;        // last seq sent during catch-up
+    uint64_t catchupDeadline;   // give up waiting for the journal at this time
+    uint32_t sysexFrom;         // client's id for the SysEx transfer in progress
+    uint32_t sysexTransfer;     // relay id it is forwarded under, 0 if none
+    bool closing;
+
+    RelayClient(int fd, const std::string &addr, const RelayConfig &config)
+        : Publisher(addr), fd(fd), queue(config.queue), coalescer(NULL),
+          caps(0), token(0), clientSeq(0), lastHeard(0), rewindMs(0),
+          catchup(NULL), catchupStart(0), catchupFrom(0), catchupSeq(0), catchupDeadline(0), sysexFrom(0),
+          sysexTransfer(0), closing(false)
+    {
+        if (config.coalesceUs)
+            coalescer = new CcCoalescer(config.coalesceUs);
+    }
+    ~RelayClient() { delete coalescer; delete catchup; }
+
+private:
+    RelayClient(const RelayClient &);
+    RelayClient &operator=(const RelayClient &);
+};
+
+/* A Standard MIDI File streamed into a room as if a client played it */
+struct FilePublisher : Publisher {
+    Player player;
+
+    explicit FilePublisher(const std::string &path) : Publisher(path) {}
+};
+
+class Relay {
+public:
+    Relay(int listenfd, const RelayConfig &config);
+    ~Relay();
+
+    /* Serve clients until done becomes true */
+    void run(volatile bool &done);
+
+private:
+    void acceptClient();
+    void readClient(RelayClient *client);
+    void handleFrame(RelayClient *client, WireFrame &frame);
+    void publish(Publisher *from, WireFrame &frame);
+    void broadcast(Publisher *from, const WireFrame &frame);
+    void relaySysex(RelayClient *from, WireFrame &frame);
+    void playSysex(FilePublisher *from, const WireFrame &message);
+    void forward(Publisher *from, const WireFrame &frame, uint32_t cap, bool with = true);
+    void resendControllers(RelayClient *client, uint64_t now);
+    void releaseNotes(Publisher *from);
+    void startPlayback(const PlaybackConfig &config);
+    void play(uint64_t now);
+    bool startCatchup(RelayClient *client);
+    void catchUp(uint64_t now);
+    bool beginReplay(RelayClient *client, uint64_t now);
+    void endCatchup(RelayClient *client);
+    bool splice(RelayClient *client, uint64_t now);
+    void hello(RelayClient *client, const WireFrame &frame);
+    void send(RelayClient *client, const WireFrame &frame);
+    void flushCoalescers(uint64_t now);
+    RelayClient *findSession(uint32_t session) const;
+    void expire(uint64_t now);
+    int pollTimeout(uint64_t now) const;
+    void join(RelayClient *client, const std::string &name, uint32_t resumeFrom = 0);
+    void leave(RelayClient *client);
+    Room *openRoom(const std::string &name);
+    void closeRoomIfUnused(Room *room);
+    void closeClient(RelayClient *client, const char *reason);
+    void sweep();
+
+    int listenfd_;
+    RelayConfig config_;
+    std::vector<RelayClient *> clients_;
+    std::vector<FilePublisher *> players_;
+    std::map<std::string, Room *> rooms_;
+    Recorder *recorder_;        // NULL when not recording
+    Journal *journal_;          // NULL when not journaling
+    std::vector<JournalFeed *> retired_;    // catch-up readers still shutting down
+
+    // State of disconnected sessions kept for resume
+    struct Lingering {
+        uint64_t token;
+        uint32_t clientSeq;
+        uint64_t expires;
+    };
+    std::map<uint32_t, Lingering> sessions_;
+    uint32_t nextTransfer_;
+    uint64_t lastExpire_;
+};
+
+#endif /* RELAY_H_ */
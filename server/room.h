@@ -0,0 +1,55 @@
+/*
+ * room.h
+ *
+ *  A relay room: the set of clients sharing one MIDI stream, the room
+ *  sequence counter, the running state model late joiners are brought
+ *  up to date from and a short history of recent frames that lets a
+ *  reconnecting session resume without gaps.
+ */
+
+#ifndef ROOM_H_
+#define ROOM_H_
+
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "midi_state.h"
+#include "midi_wire.h"
+
+#define ROOM_HISTORY_FRAMES 1024    // frames kept for session resume
+
+struct RelayClient;
+
+/* A frame kept for resume, with the session that published it */
+struct HistoryFrame {
+    WireFrame frame;
+    uint32_t session;       // 0 for files and clients without a session
+};
+
+struct Room {
+    std::string name;
+    std::vector<RelayClient *> members;
+    MidiState state;
+    std::deque<HistoryFrame> history;   // most recent frames, oldest first
+    uint32_t seq;           // last sequence number stamped in this room
+    uint32_t recording;     // Recorder id, 0 when not recording
+    unsigned int tracks;    // recorder tracks handed out to publishers
+    unsigned int players;   // files playing into the room
+    uint32_t journal;       // Journal id, 0 when not journaling
+    uint64_t opened;        // wall clock time seqs started from 0
+
+    explicit Room(const std::string &name)
+        : name(name), seq(0), recording(0), tracks(0), players(0), journal(0), opened(0) {}
+
+    void remember(const WireFrame &frame, uint32_t session)
+    {
+        if (history.size() >= ROOM_HISTORY_FRAMES)
+            history.pop_front();
+        history.push_back(HistoryFrame());
+        history.back().frame = frame;
+        history.back().session = session;
+    }
+};
+
+#endif /* ROOM_H_ */
@@ -0,0 +1,238 @@
+//*****************************************//
+//  send_queue.cpp
+//
+//  Bounded, non-blocking per-subscriber
+//  send queue with drop policies.
+//
+//*****************************************//
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "midi_util.h"
+#include "send_queue.h"
+
+#define MAX_IOV 64              // frames handed to the kernel per sendmsg()
+#define PINNED_OVERFLOW 4       // pinned frames may exceed maxFrames by this factor
+
+SendQueue::SendQueue(const QueueConfig &config)
+    : config_(config), bulkBytes_(0), sent_(0), partial_(SEND_REALTIME), throttled_(false), dropped_(0)
+{
+}
+
+bool SendQueue::push(const WireFrame &frame, uint64_t now)
+{
+    SendClass cls = send_class(frame);
+    if (cls == SEND_BULK) {
+        pushBulk(frame, now);
+        return true;
+    }
+
+    const unsigned char *msg = frame.body.empty() ? NULL : &frame.body[0];
+    size_t n = frame.body.size();
+    bool pinned = frame.type == FRAME_SNAPSHOT || (frame.type == FRAME_MIDI && midi_is_release(msg, n));
+    int key = (frame.type == FRAME_MIDI && !pinned) ? midi_coalesce_key(msg, n) : -1;
+
+    if (live() >= config_.maxFrames) {
+        if (config_.policy == QUEUE_DISCONNECT)
+            return false;
+        bool superseded = config_.policy == QUEUE_COALESCE && key >= 0 && coalesce(cls, key);
+        if (!superseded && !makeRoom()) {
+            // Nothing left to drop. Pinned frames still get queued, up to a hard cap.
+            if (!pinned) {
+                dropped_++;
+                return true;
+            }
+            if (live() >= config_.maxFrames * PINNED_OVERFLOW)
+                return false;
+        }
+    }
+
+    append(cls, frame, now, key, pinned);
+    return true;
+}
+
+void SendQueue::replay(const WireFrame &frame, uint64_t now)
+{
+    append(SEND_BULK, frame, now, -1, false);
+}
+
+/*
+ * Queue live bulk data: SysEx chunks and short SysEx messages. Once a
+ * transfer does not fit, the rest of it is dropped rather than delivered
+ * with a hole in it.
+ */
+void SendQueue::pushBulk(const WireFrame &frame, uint64_t now)
+{
+    uint32_t transfer = 0;
+    if (frame.type == FRAME_SYSEX) {
+        if (frame.body.size() < 4)
+            return;
+        transfer = wire_get32(&frame.body[0]);
+        if (frame.flags & SYSEX_BEGIN)
+            broken_.erase(transfer);
+    }
+    bool broken = transfer && broken_.count(transfer);
+    if (broken || bulkBytes_ + WIRE_HEADER_SIZE + frame.body.size() > config_.maxBulkBytes) {
+        if (transfer && (frame.flags & SYSEX_END))
+            broken_.erase(transfer);
+        else if (transfer)
+            broken_.insert(transfer);
+        dropped_++;
+        return;
+    }
+    append(SEND_BULK, frame, now, -1, false);
+}
+
+void SendQueue::append(SendClass cls, const WireFrame &frame, uint64_t now, int key, bool pinned)
+{
+    lanes_[cls].push_back(Entry());
+    Entry &e = lanes_[cls].back();
+    if (!wire_encode(e.bytes, frame)) {
+        // Too big for the wire; never queue an empty frame
+        lanes_[cls].pop_back();
+        dropped_++;
+        return;
+    }
+    e.queued = now;
+    e.key = key;
+    e.pinned = pinned;
+    if (cls == SEND_BULK)
+        bulkBytes_ += e.bytes.size();
+}
+
+/*
+ * Make room by dropping a queued, not yet started, value the new frame
+ * supersedes. The new value is queued at the back as usual, so nothing
+ * moves ahead of frames queued after the one it replaces.
+ */
+bool SendQueue::coalesce(SendClass cls, int key)
+{
+    std::deque<Entry> &lane = lanes_[cls];
+    size_t first = started(cls);
+    for (size_t i = lane.size(); i-- > first; ) {
+        if (lane[i].key != key)
+            continue;
+        lane.erase(lane.begin() + i);
+        dropped_++;
+        return true;
+    }
+    return false;
+}
+
+// Drop the oldest frame that is neither pinned nor partially sent, controllers first.
+bool SendQueue::makeRoom()
+{
+    static const int order[] = { SEND_CONTROL, SEND_REALTIME };
+    for (size_t k = 0; k < sizeof order / sizeof order[0]; k++) {
+        std::deque<Entry> &lane = lanes_[order[k]];
+        for (size_t i = started(order[k]); i < lane.size(); i++) {
+            if (lane[i].pinned)
+                continue;
+            lane.erase(lane.begin() + i);
+            dropped_++;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Each pass is one deficit round-robin round. The bulk lane sits a round
+ * out while the socket still has WIRE_SYSEX_BACKLOG bytes in flight.
+ */
+bool SendQueue::flush(int fd)
+{
+    throttled_ = false;
+    for (;;) {
+        struct iovec iov[MAX_IOV];
+        int lane[MAX_IOV];
+        size_t taken[SEND_CLASSES] = { 0 };
+        size_t count = 0;
+        bool waiting = false;
+
+        // A partly written frame has to be finished before anything else
+        if (sent_ > 0) {
+            const Entry &e = lanes_[partial_].front();
+            iov[0].iov_base = (void *)(&e.bytes[0] + sent_);
+            iov[0].iov_len = e.bytes.size() - sent_;
+            lane[0] = partial_;
+            taken[partial_] = 1;
+            count = 1;
+        }
+        for (int cls = 0; cls < SEND_CLASSES && count < MAX_IOV; cls++) {
+            std::deque<Entry> &q = lanes_[cls];
+            if (taken[cls] >= q.size()) {
+                if (q.empty())
+                    drr_.idle(cls);
+                continue;
+            }
+            if (cls == SEND_BULK && wire_unsent(fd) >= WIRE_SYSEX_BACKLOG) {
+                throttled_ = count == 0;
+                continue;
+            }
+            drr_.grant(cls);
+            long credit = drr_.credit(cls);
+            for (; count < MAX_IOV && taken[cls] < q.size(); count++, taken[cls]++) {
+                const Entry &e = q[taken[cls]];
+                if ((long)e.bytes.size() > credit)
+                    break;
+                credit -= e.bytes.size();
+                iov[count].iov_base = (void *)&e.bytes[0];
+                iov[count].iov_len = e.bytes.size();
+                lane[count] = cls;
+            }
+            waiting = true;
+        }
+        if (count == 0) {
+            // Frames bigger than one quantum take a few rounds of credit
+            if (waiting)
+                continue;
+            return true;
+        }
+
+        struct msghdr msg = msghdr();
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        // Retire fully written frames, in the order they went out
+        size_t written = (size_t)n;
+        for (size_t i = 0; i < count && written > 0; i++) {
+            std::deque<Entry> &q = lanes_[lane[i]];
+            size_t size = q.front().bytes.size();
+            size_t left = size - (i == 0 ? sent_ : 0);
+            if (written < left) {
+                sent_ = size - left + written;
+                partial_ = lane[i];
+                break;
+            }
+            written -= left;
+            sent_ = 0;
+            drr_.charge(lane[i], size);
+            if (lane[i] == SEND_BULK)
+                bulkBytes_ -= size;
+            q.pop_front();
+        }
+    }
+}
+
+bool SendQueue::healthy(uint64_t now) const
+{
+    if (config_.policy != QUEUE_DISCONNECT || config_.maxLagMs == 0 || live() == 0)
+        return true;
+    uint64_t oldest = now;
+    for (int cls = SEND_REALTIME; cls <= SEND_CONTROL; cls++) {
+        if (!lanes_[cls].empty() && lanes_[cls].front().queued < oldest)
+            oldest = lanes_[cls].front().queued;
+    }
+    return now - oldest <= (uint64_t)config_.maxLagMs * 1000;
+}
@@ -0,0 +1,100 @@
+/*
+ * send_queue.h
+ *
+ *  Bounded per-subscriber outgoing frame queue. The relay never blocks
+ *  on a subscriber socket: frames are queued here and written out with
+ *  non-blocking sends whenever the socket has room. When a subscriber
+ *  falls behind, the queue applies its QueuePolicy instead of growing.
+ *  Release messages (note offs, sustain up) and state snapshots are never
+ *  dropped.
+ *
+ *  Frames wait in one lane per SendClass and every write is one deficit
+ *  round-robin round over the lanes (see send_classes.h). The bound and
+ *  policy apply to the realtime and control lanes together. The bulk lane
+ *  is only written while little is in flight on the socket (see
+ *  wire_unsent()) and is bounded in bytes: a SysEx transfer that
+ *  overflows it loses its remaining chunks, never the subscriber.
+ */
+
+#ifndef SEND_QUEUE_H_
+#define SEND_QUEUE_H_
+
+#include <stdint.h>
+#include <deque>
+#include <set>
+#include <vector>
+#include "midi_wire.h"
+#include "send_classes.h"
+
+enum QueuePolicy {
+    QUEUE_DROP_OLDEST,      // discard the oldest droppable frame when full
+    QUEUE_COALESCE,         // when full, drop a queued controller value the new one supersedes, then drop oldest
+    QUEUE_DISCONNECT        // disconnect the subscriber when full or lagging
+};
+
+struct QueueConfig {
+    size_t maxFrames;       // bound of the realtime and control lanes in frames
+    QueuePolicy policy;
+    unsigned int maxLagMs;  // QUEUE_DISCONNECT: max age of the oldest queued frame (0 = no limit)
+    size_t maxBulkBytes;    // bound of the bulk lane in encoded bytes
+
+    QueueConfig() : maxFrames(256), policy(QUEUE_COALESCE), maxLagMs(2000), maxBulkBytes(1 << 20) {}
+};
+
+class SendQueue {
+public:
+    explicit SendQueue(const QueueConfig &config);
+
+    /* Queue one frame. Returns false if the subscriber must be disconnected. */
+    bool push(const WireFrame &frame, uint64_t now);
+
+    /*
+     * Queue a replayed frame on the bulk lane. The caller paces replay
+     * by size(), so these are never dropped.
+     */
+    void replay(const WireFrame &frame, uint64_t now);
+
+    /* Write as much as the socket accepts. Returns false on a socket error. */
+    bool flush(int fd);
+
+    /* Returns false if the subscriber lags beyond the configured threshold */
+    bool healthy(uint64_t now) const;
+
+    bool empty() const { return size() == 0; }
+    size_t size() const { return live() + lanes_[SEND_BULK].size(); }
+    size_t size(SendClass cls) const { return lanes_[cls].size(); }
+    unsigned long dropped() const { return dropped_; }
+
+    /* True if flush() has something to write as soon as the socket has room */
+    bool writable() const { return live() > 0 || sent_ > 0 || (!lanes_[SEND_BULK].empty() && !throttled_); }
+
+    /* True if the last flush() held SysEx back until the socket drains */
+    bool throttled() const { return throttled_; }
+
+private:
+    struct Entry {
+        std::vector<unsigned char> bytes;   // encoded frame
+        uint64_t queued;                    // enqueue time (us)
+        int key;                            // coalesce key or -1
+        bool pinned;                        // release or snapshot, never dropped
+    };
+
+    void pushBulk(const WireFrame &frame, uint64_t now);
+    void append(SendClass cls, const WireFrame &frame, uint64_t now, int key, bool pinned);
+    bool coalesce(SendClass cls, int key);
+    bool makeRoom();
+    size_t live() const { return lanes_[SEND_REALTIME].size() + lanes_[SEND_CONTROL].size(); }
+    size_t started(int cls) const { return sent_ > 0 && partial_ == cls ? 1 : 0; }
+
+    QueueConfig config_;
+    std::deque<Entry> lanes_[SEND_CLASSES];
+    DeficitRoundRobin drr_;
+    size_t bulkBytes_;
+    std::set<uint32_t> broken_; // transfers that overflowed the bulk lane
+    size_t sent_;               // bytes of the partly written frame already sent
+    int partial_;               // its lane, at the front
+    bool throttled_;
+    unsigned long dropped_;
+};
+
+#endif /* SEND_QUEUE_H_ */
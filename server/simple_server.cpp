@@ -9,40 +9,91 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
-#include <sys/wait.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <vector>
 #include <string>
+#include "relay.h"
 
 #define PORT "3490"  // the port users will be connecting to
-#define MAXDATASIZE 100 // max number of bytes we can get at once
 #define BACKLOG 10     // how many pending connections queue will hold
 
-void sigchld_handler(int s)
-{
-    while(waitpid(-1, NULL, WNOHANG) > 0);
-}
+// Interrupt handler logic
+static volatile bool done = false;
+static void finish(int ignore){ done = true; }
 
-// get sockaddr, IPv4 or IPv6:
-void *get_in_addr(struct sockaddr *sa)
+static void usage(void)
 {
-    if (sa->sa_family == AF_INET) {
-        return &(((struct sockaddr_in*)sa)->sin_addr);
-    }
-
-    return &(((struct sockaddr_in6*)sa)->sin6_addr);
+    fprintf(stderr, "usage: simple_server [-q frames] [-p drop|coalesce|disconnect] [-l lag_ms] [-c cc_window_ms] [-r record_dir] [-j journal_dir]\n"
+                    "                     [-f file.mid[@room]]... [-L] [-T tempo_scale]\n");
+    exit(1);
 }
 
-int main(void)
+int main(int argc, char *argv[])
 {
-    int sockfd, new_fd;  // listen on sock_fd, new connection on new_fd
+    int sockfd;  // listen on sock_fd
     struct addrinfo hints, *servinfo, *p;
-    struct sockaddr_storage their_addr; // connector's address information
-    socklen_t sin_size;
     struct sigaction sa;
     int yes=1;
-    char s[INET6_ADDRSTRLEN];
     int rv;
+    int opt;
+    RelayConfig config;
+    bool loop = false;
+    double tempoScale = 1.0;
+
+    // Per-subscriber send queue options
+    while ((opt = getopt(argc, argv, "q:p:l:c:r:j:f:LT:")) != -1) {
+        switch (opt) {
+        case 'q':
+            config.queue.maxFrames = strtoul(optarg, NULL, 10);
+            if (config.queue.maxFrames == 0) usage();
+            break;
+        case 'p':
+            if (!strcmp(optarg, "drop")) config.queue.policy = QUEUE_DROP_OLDEST;
+            else if (!strcmp(optarg, "coalesce")) config.queue.policy = QUEUE_COALESCE;
+            else if (!strcmp(optarg, "disconnect")) config.queue.policy = QUEUE_DISCONNECT;
+            else usage();
+            break;
+        case 'l':
+            config.queue.maxLagMs = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            config.coalesceUs = strtoul(optarg, NULL, 10) * 1000;
+            break;
+        case 'r':
+            config.recordDir = optarg;
+            break;
+        case 'j':
+            config.journalDir = optarg;
+            break;
+        case 'f': {
+            // file.mid@room plays into room, plain file.mid into the default
+            PlaybackConfig playback;
+            playback.path = optarg;
+            size_t at = playback.path.rfind('@');
+            if (at != std::string::npos) {
+                playback.room = playback.path.substr(at + 1);
+                playback.path.erase(at);
+            }
+            config.playback.push_back(playback);
+            break;
+        }
+        case 'L':
+            loop = true;
+            break;
+        case 'T':
+            tempoScale = strtod(optarg, NULL);
+            if (tempoScale <= 0) usage();
+            break;
+        default:
+            usage();
+        }
+    }
+
+    for (size_t i = 0; i < config.playback.size(); i++) {
+        config.playback[i].loop = loop;
+        config.playback[i].tempoScale = tempoScale;
+    }
 
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
@@ -89,55 +140,26 @@ int main(void)
         exit(1);
     }
 
-    sa.sa_handler = sigchld_handler; // reap all dead processes
+    // Non-blocking accept() so a vanished connector can't stall the relay
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+
+    // Dead subscribers are detected by send() errors, not SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+
+    sa.sa_handler = finish;
     sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+    sa.sa_flags = 0;
+    if (sigaction(SIGINT, &sa, NULL) == -1) {
         perror("sigaction");
         exit(1);
     }
 
     printf("server: waiting for connections...\n");
 
-    while(1) {  // main accept() loop
-        sin_size = sizeof their_addr;
-        new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
-        if (new_fd == -1) {
-            perror("accept");
-            continue;
-        }
-
-        inet_ntop(their_addr.ss_family,
-            get_in_addr((struct sockaddr *)&their_addr),
-            s, sizeof s);
-        printf("server: got connection from %s\n", s);
-
-        // Send confirmation to client when client sends something over
-        // (encapsulate in function recv_from_client())
-        int numbytes;
-        std::vector<char> buf(MAXDATASIZE);
-        numbytes = recv(new_fd, buf.data(), buf.size() - 1, 0);
-        if (numbytes == -1) {
-        	perror("recv");
-        } else if (!numbytes) {
-        	continue;
-        } else {
-        	std::string teststr = "Got it!";
-        	std::cout << "received from client: " << buf.data() << std::endl;
-        	if (send(new_fd, teststr.c_str(), teststr.length(), 0) == -1)
-        		perror("send");
-        }
-
-//        // Sends "Hello world!" every time a connection is made
-//        if (!fork()) { // this is the child process
-//            close(sockfd); // child doesn't need the listener
-//            if (send(new_fd, "Hello, world!", 13, 0) == -1)
-//                perror("send");
-//            close(new_fd);
-//            exit(0);
-//        }
-        close(new_fd);  // parent doesn't need this
-    }
+    Relay relay(sockfd, config);
+    relay.run(done);
 
+    printf("\nserver: shutting down\n");
+    close(sockfd);
     return 0;
 }
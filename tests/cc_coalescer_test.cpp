@@ -0,0 +1,74 @@
+//*****************************************//
+//  cc_coalescer_test.cpp
+//
+//  CcCoalescer: one value per window, the
+//  latest one wins.
+//
+//*****************************************//
+
+#include "cc_coalescer.h"
+#include "test.h"
+
+TEST(cc_coalescer_holds_back_sweeps)
+{
+    CcCoalescer coalescer(10000);
+    unsigned char cc[3] = { 0xB2, 7, 10 };
+    CHECK(coalescer.offer(cc, 3, 1000, 1));
+    CHECK(coalescer.nextDue() == 11000);
+
+    cc[2] = 20;
+    CHECK(!coalescer.offer(cc, 3, 2000, 2));
+    cc[2] = 30;
+    CHECK(!coalescer.offer(cc, 3, 3000, 3));
+
+    std::vector<CoalescedMessage> out;
+    coalescer.flush(10999, out);
+    CHECK(out.empty());
+    coalescer.flush(11000, out);
+    CHECK(out.size() == 1);
+    if (out.size() == 1) {
+        CHECK(out[0].bytes[0] == 0xB2 && out[0].bytes[1] == 7 && out[0].bytes[2] == 30);
+        CHECK(out[0].tag == 3);
+    }
+
+    // Emitting opened a new window; once it closes empty, the next value passes
+    out.clear();
+    coalescer.flush(21000, out);
+    CHECK(out.empty());
+    CHECK(coalescer.nextDue() == 0);
+    CHECK(coalescer.offer(cc, 3, 21500));
+}
+
+TEST(cc_coalescer_slots_are_independent)
+{
+    CcCoalescer coalescer(10000);
+    unsigned char a[3] = { 0xB0, 7, 1 };
+    unsigned char b[3] = { 0xB1, 7, 1 };
+    unsigned char c[3] = { 0xB0, 10, 1 };
+    CHECK(coalescer.offer(a, 3, 0));
+    CHECK(coalescer.offer(b, 3, 0));
+    CHECK(coalescer.offer(c, 3, 0));
+    CHECK(!coalescer.offer(a, 3, 1));
+}
+
+TEST(cc_coalescer_passes_ordered_and_other_messages)
+{
+    CcCoalescer coalescer(10000);
+    unsigned char sustain[3] = { 0xB0, 64, 127 };
+    unsigned char note[3] = { 0x90, 60, 100 };
+    for (int i = 0; i < 3; i++) {
+        CHECK(coalescer.offer(sustain, 3, i));
+        CHECK(coalescer.offer(note, 3, i));
+    }
+
+    unsigned char volume[3] = { 0xB0, 7, 1 };
+    coalescer.allow(7);
+    CHECK(coalescer.offer(volume, 3, 0));
+    CHECK(coalescer.offer(volume, 3, 1));
+    coalescer.allow(7, false);
+    CHECK(coalescer.offer(volume, 3, 2));
+    CHECK(!coalescer.offer(volume, 3, 3));
+
+    coalescer.setWindow(0);
+    CHECK(coalescer.offer(volume, 3, 4));
+}
@@ -0,0 +1,267 @@
+//*****************************************//
+//  journal_test.cpp
+//
+//  Journal and JournalReader: what is
+//  written can be sought and read back,
+//  across checkpoints, segments and while
+//  the writer is still going.
+//
+//*****************************************//
+
+#include <unistd.h>
+#include <dirent.h>
+#include "midi_state.h"
+#include "journal.h"
+#include "test.h"
+
+#define T0 1000000000000ull     // time of the first record
+#define STEP 1000               // between records
+
+struct Written {
+    uint32_t seq;
+    uint64_t time;
+    uint32_t session;
+    std::vector<unsigned char> body;
+};
+
+// A varied stream: notes coming and going on a few channels, controllers
+// including the pedal, program changes and bends
+static void make_message(uint32_t seq, std::vector<unsigned char> &msg)
+{
+    unsigned char ch = seq % 3;
+    unsigned char note = 36 + (seq * 7) % 48;
+    switch (seq % 10) {
+    case 0: case 1: case 2: case 3:
+        msg.assign(3, 0);
+        msg[0] = 0x90 | ch; msg[1] = note; msg[2] = 1 + seq % 127;
+        break;
+    case 4: case 5: case 6:
+        msg.assign(3, 0);
+        msg[0] = 0x80 | ch; msg[1] = 36 + ((seq - 14) * 7) % 48; msg[2] = 0;
+        break;
+    case 7:
+        msg.assign(3, 0);
+        msg[0] = 0xB0 | ch; msg[1] = seq % 20 == 7 ? 64 : 7; msg[2] = seq % 128;
+        break;
+    case 8:
+        msg.assign(2, 0);
+        msg[0] = 0xC0 | ch; msg[1] = seq % 128;
+        break;
+    default:
+        msg.assign(3, 0);
+        msg[0] = 0xE0 | ch; msg[1] = seq % 128; msg[2] = (seq / 128) % 128;
+        break;
+    }
+}
+
+// Append records first..last, giving the writer time to keep up
+static void write_range(Journal &journal, uint32_t id, uint32_t first, uint32_t last,
+                        std::vector<Written> &log)
+{
+    for (uint32_t seq = first; seq <= last; seq++) {
+        Written w;
+        w.seq = seq;
+        w.time = T0 + (uint64_t)seq * STEP;
+        w.session = 100 + seq % 4;
+        make_message(seq, w.body);
+        journal.append(id, w.seq, w.time, w.session, &w.body[0], w.body.size());
+        log.push_back(w);
+        if (seq % 2000 == 0)
+            usleep(10000);
+    }
+}
+
+// Wait for the writer to flush what it has
+static void settle()
+{
+    usleep(2 * JOURNAL_FLUSH_MS * 1000);
+}
+
+static size_t count_segments(const std::string &dir, const std::string &room)
+{
+    DIR *d = opendir(journal_room_dir(dir, room).c_str());
+    if (!d)
+        return 0;
+    size_t n = 0;
+    while (struct dirent *e = readdir(d)) {
+        std::string name = e->d_name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".seg") == 0)
+            n++;
+    }
+    closedir(d);
+    return n;
+}
+
+// Seek to time and compare against a model fed everything before it
+static bool seek_matches(JournalReader &reader, const std::vector<Written> &log, uint64_t time)
+{
+    MidiState model;
+    uint32_t expectSeq = 0;
+    size_t i = 0;
+    for (; i < log.size() && log[i].time < time; i++) {
+        model.update(&log[i].body[0], log[i].body.size());
+        expectSeq = log[i].seq;
+    }
+    std::vector<unsigned char> expect, state;
+    model.snapshot(expect);
+
+    uint32_t seq;
+    if (!reader.seek(time, state, seq) || seq != expectSeq || state != expect)
+        return false;
+    JournalEntry entry;
+    if (i == log.size())
+        return !reader.next(entry);
+    return reader.next(entry) && entry.seq == log[i].seq && entry.time == log[i].time &&
+           entry.session == log[i].session && entry.body == log[i].body;
+}
+
+TEST(journal_write_seek_round_trip)
+{
+    std::string dir = test_mkdir();
+    std::vector<Written> log;
+    const uint32_t count = 3 * JOURNAL_CHECKPOINT_RECORDS + 500;
+    {
+        Journal journal(dir);
+        uint32_t id = journal.open("room one", T0);
+        write_range(journal, id, 1, count, log);
+        journal.close(id);
+        CHECK(journal.dropped() == 0);
+    }
+
+    JournalReader reader;
+    CHECK(!reader.open(dir, "elsewhere"));
+    CHECK(reader.open(dir, "room one"));
+
+    // Everything in order from the start
+    std::vector<unsigned char> state;
+    uint32_t seq = 1;
+    CHECK(reader.seek(0, state, seq) && state.empty() && seq == 0);
+    JournalEntry entry;
+    uint32_t expect = 1;
+    bool same = true;
+    while (reader.next(entry)) {
+        const Written &w = log[expect - 1];
+        if (entry.seq != w.seq || entry.time != w.time || entry.session != w.session ||
+                entry.body != w.body)
+            same = false;
+        expect++;
+    }
+    CHECK(same);
+    CHECK(expect == count + 1);
+
+    // On checkpoints, either side of them, between records and past the end
+    bool found = true;
+    uint64_t times[] = {
+        T0, T0 + STEP, T0 + STEP + 1, T0 + 777 * STEP + 500,
+        T0 + (uint64_t)JOURNAL_CHECKPOINT_RECORDS * STEP,
+        T0 + (uint64_t)JOURNAL_CHECKPOINT_RECORDS * STEP + 1,
+        T0 + (uint64_t)(JOURNAL_CHECKPOINT_RECORDS + 1) * STEP,
+        T0 + (uint64_t)(2 * JOURNAL_CHECKPOINT_RECORDS - 1) * STEP,
+        T0 + (uint64_t)count * STEP, T0 + (uint64_t)count * STEP + 1
+    };
+    for (size_t i = 0; i < sizeof times / sizeof times[0]; i++)
+        found = found && seek_matches(reader, log, times[i]);
+    for (uint64_t time = T0; time < T0 + (uint64_t)count * STEP; time += 997 * STEP + 13)
+        found = found && seek_matches(reader, log, time);
+    CHECK(found);
+
+    test_rmdir(dir);
+}
+
+TEST(journal_rolls_over_segments)
+{
+    std::string dir = test_mkdir();
+    std::vector<Written> log;
+    const uint32_t count = JOURNAL_SEGMENT_BYTES / 60000 + 20;
+    {
+        Journal journal(dir);
+        uint32_t id = journal.open("big", T0);
+        // SysEx dumps large enough to fill a segment quickly
+        for (uint32_t seq = 1; seq <= count; seq++) {
+            Written w;
+            w.seq = seq;
+            w.time = T0 + (uint64_t)seq * STEP;
+            w.session = 0;
+            w.body.assign(60000, (unsigned char)(seq & 0x7F));
+            w.body.front() = 0xF0;
+            w.body.back() = 0xF7;
+            journal.append(id, seq, w.time, 0, &w.body[0], w.body.size());
+            log.push_back(w);
+            if (seq % 8 == 0)
+                usleep(20000);
+        }
+        CHECK(journal.dropped() == 0);
+    }
+    CHECK(count_segments(dir, "big") == 2);
+
+    JournalReader reader;
+    CHECK(reader.open(dir, "big"));
+    std::vector<unsigned char> state;
+    uint32_t seq;
+    CHECK(reader.seek(0, state, seq));
+    JournalEntry entry;
+    uint32_t expect = 1;
+    bool same = true;
+    while (reader.next(entry)) {
+        if (entry.seq != expect || entry.body != log[expect - 1].body)
+            same = false;
+        expect++;
+    }
+    CHECK(same);
+    CHECK(expect == count + 1);
+
+    bool found = true;
+    for (uint32_t s = 1; s <= count; s += 9)
+        found = found && seek_matches(reader, log, T0 + (uint64_t)s * STEP);
+    CHECK(found);
+
+    test_rmdir(dir);
+}
+
+TEST(journal_follows_the_writer)
+{
+    std::string dir = test_mkdir();
+    std::vector<Written> log;
+    {
+        Journal journal(dir);
+        uint32_t id = journal.open("live", T0);
+        write_range(journal, id, 1, 100, log);
+        settle();
+
+        JournalReader reader;
+        CHECK(reader.open(dir, "live"));
+        CHECK(seek_matches(reader, log, T0 + 50 * STEP));
+        JournalEntry entry;
+        uint32_t last = 50;
+        while (reader.next(entry))
+            last = entry.seq;
+        CHECK(last == 100);
+
+        // New records show up on later calls, through checkpoints too
+        write_range(journal, id, 101, JOURNAL_CHECKPOINT_RECORDS + 200, log);
+        settle();
+        bool ordered = true;
+        while (reader.next(entry)) {
+            if (entry.seq != last + 1)
+                ordered = false;
+            last = entry.seq;
+        }
+        CHECK(ordered);
+        CHECK(last == JOURNAL_CHECKPOINT_RECORDS + 200);
+        CHECK(seek_matches(reader, log, T0 + (uint64_t)(JOURNAL_CHECKPOINT_RECORDS + 100) * STEP));
+        while (reader.next(entry))
+            last = entry.seq;
+
+        // A journal reopened later starts a new segment after the old ones
+        journal.close(id);
+        id = journal.open("live", T0 + 10000000000ull);
+        std::vector<unsigned char> body(3);
+        body[0] = 0x90; body[1] = 60; body[2] = 1;
+        journal.append(id, 1, T0 + 10000000000ull, 7, &body[0], body.size());
+        settle();
+        CHECK(reader.next(entry) && entry.seq == 1 && entry.session == 7);
+        CHECK(count_segments(dir, "live") == 2);
+    }
+
+    test_rmdir(dir);
+}
@@ -0,0 +1,171 @@
+//*****************************************//
+//  midi_state_test.cpp
+//
+//  MidiState: snapshots recreate the state
+//  they were taken from.
+//
+//*****************************************//
+
+#include "midi_util.h"
+#include "midi_state.h"
+#include "test.h"
+
+static void feed(MidiState &state, const unsigned char *p, size_t n)
+{
+    size_t i = 0;
+    while (i < n) {
+        size_t size = midi_channel_message_size(p[i]);
+        if (size == 0 || i + size > n)
+            break;
+        state.update(p + i, size);
+        i += size;
+    }
+}
+
+static void feed(MidiState &state, const std::vector<unsigned char> &stream)
+{
+    if (!stream.empty())
+        feed(state, &stream[0], stream.size());
+}
+
+static bool contains(const std::vector<unsigned char> &stream, unsigned char a, unsigned char b,
+                     int c = -1)
+{
+    size_t i = 0;
+    while (i < stream.size()) {
+        size_t size = midi_channel_message_size(stream[i]);
+        if (size == 0)
+            return false;
+        if (stream[i] == a && stream[i + 1] == b && (c < 0 || (size == 3 && stream[i + 2] == c)))
+            return true;
+        i += size;
+    }
+    return false;
+}
+
+static const unsigned char performance[] = {
+    0xB0, 0, 1,         // bank select
+    0xC0, 5,            // program
+    0xB0, 7, 100,       // volume
+    0xB0, 10, 30,       // pan
+    0xB0, 1, 64,        // modulation
+    0xE0, 0x10, 0x50,   // pitch bend
+    0xD0, 40,           // channel pressure
+    0x90, 60, 100,
+    0x90, 64, 90,
+    0xA0, 64, 70,       // key pressure on a held note
+    0xA0, 65, 70,       // and on one that isn't: ignored
+    0xB0, 64, 127,      // sustain down
+    0x90, 67, 80,
+    0x80, 67, 0,        // released, still held by the pedal
+    0x91, 36, 110,
+    0x91, 36, 0,        // note on with velocity 0 is a note off
+    0xC9, 10
+};
+
+TEST(midi_state_snapshot_round_trip)
+{
+    MidiState state;
+    feed(state, performance, sizeof performance);
+
+    std::vector<unsigned char> snapshot;
+    state.snapshot(snapshot);
+    MidiState copy;
+    feed(copy, snapshot);
+    std::vector<unsigned char> again;
+    copy.snapshot(again);
+    CHECK(snapshot == again);
+
+    CHECK(contains(snapshot, 0xB0, 0, 1));
+    CHECK(contains(snapshot, 0xC0, 5));
+    CHECK(contains(snapshot, 0xB0, 7, 100));
+    CHECK(contains(snapshot, 0xE0, 0x10, 0x50));
+    CHECK(contains(snapshot, 0xD0, 40));
+    CHECK(contains(snapshot, 0x90, 60, 100));
+    CHECK(contains(snapshot, 0xA0, 64, 70));
+    CHECK(!contains(snapshot, 0xA0, 65));
+    CHECK(contains(snapshot, 0x90, 67, 80));
+    CHECK(contains(snapshot, 0x80, 67));
+    CHECK(!contains(snapshot, 0x91, 36));
+    CHECK(contains(snapshot, 0xC9, 10));
+
+    // Bank select goes ahead of the program change it qualifies
+    CHECK(snapshot.size() >= 5 && snapshot[0] == 0xB0 && snapshot[1] == 0 && snapshot[3] == 0xC0);
+}
+
+TEST(midi_state_settings_leave_out_notes)
+{
+    MidiState state;
+    feed(state, performance, sizeof performance);
+    std::vector<unsigned char> settings;
+    state.settings(settings);
+    CHECK(contains(settings, 0xC0, 5));
+    CHECK(contains(settings, 0xB0, 64, 127));
+    CHECK(!contains(settings, 0x90, 60));
+    CHECK(!contains(settings, 0xA0, 64));
+    CHECK(!contains(settings, 0x80, 67));
+}
+
+TEST(midi_state_controllers_skip_ordered)
+{
+    MidiState state;
+    feed(state, performance, sizeof performance);
+    std::vector<unsigned char> controllers;
+    state.controllers(controllers);
+    CHECK(contains(controllers, 0xB0, 7, 100));
+    CHECK(contains(controllers, 0xB0, 1, 64));
+    CHECK(contains(controllers, 0xD0, 40));
+    CHECK(contains(controllers, 0xA0, 64, 70));
+    CHECK(!contains(controllers, 0xB0, 0));
+    CHECK(!contains(controllers, 0xB0, 64));
+    CHECK(!contains(controllers, 0xC0, 5));
+}
+
+TEST(midi_state_notes_off)
+{
+    MidiState state;
+    feed(state, performance, sizeof performance);
+    const unsigned char off[] = { 0xB0, MIDI_CC_ALL_NOTES_OFF, 0 };
+    state.update(off, sizeof off);
+    std::vector<unsigned char> snapshot;
+    state.snapshot(snapshot);
+    CHECK(!contains(snapshot, 0x90, 60));
+    CHECK(!contains(snapshot, 0x90, 67));
+    CHECK(!contains(snapshot, 0xA0, 64));
+    CHECK(contains(snapshot, 0xB0, 7, 100));
+
+    state.reset();
+    CHECK(state.empty());
+}
+
+TEST(midi_state_reset_all_controllers)
+{
+    MidiState state;
+    feed(state, performance, sizeof performance);
+    const unsigned char more[] = { 0xB0, 11, 90, 0xB0, 101, 0, 0xB0, 100, 0, 0xB0, 91, 40 };
+    feed(state, more, sizeof more);
+    const unsigned char reset[] = { 0xB0, MIDI_CC_RESET_ALL, 0 };
+    state.update(reset, sizeof reset);
+
+    std::vector<unsigned char> snapshot;
+    state.snapshot(snapshot);
+    CHECK(!contains(snapshot, 0xB0, 1));
+    CHECK(!contains(snapshot, 0xB0, 11));
+    CHECK(!contains(snapshot, 0xB0, 64));
+    CHECK(!contains(snapshot, 0xB0, 100));
+    CHECK(!contains(snapshot, 0xB0, 101));
+    CHECK(!contains(snapshot, 0xE0, 0x10));
+    CHECK(!contains(snapshot, 0xD0, 40));
+    CHECK(!contains(snapshot, 0xA0, 64));
+
+    // Settings RP-015 leaves alone
+    CHECK(contains(snapshot, 0xB0, 0, 1));
+    CHECK(contains(snapshot, 0xC0, 5));
+    CHECK(contains(snapshot, 0xB0, 7, 100));
+    CHECK(contains(snapshot, 0xB0, 10, 30));
+    CHECK(contains(snapshot, 0xB0, 91, 40));
+
+    // Held keys keep sounding; the pedal no longer holds released ones
+    CHECK(contains(snapshot, 0x90, 60, 100));
+    CHECK(!contains(snapshot, 0x90, 67));
+}
@@ -0,0 +1,83 @@
+//*****************************************//
+//  smf_file_test.cpp
+//
+//  SmfFile: tracks are merged in time order
+//  through the tempo map.
+//
+//*****************************************//
+
+#include <stdio.h>
+#include "smf_file.h"
+#include "test.h"
+
+// Format 1, 96 ticks per quarter: a tempo track going from 120 to 240
+// bpm at tick 192, and a track with a program change, running status,
+// a SysEx and a rest after its last note
+static const unsigned char song[] = {
+    'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 1, 0, 2, 0, 96,
+    'M', 'T', 'r', 'k', 0, 0, 0, 20,
+    0x00, 0xFF, 0x51, 0x03, 0x07, 0xA1, 0x20,
+    0x81, 0x40, 0xFF, 0x51, 0x03, 0x03, 0xD0, 0x90,
+    0x81, 0x40, 0xFF, 0x2F, 0x00,
+    'M', 'T', 'r', 'k', 0, 0, 0, 26,
+    0x00, 0xC0, 0x05,
+    0x00, 0x90, 0x3C, 0x64,
+    0x60, 0x3C, 0x00,
+    0x81, 0x40, 0x90, 0x40, 0x50,
+    0x00, 0xF0, 0x03, 0x7E, 0x7F, 0xF7,
+    0x81, 0x40, 0xFF, 0x2F, 0x00
+};
+
+TEST(smf_file_merges_tracks)
+{
+    std::string dir = test_mkdir();
+    std::string path = dir + "/song.mid";
+    FILE *f = fopen(path.c_str(), "wb");
+    CHECK(f && fwrite(song, 1, sizeof song, f) == sizeof song);
+    if (f)
+        fclose(f);
+
+    SmfFile smf;
+    CHECK(smf.open(path));
+    const std::vector<SmfEvent> &events = smf.events();
+    CHECK(events.size() == 5);
+    if (events.size() == 5) {
+        std::vector<unsigned char> m;
+        smf.message(0, m);
+        CHECK(events[0].time == 0 && m.size() == 2 && m[0] == 0xC0 && m[1] == 5);
+        smf.message(1, m);
+        CHECK(events[1].time == 0 && m.size() == 3 && m[0] == 0x90 && m[2] == 0x64);
+        smf.message(2, m);
+        CHECK(events[2].time == 500000 && m.size() == 3 && m[0] == 0x90 && m[1] == 0x3C && m[2] == 0);
+        smf.message(3, m);
+        CHECK(events[3].time == 1250000 && m.size() == 3 && m[1] == 0x40);
+        smf.message(4, m);
+        CHECK(events[4].time == 1250000 && m.size() == 4 && m[0] == 0xF0 && m[3] == 0xF7);
+    }
+
+    // The second track's End of Track, not its last event
+    CHECK(smf.duration() == 1750000);
+    CHECK(smf.find(0) == 0);
+    CHECK(smf.find(1) == 2);
+    CHECK(smf.find(1000000) == 3);
+    CHECK(smf.find(1750000) == 5);
+
+    smf.close();
+    CHECK(smf.events().empty());
+    test_rmdir(dir);
+}
+
+TEST(smf_file_rejects_other_files)
+{
+    std::string dir = test_mkdir();
+    std::string path = dir + "/not.mid";
+    FILE *f = fopen(path.c_str(), "wb");
+    if (f) {
+        fputs("RIFF this is not a MIDI file", f);
+        fclose(f);
+    }
+    SmfFile smf;
+    CHECK(!smf.open(path));
+    CHECK(!smf.open(dir + "/missing.mid"));
+    test_rmdir(dir);
+}
@@ -0,0 +1,93 @@
+//*****************************************//
+//  spsc_ring_test.cpp
+//
+//  SpscRing: records come out whole and in
+//  order, across the wrap and across threads.
+//
+//*****************************************//
+
+#include <stdint.h>
+#include <thread>
+#include "spsc_ring.h"
+#include "test.h"
+
+TEST(spsc_ring_push_pop)
+{
+    SpscRing ring(64);
+    std::vector<unsigned char> out;
+    CHECK(ring.empty());
+    CHECK(!ring.pop(out));
+
+    const char a[] = "head", b[] = "tail";
+    CHECK(ring.push(a, 4, b, 4));
+    CHECK(ring.push(NULL, 0));
+    CHECK(!ring.empty());
+    CHECK(ring.pop(out) && out.size() == 8 && !memcmp(&out[0], "headtail", 8));
+    CHECK(ring.pop(out) && out.empty());
+    CHECK(!ring.pop(out));
+}
+
+TEST(spsc_ring_full_and_wrap)
+{
+    SpscRing ring(64);
+    unsigned char record[28];
+    std::vector<unsigned char> out;
+
+    // Two 32 byte records fill it exactly
+    memset(record, 1, sizeof record);
+    CHECK(ring.push(record, sizeof record));
+    memset(record, 2, sizeof record);
+    CHECK(ring.push(record, sizeof record));
+    CHECK(!ring.push(record, 1));
+
+    CHECK(ring.pop(out) && out.size() == sizeof record && out[0] == 1);
+    CHECK(ring.pop(out) && out.size() == sizeof record && out[0] == 2);
+
+    // Odd sizes keep moving the records across the end of the buffer
+    bool whole = true;
+    for (int i = 0; i < 100; i++) {
+        size_t n = 13 + i % 11;
+        memset(record, i, n);
+        CHECK(ring.push(record, n));
+        if (!ring.pop(out) || out.size() != n || out[0] != i || out[n - 1] != i)
+            whole = false;
+    }
+    CHECK(whole);
+    CHECK(ring.empty());
+}
+
+TEST(spsc_ring_threads)
+{
+    SpscRing ring(256);
+    const uint32_t count = 200000;
+    std::thread producer([&ring, count]() {
+        for (uint32_t i = 0; i < count; ) {
+            uint32_t record[3] = { i, i * 7, ~i };
+            if (ring.push(record, (i % 3 + 1) * sizeof(uint32_t)))
+                i++;
+            else
+                std::this_thread::yield();
+        }
+    });
+
+    std::vector<unsigned char> out;
+    uint32_t expect = 0;
+    bool ordered = true;
+    while (expect < count) {
+        if (!ring.pop(out)) {
+            std::this_thread::yield();
+            continue;
+        }
+        uint32_t record[3] = { 0, 0, 0 };
+        if (out.size() == (expect % 3 + 1) * sizeof(uint32_t))
+            memcpy(record, &out[0], out.size());
+        else
+            ordered = false;
+        if (record[0] != expect || (out.size() > 4 && record[1] != expect * 7))
+            ordered = false;
+        expect++;
+    }
+    producer.join();
+    CHECK(ordered);
+    CHECK(ring.empty());
+}
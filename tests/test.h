@@ -0,0 +1,45 @@
+/*
+ * test.h
+ *
+ *  Minimal harness for the unit tests under tests/. Each file defines
+ *  its cases with TEST(name) and checks with CHECK(cond); a failed check
+ *  is reported and the case carries on. test_main.cpp runs every case
+ *  and exits non-zero if any check failed.
+ */
+
+#ifndef TEST_H_
+#define TEST_H_
+
+#include <string>
+#include <vector>
+
+typedef void (*TestFunction)();
+
+struct TestCase {
+    const char *name;
+    TestFunction run;
+};
+
+std::vector<TestCase> &test_cases();
+void test_check(bool ok, const char *expr, const char *file, int line);
+
+/* A fresh directory under /tmp, removed with everything in it by test_rmdir() */
+std::string test_mkdir();
+void test_rmdir(const std::string &dir);
+
+struct TestRegistration {
+    TestRegistration(const char *name, TestFunction run)
+    {
+        TestCase t = { name, run };
+        test_cases().push_back(t);
+    }
+};
+
+#define TEST(name) \
+    static void name(); \
+    static TestRegistration name##_registration(#name, name); \
+    static void name()
+
+#define CHECK(cond) test_check((cond), #cond, __FILE__, __LINE__)
+
+#endif /* TEST_H_ */
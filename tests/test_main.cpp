@@ -0,0 +1,79 @@
+//*****************************************//
+//  test_main.cpp
+//
+//  Runs every registered unit test.
+//
+//*****************************************//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "test.h"
+
+static int failures = 0;
+
+std::vector<TestCase> &test_cases()
+{
+    static std::vector<TestCase> cases;
+    return cases;
+}
+
+void test_check(bool ok, const char *expr, const char *file, int line)
+{
+    if (ok)
+        return;
+    fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expr);
+    failures++;
+}
+
+std::string test_mkdir()
+{
+    char path[] = "/tmp/midi-test-XXXXXX";
+    if (!mkdtemp(path)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    return path;
+}
+
+void test_rmdir(const std::string &dir)
+{
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+        return;
+    while (struct dirent *e = readdir(d)) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+            continue;
+        std::string path = dir + "/" + e->d_name;
+        struct stat st;
+        if (lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+            test_rmdir(path);
+        else
+            unlink(path.c_str());
+    }
+    closedir(d);
+    rmdir(dir.c_str());
+}
+
+int main(int argc, char *argv[])
+{
+    // Optional arguments pick cases by name
+    std::vector<TestCase> &cases = test_cases();
+    int run = 0;
+    for (size_t i = 0; i < cases.size(); i++) {
+        bool wanted = argc < 2;
+        for (int a = 1; a < argc; a++)
+            wanted = wanted || !strcmp(argv[a], cases[i].name);
+        if (!wanted)
+            continue;
+        int before = failures;
+        cases[i].run();
+        printf("%-40s %s\n", cases[i].name, failures == before ? "ok" : "FAILED");
+        run++;
+    }
+    printf("%d tests, %d failed checks\n", run, failures);
+    return failures ? 1 : 0;
+}
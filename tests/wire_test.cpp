@@ -0,0 +1,84 @@
+//*****************************************//
+//  wire_test.cpp
+//
+//  Framing: WireReader reassembles frames
+//  however the stream is split, and the
+//  handshake bodies round-trip.
+//
+//*****************************************//
+
+#include "midi_wire.h"
+#include "test.h"
+
+TEST(wire_reader_reassembles)
+{
+    std::vector<unsigned char> stream;
+    const unsigned char note[3] = { 0x90, 60, 100 };
+    std::vector<unsigned char> big(WIRE_MAX_BODY, 0x55);
+    CHECK(wire_encode(stream, FRAME_MIDI, 0, 7, 0xFFFFFFF0u, note, sizeof note));
+    CHECK(wire_encode(stream, FRAME_PING, 0, 0, 1234, NULL, 0));
+    CHECK(wire_encode(stream, FRAME_SYSEX, SYSEX_BEGIN, 0, 0, &big[0], big.size()));
+    big.push_back(0);
+    size_t size = stream.size();
+    CHECK(!wire_encode(stream, FRAME_SYSEX, 0, 0, 0, &big[0], big.size()));
+    CHECK(stream.size() == size);
+
+    // Byte by byte: a frame comes out exactly when its last byte arrives
+    WireReader reader;
+    WireFrame frame;
+    std::vector<WireFrame> frames;
+    for (size_t i = 0; i < stream.size(); i++) {
+        reader.feed(&stream[i], 1);
+        while (reader.next(frame))
+            frames.push_back(frame);
+    }
+    CHECK(reader.pending() == 0);
+    CHECK(frames.size() == 3);
+    if (frames.size() == 3) {
+        CHECK(frames[0].type == FRAME_MIDI && frames[0].seq == 7 && frames[0].time == 0xFFFFFFF0u);
+        CHECK(frames[0].body.size() == 3 && frames[0].body[1] == 60);
+        CHECK(frames[1].type == FRAME_PING && frames[1].time == 1234 && frames[1].body.empty());
+        CHECK(frames[2].flags == SYSEX_BEGIN && frames[2].body.size() == WIRE_MAX_BODY);
+    }
+
+    // All at once
+    WireReader whole;
+    whole.feed(&stream[0], stream.size());
+    int count = 0;
+    while (whole.next(frame))
+        count++;
+    CHECK(count == 3);
+}
+
+TEST(wire_handshake_round_trip)
+{
+    WireHello hello;
+    hello.caps = CAP_SNAPSHOT | CAP_RESUME | CAP_CLOCK;
+    hello.session = 0x12345678;
+    hello.lastSeq = 99;
+    hello.token = 0xFEDCBA9876543210ull;
+    hello.room = "studio-b";
+
+    WireFrame frame;
+    wire_encode_hello(frame, hello);
+    CHECK(frame.type == FRAME_HELLO);
+    WireHello h;
+    CHECK(wire_decode_hello(frame, h));
+    CHECK(h.version == PROTOCOL_VERSION && h.caps == hello.caps && h.session == hello.session);
+    CHECK(h.lastSeq == 99 && h.token == hello.token && h.room == "studio-b");
+
+    frame.body.resize(10);
+    CHECK(!wire_decode_hello(frame, h));
+
+    WireWelcome welcome;
+    welcome.caps = CAP_SYSEX;
+    welcome.session = 42;
+    welcome.clientSeq = 17;
+    welcome.token = 0x0123456789ABCDEFull;
+    wire_encode_welcome(frame, welcome);
+    CHECK(frame.type == FRAME_WELCOME);
+    WireWelcome w;
+    CHECK(wire_decode_welcome(frame, w));
+    CHECK(w.version == PROTOCOL_VERSION && w.caps == CAP_SYSEX && w.session == 42);
+    CHECK(w.clientSeq == 17 && w.token == welcome.token);
+}